@@ -0,0 +1,250 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * alloc_stats.c: Counts heap allocations (make ALLOC_STATS=1). malloc() and
+ *                friends are replaced by wrappers which count every call and
+ *                hand it on to glibc. The locked screen should not allocate
+ *                while it is idle; the counts per frame and per X event show
+ *                where it still does.
+ *
+ *                Allocations made while rendering a frame are attributed to
+ *                i3lock or to the libraries it draws with. cairo, pixman and
+ *                libxcb allocate internally (e.g. cairo creates a pixman image
+ *                for every surface it composites), which i3lock cannot avoid.
+ *                Everything else is i3lock's own: allocations made by its
+ *                code, directly or through libc (strdup(), asprintf(), ...).
+ *                Once warmed up, a frame must not make any of those.
+ *
+ */
+#ifdef ALLOC_STATS
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#include "metrics.h"
+#include "alloc_stats.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* The text of the executable, from the linker. */
+extern char __executable_start[];
+extern char etext[];
+
+/* The wrappers go into their own section, their frames are skipped. */
+#define WRAPPER __attribute__((section("alloc_stats_text"), noinline))
+extern char __start_alloc_stats_text[];
+extern char __stop_alloc_stats_text[];
+
+/* X event types, without the bit for generated events. */
+#define EVENT_TYPES 128
+
+/* Stack frames looked at to attribute an allocation. */
+#define ATTRIBUTION_DEPTH 16
+
+static uint64_t allocations;
+
+/* Allocations of the calling thread, frames and events are counted with
+ * these, so that the startup tasks do not show up in them. */
+static __thread uint64_t thread_allocations;
+static __thread uint64_t thread_own_allocations;
+static __thread bool in_frame;
+static __thread bool attributing;
+
+/* Counts of the frame being rendered, see alloc_frame_begin(). */
+static uint64_t frame_start;
+static uint64_t frame_own_start;
+
+/* Allocations per frame. */
+static histogram_t frame_allocations;
+
+/* Frames after the warm-up: their own and library allocations. */
+static int warm_up_frames = ALLOC_WARMUP_FRAMES;
+static histogram_t steady_own_allocations;
+static histogram_t steady_library_allocations;
+
+/* Allocations while handling X events, by event type. */
+static struct {
+    uint64_t events;
+    uint64_t allocating;
+    uint64_t allocations;
+} events[EVENT_TYPES];
+
+static bool in_alloc_stats(const void *address) {
+    const char *a = address;
+    return a >= __start_alloc_stats_text && a < __stop_alloc_stats_text;
+}
+
+static bool in_executable(const void *address) {
+    const char *a = address;
+    return a >= __executable_start && a < etext;
+}
+
+static bool in_libc(const void *address) {
+    static void *libc_base;
+    Dl_info info;
+
+    if (libc_base == NULL && dladdr((void *)__libc_malloc, &info) != 0)
+        libc_base = info.dli_fbase;
+    return dladdr(address, &info) != 0 && info.dli_fbase == libc_base;
+}
+
+/*
+ * Whether the allocation being made was asked for by i3lock: the innermost
+ * caller outside of libc is i3lock's code rather than a library. A library
+ * function which ends in a tail call to malloc() has no frame of its own
+ * and counts as its caller.
+ *
+ */
+WRAPPER static bool allocated_by_i3lock(void) {
+    void *frames[ATTRIBUTION_DEPTH];
+
+    /* backtrace() allocates when it is first called. */
+    if (attributing)
+        return false;
+    attributing = true;
+    int n = backtrace(frames, ATTRIBUTION_DEPTH);
+    attributing = false;
+
+    for (int i = 0; i < n; i++) {
+        if (in_alloc_stats(frames[i]) || in_libc(frames[i]))
+            continue;
+        return in_executable(frames[i]);
+    }
+    return false;
+}
+
+WRAPPER static void count(void) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    thread_allocations++;
+    if (in_frame && allocated_by_i3lock())
+        thread_own_allocations++;
+}
+
+WRAPPER void *malloc(size_t size) {
+    count();
+    return __libc_malloc(size);
+}
+
+WRAPPER void *calloc(size_t n, size_t size) {
+    count();
+    return __libc_calloc(n, size);
+}
+
+WRAPPER void *realloc(void *ptr, size_t size) {
+    count();
+    return __libc_realloc(ptr, size);
+}
+
+WRAPPER void *memalign(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+WRAPPER void *aligned_alloc(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+WRAPPER int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    count();
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+/* Returns the number of allocations of the calling thread so far. */
+uint64_t alloc_count(void) {
+    return thread_allocations;
+}
+
+/* Starts counting the allocations of a frame, on the calling thread. */
+void alloc_frame_begin(void) {
+    frame_start = thread_allocations;
+    frame_own_start = thread_own_allocations;
+    in_frame = true;
+}
+
+/* Records the allocations of the frame started with alloc_frame_begin(). */
+void alloc_frame_end(void) {
+    uint64_t total = thread_allocations - frame_start;
+    uint64_t own = thread_own_allocations - frame_own_start;
+
+    in_frame = false;
+    histogram_add(&frame_allocations, total);
+    if (warm_up_frames > 0) {
+        warm_up_frames--;
+        return;
+    }
+    histogram_add(&steady_own_allocations, own);
+    histogram_add(&steady_library_allocations, total - own);
+}
+
+/*
+ * The next frames fill caches again (e.g. after the screens or the
+ * configuration changed) and do not count as steady.
+ *
+ */
+void alloc_warm_up(void) {
+    warm_up_frames = ALLOC_WARMUP_FRAMES;
+}
+
+/* Starts over with the steady frames, after a warm-up. */
+void alloc_frames_reset(void) {
+    memset(&steady_own_allocations, 0, sizeof(histogram_t));
+    memset(&steady_library_allocations, 0, sizeof(histogram_t));
+    alloc_warm_up();
+}
+
+/* The most allocations a steady frame made, by i3lock and by libraries. */
+void alloc_steady_max(uint64_t *own, uint64_t *library) {
+    *own = steady_own_allocations.max;
+    *library = steady_library_allocations.max;
+}
+
+/* Called after every X event with the allocations handling it took. */
+void alloc_event_done(int type, uint64_t n) {
+    if (type < 0 || type >= EVENT_TYPES)
+        return;
+    events[type].events++;
+    events[type].allocations += n;
+    if (n > 0)
+        events[type].allocating++;
+}
+
+void alloc_stats_dump(FILE *out) {
+    const histogram_t *own = &steady_own_allocations;
+    const histogram_t *library = &steady_library_allocations;
+
+    fprintf(out, "# i3lock allocations\n");
+    fprintf(out, "%-12s %llu\n", "total", (unsigned long long)allocations);
+    fprintf(out, "%-12s count %-8llu allocating %-8llu max %llu\n", "frames",
+            (unsigned long long)frame_allocations.count,
+            (unsigned long long)(frame_allocations.count - frame_allocations.buckets[0]),
+            (unsigned long long)frame_allocations.max);
+    fprintf(out, "%-12s count %-8llu own allocating %-8llu own max %-8llu library max %llu\n",
+            "steady",
+            (unsigned long long)own->count,
+            (unsigned long long)(own->count - own->buckets[0]),
+            (unsigned long long)own->max,
+            (unsigned long long)library->max);
+    for (int type = 0; type < EVENT_TYPES; type++) {
+        if (events[type].events == 0)
+            continue;
+        fprintf(out, "event %-6d count %-8llu allocating %-8llu allocations %llu\n", type,
+                (unsigned long long)events[type].events,
+                (unsigned long long)events[type].allocating,
+                (unsigned long long)events[type].allocations);
+    }
+    fflush(out);
+}
+#endif
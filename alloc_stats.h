@@ -0,0 +1,40 @@
+#ifndef _ALLOC_STATS_H
+#define _ALLOC_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Frames which fill caches (the first ones, and the ones after the screens
+ * or the configuration changed) before the allocations of a frame count as
+ * steady.
+ */
+#define ALLOC_WARMUP_FRAMES 3
+
+/*
+ * Allocation accounting, only built with ALLOC_STATS (make ALLOC_STATS=1).
+ * Every malloc(), calloc(), realloc() and aligned allocation of the process
+ * is counted, and the counts are attributed to frames and to X events.
+ * Without ALLOC_STATS, all of this compiles to nothing.
+ */
+#ifdef ALLOC_STATS
+uint64_t alloc_count(void);
+void alloc_frame_begin(void);
+void alloc_frame_end(void);
+void alloc_warm_up(void);
+void alloc_frames_reset(void);
+void alloc_steady_max(uint64_t *own, uint64_t *library);
+void alloc_event_done(int type, uint64_t allocations);
+void alloc_stats_dump(FILE *out);
+#else
+static inline uint64_t alloc_count(void) { return 0; }
+static inline void alloc_frame_begin(void) {}
+static inline void alloc_frame_end(void) {}
+static inline void alloc_warm_up(void) {}
+static inline void alloc_frames_reset(void) {}
+static inline void alloc_steady_max(uint64_t *own, uint64_t *library) { *own = *library = 0; }
+static inline void alloc_event_done(int type, uint64_t allocations) {}
+static inline void alloc_stats_dump(FILE *out) {}
+#endif
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * bench.c: Rendering benchmark (i3lock --bench, make bench). Renders scripted
+ *          scenarios into in-memory image surfaces for a matrix of screen
+ *          layouts and backgrounds and prints min/median/p99 per render
+ *          stage as JSON on stdout.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "settings.h"
+#include "xinerama.h"
+#include "unlock_indicator.h"
+#include "metrics.h"
+#include "bench.h"
+#include "tinyexpr.h"
+#include "layout.h"
+#include "alloc_stats.h"
+
+extern unlock_state_t unlock_state;
+extern auth_state_t auth_state;
+extern int input_position;
+extern int failed_attempts;
+extern cairo_surface_t *img;
+
+enum {
+    STAGE_BACKGROUND = 0,
+    STAGE_RING,
+    STAGE_STATUS,
+    STAGE_KEYBOARD,
+    STAGE_CLOCK,
+    STAGE_COMPOSITE,
+    STAGE_UPLOAD,
+    STAGE_TOTAL,
+    STAGES
+};
+
+static const char *stage_names[STAGES] = {
+    "background", "ring", "status", "keyboard", "clock", "composite", "upload", "total"
+};
+
+typedef enum {
+    SCENARIO_IDLE_CLOCK = 0,
+    SCENARIO_KEYPRESS_BURST,
+    SCENARIO_WRONG_PASSWORD,
+    SCENARIO_RESIZE,
+    SCENARIOS
+} scenario_t;
+
+static const char *scenario_names[SCENARIOS] = {
+    "idle-clock", "keypress-burst", "wrong-password", "resize"
+};
+
+typedef enum {
+    BACKGROUND_SOLID = 0,
+    BACKGROUND_IMAGE,
+    BACKGROUND_TILED,
+    BACKGROUNDS
+} background_t;
+
+static const char *background_names[BACKGROUNDS] = {
+    "solid", "image", "tiled"
+};
+
+static const struct {
+    const char *name;
+    uint16_t width;
+    uint16_t height;
+} monitor_sizes[] = {
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+};
+
+static const int monitor_counts[] = {1, 3, 6};
+
+/* Size of the image used for the tiled background. */
+#define TILE_SIZE 256
+
+/* Monitors per row of the synthetic layout. */
+#define MONITORS_PER_ROW 3
+
+typedef struct bench_case {
+    scenario_t scenario;
+    int monitors;
+    int size;
+    background_t background;
+    bool snap;
+    /* Whether the indicator is placed off the pixel grid. */
+    bool fractional;
+} bench_case_t;
+
+/*
+ * Sets up xr_resolutions with the given number of monitors, in rows of
+ * MONITORS_PER_ROW, and stores the size of the whole area in resolution. With
+ * rotate set, every monitor is in portrait orientation.
+ *
+ */
+static void set_layout(int monitors, uint16_t width, uint16_t height, bool rotate,
+                       uint32_t *resolution) {
+    if (rotate) {
+        uint16_t tmp = width;
+        width = height;
+        height = tmp;
+    }
+
+    free(xr_resolutions);
+    xr_resolutions = calloc(monitors, sizeof(Rect));
+    xr_screens = monitors;
+
+    resolution[0] = resolution[1] = 0;
+    for (int i = 0; i < monitors; i++) {
+        Rect *rect = &xr_resolutions[i];
+        rect->x = (i % MONITORS_PER_ROW) * width;
+        rect->y = (i / MONITORS_PER_ROW) * height;
+        rect->width = width;
+        rect->height = height;
+        if ((uint32_t)(rect->x + width) > resolution[0])
+            resolution[0] = rect->x + width;
+        if ((uint32_t)(rect->y + height) > resolution[1])
+            resolution[1] = rect->y + height;
+    }
+}
+
+/* Creates a synthetic background image (a gradient) of the given size. */
+static cairo_surface_t *create_image(int width, int height) {
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    cairo_t *ctx = cairo_create(surface);
+    cairo_pattern_t *pattern = cairo_pattern_create_linear(0, 0, width, height);
+    cairo_pattern_add_color_stop_rgb(pattern, 0, 0.1, 0.2, 0.4);
+    cairo_pattern_add_color_stop_rgb(pattern, 1, 0.8, 0.4, 0.1);
+    cairo_set_source(ctx, pattern);
+    cairo_paint(ctx);
+    cairo_pattern_destroy(pattern);
+    cairo_destroy(ctx);
+    return surface;
+}
+
+/* Puts i3lock into the state of the given frame of the scenario. */
+static void set_scenario_state(scenario_t scenario, int frame, time_t *now) {
+    unlock_state = STATE_STARTED;
+    auth_state = STATE_AUTH_IDLE;
+
+    switch (scenario) {
+        case SCENARIO_IDLE_CLOCK:
+            /* Every frame is the next clock tick. */
+            *now += 1;
+            break;
+        case SCENARIO_KEYPRESS_BURST:
+            unlock_state = (frame % 5 == 4 ? STATE_BACKSPACE_ACTIVE : STATE_KEY_ACTIVE);
+            input_position = frame % 32 + 1;
+            break;
+        case SCENARIO_WRONG_PASSWORD:
+            unlock_state = STATE_KEY_PRESSED;
+            auth_state = (frame % 2 == 0 ? STATE_AUTH_WRONG : STATE_AUTH_IDLE);
+            failed_attempts = frame / 2 + 1;
+            break;
+        case SCENARIO_RESIZE:
+        case SCENARIOS:
+            break;
+    }
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Runs one case of the matrix for the given number of frames and prints its
+ * result as a JSON object. Returns false if this is the idle clock scenario
+ * and i3lock's own code allocated memory in a measured frame (only counted
+ * with ALLOC_STATS, see alloc_stats.c).
+ *
+ */
+static bool run_case(const bench_case_t *bc, int frames, bool first) {
+    uint64_t *samples = calloc((size_t)frames * STAGES, sizeof(uint64_t));
+    uint32_t resolution[2];
+    uint16_t width = monitor_sizes[bc->size].width;
+    uint16_t height = monitor_sizes[bc->size].height;
+
+    set_layout(bc->monitors, width, height, false, resolution);
+
+    img = NULL;
+    tile = 0;
+    if (bc->background == BACKGROUND_IMAGE) {
+        img = create_image(resolution[0], resolution[1]);
+    } else if (bc->background == BACKGROUND_TILED) {
+        img = create_image(TILE_SIZE, TILE_SIZE);
+        tile = 1;
+    }
+
+    snap_unlock = snap_time = snap_date = snap_keyboard = bc->snap;
+
+    cairo_surface_t *target = cairo_image_surface_create(
+        CAIRO_FORMAT_RGB24, resolution[0], resolution[1]);
+    cairo_t *ctx = cairo_create(target);
+    /* Frames repaint what changed since the previous one. */
+    render_target_t damage = {0};
+    /* Stands in for the X server side of the upload. */
+    cairo_surface_t *server = NULL;
+    cairo_t *server_ctx = NULL;
+
+    render_timings_t timings;
+    render_timings = &timings;
+
+    time_t now = 0;
+    /* The first frames fill the widget, font and layout caches and are not
+     * measured. */
+    alloc_frames_reset();
+    for (int frame = -ALLOC_WARMUP_FRAMES; frame < frames; frame++) {
+        uint64_t start = now_usec();
+
+        if (bc->scenario == SCENARIO_RESIZE) {
+            set_layout(bc->monitors, width, height, frame % 2 != 0, resolution);
+            cairo_destroy(ctx);
+            cairo_surface_destroy(target);
+            target = cairo_image_surface_create(CAIRO_FORMAT_RGB24, resolution[0], resolution[1]);
+            ctx = cairo_create(target);
+            damage = (render_target_t){0};
+        }
+        if (server == NULL ||
+            cairo_image_surface_get_width(server) != (int)resolution[0] ||
+            cairo_image_surface_get_height(server) != (int)resolution[1]) {
+            if (server != NULL) {
+                cairo_destroy(server_ctx);
+                cairo_surface_destroy(server);
+            }
+            server = cairo_image_surface_create(CAIRO_FORMAT_RGB24, resolution[0], resolution[1]);
+            server_ctx = cairo_create(server);
+        }
+
+        set_scenario_state(bc->scenario, frame < 0 ? 0 : frame, &now);
+        /* Counted like a frame of redraw_screen(), the upload included. */
+        alloc_frame_begin();
+        render_frame(ctx, &damage, resolution, "US", false, now);
+        cairo_surface_flush(target);
+
+        uint64_t upload_start = now_usec();
+        cairo_set_source_surface(server_ctx, target, 0, 0);
+        cairo_paint(server_ctx);
+        cairo_surface_flush(server);
+        alloc_frame_end();
+        uint64_t end = now_usec();
+
+        if (frame < 0)
+            continue;
+
+        uint64_t *sample = &samples[(size_t)frame * STAGES];
+        sample[STAGE_BACKGROUND] = timings.background;
+        sample[STAGE_RING] = timings.ring;
+        sample[STAGE_STATUS] = timings.status;
+        sample[STAGE_KEYBOARD] = timings.keyboard;
+        sample[STAGE_CLOCK] = timings.clock;
+        sample[STAGE_COMPOSITE] = timings.composite;
+        sample[STAGE_UPLOAD] = end - upload_start;
+        sample[STAGE_TOTAL] = end - start;
+    }
+    render_timings = NULL;
+
+    printf("%s    {\"scenario\": \"%s\", \"monitors\": %d, \"monitor_size\": \"%s\", "
+           "\"background\": \"%s\", \"snap_to_pixel\": %s, \"fractional_origin\": %s, "
+           "\"frames\": %d, \"stages\": {",
+           first ? "" : ",\n",
+           scenario_names[bc->scenario], bc->monitors, monitor_sizes[bc->size].name,
+           background_names[bc->background], bc->snap ? "true" : "false",
+           bc->fractional ? "true" : "false", frames);
+
+    uint64_t *values = calloc(frames, sizeof(uint64_t));
+    for (int stage = 0; stage < STAGES; stage++) {
+        for (int frame = 0; frame < frames; frame++)
+            values[frame] = samples[(size_t)frame * STAGES + stage];
+        qsort(values, frames, sizeof(uint64_t), compare_samples);
+
+        int p99 = (frames * 99 + 99) / 100 - 1;
+        printf("%s\"%s\": {\"min\": %llu, \"median\": %llu, \"p99\": %llu}",
+               stage == 0 ? "" : ", ", stage_names[stage],
+               (unsigned long long)values[0],
+               (unsigned long long)values[frames / 2],
+               (unsigned long long)values[p99]);
+    }
+    printf("}");
+    uint64_t own_allocations, library_allocations;
+    alloc_steady_max(&own_allocations, &library_allocations);
+#ifdef ALLOC_STATS
+    printf(", \"allocations\": {\"own_max\": %llu, \"library_max\": %llu}",
+           (unsigned long long)own_allocations, (unsigned long long)library_allocations);
+#endif
+    printf("}");
+    fflush(stdout);
+
+    free(values);
+    free(samples);
+    cairo_destroy(server_ctx);
+    cairo_surface_destroy(server);
+    cairo_destroy(ctx);
+    cairo_surface_destroy(target);
+    if (img != NULL) {
+        cairo_surface_destroy(img);
+        img = NULL;
+    }
+
+    return bc->scenario != SCENARIO_IDLE_CLOCK || own_allocations == 0;
+}
+
+/* Evaluations per expression in the expression benchmark. */
+#define EXPR_EVALUATIONS 1000000
+
+/* The default position expressions and some from real configurations. */
+static const char *bench_exprs[] = {
+    "x + (w / 2)",
+    "ix - (cw / 2)",
+    "ty+30",
+    "iy - 150 - (ch / 2)",
+    "y + 150 + (h / 2)",
+    "x + w - r - 40",
+};
+
+/*
+ * Times the evaluation of the position expressions with te_eval() (walking
+ * the expression tree) and with te_run() (running the flattened bytecode,
+ * with cw, ch and r folded as they are constant per configuration). Prints
+ * the nanoseconds per evaluation as a JSON array.
+ *
+ */
+static void run_expr_bench(void) {
+    double w = 1920, h = 1080, x = 0, y = 0, ix = 960, iy = 540, tx = 960, ty = 540;
+    double cw = CLOCK_WIDTH, ch = CLOCK_HEIGHT, r = circle_radius;
+    te_variable vars[] = {
+        {"w", &w}, {"h", &h},
+        {"x", &x}, {"y", &y},
+        {"ix", &ix}, {"iy", &iy},
+        {"tx", &tx}, {"ty", &ty},
+        {"cw", &cw}, {"ch", &ch},
+        {"r", &r}
+    };
+    const double *constants[] = {&cw, &ch, &r};
+    volatile double sink = 0;
+
+    for (size_t i = 0; i < sizeof(bench_exprs) / sizeof(bench_exprs[0]); i++) {
+        int error;
+        te_expr *expr = te_compile(bench_exprs[i], vars, 11, &error);
+        te_program *program = te_flatten(expr, constants, 3);
+        if (program == NULL) {
+            fprintf(stderr, "Could not compile \"%s\"\n", bench_exprs[i]);
+            te_free(expr);
+            continue;
+        }
+
+        uint64_t start = now_usec();
+        for (int n = 0; n < EXPR_EVALUATIONS; n++) {
+            x = n & 7;
+            sink += te_eval(expr);
+        }
+        uint64_t tree = now_usec() - start;
+
+        start = now_usec();
+        for (int n = 0; n < EXPR_EVALUATIONS; n++) {
+            x = n & 7;
+            sink += te_run(program);
+        }
+        uint64_t bytecode = now_usec() - start;
+
+        printf("%s    {\"expr\": \"%s\", \"tree_ns\": %.1f, \"bytecode_ns\": %.1f}",
+               i == 0 ? "" : ",\n", bench_exprs[i],
+               tree * 1000.0 / EXPR_EVALUATIONS, bytecode * 1000.0 / EXPR_EVALUATIONS);
+        fflush(stdout);
+
+        te_program_free(program);
+        te_free(expr);
+    }
+    (void)sink;
+}
+
+/*
+ * Runs all scenarios for every layout and background, rendering the given
+ * number of frames each. The settings are the built-in defaults (no config
+ * file is read), with the clock enabled, so results stay comparable.
+ *
+ * All times in the output are in microseconds.
+ *
+ */
+int run_bench(int frames) {
+    if (frames < 1) {
+        fprintf(stderr, "Invalid number of benchmark frames: %d\n", frames);
+        return EXIT_FAILURE;
+    }
+
+    show_clock = 1;
+
+    printf("{\n  \"version\": \"%s\",\n  \"unit\": \"usec\",\n  \"results\": [\n", VERSION);
+
+    bool first = true;
+    bool idle_without_allocations = true;
+    bench_case_t bc = {0};
+    for (bc.scenario = 0; bc.scenario < SCENARIOS; bc.scenario++) {
+        for (bc.size = 0; bc.size < (int)(sizeof(monitor_sizes) / sizeof(monitor_sizes[0])); bc.size++) {
+            for (size_t m = 0; m < sizeof(monitor_counts) / sizeof(monitor_counts[0]); m++) {
+                bc.monitors = monitor_counts[m];
+                for (bc.background = 0; bc.background < BACKGROUNDS; bc.background++) {
+                    bc.snap = true;
+                    if (!run_case(&bc, frames, first))
+                        idle_without_allocations = false;
+                    first = false;
+                }
+            }
+        }
+    }
+
+    /*
+     * Pixel snapping only matters for widgets at fractional positions, so
+     * compare it with the indicator moved off the pixel grid.
+     */
+    strcpy(unlock_x_expr, "x + (w / 2) + 0.37");
+    strcpy(unlock_y_expr, "y + (h / 2) + 0.37");
+    bc.size = 1;
+    bc.monitors = 1;
+    bc.background = BACKGROUND_SOLID;
+    bc.fractional = true;
+    for (bc.scenario = 0; bc.scenario < SCENARIOS; bc.scenario++) {
+        for (int snap = 1; snap >= 0; snap--) {
+            bc.snap = snap;
+            if (!run_case(&bc, frames, false))
+                idle_without_allocations = false;
+        }
+    }
+
+    printf("\n  ],\n  \"expressions\": [\n");
+    run_expr_bench();
+
+    printf("\n  ]\n}\n");
+
+    if (!idle_without_allocations) {
+        fprintf(stderr, "Frames of the idle-clock scenario allocated memory in i3lock\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,9 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/* Frames rendered per benchmark case if not given. */
+#define BENCH_DEFAULT_FRAMES 50
+
+int run_bench(int frames);
+
+#endif
@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# End-to-end lock latency benchmark (make bench-e2e).
+#
+# Starts a private Xvfb with two fake Xinerama screens and measures
+# bench/i3lock-e2e with bench/xlatency, once with a PAM service accepting
+# every password and once with one rejecting every password. Needs no
+# network and no system PAM configuration (see bench/pam.d).
+#
+# Environment: RUNS (default 10), KEYS (keypresses per run, default 10),
+# SCREENS (Xvfb -screen arguments, default two 1920x1080 screens).
+#
+# With make ALLOC_STATS=1 bench-e2e, the idle lock screen with a ticking
+# clock is checked as well: once warmed up, no frame may allocate in i3lock's
+# own code (see alloc_stats.c). IDLE sets how many seconds it ticks
+# (default 5).
+#
+set -eu
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+RUNS=${RUNS:-10}
+KEYS=${KEYS:-10}
+SCREENS=${SCREENS:-"-screen 0 1920x1080x24 -screen 1 1920x1080x24"}
+
+TMP_DIR=$(mktemp -d)
+XVFB_PID=
+cleanup() {
+	[ -n "$XVFB_PID" ] && kill "$XVFB_PID" 2>/dev/null
+	rm -rf "$TMP_DIR"
+}
+trap cleanup EXIT INT TERM
+
+# Xvfb writes the display number it picked once it is ready.
+# shellcheck disable=SC2086
+Xvfb -displayfd 3 -nolisten tcp -noreset +xinerama $SCREENS \
+	3>"$TMP_DIR/display" 2>"$TMP_DIR/xvfb.log" &
+XVFB_PID=$!
+
+tries=0
+while [ ! -s "$TMP_DIR/display" ]; do
+	tries=$((tries + 1))
+	if [ $tries -gt 100 ] || ! kill -0 "$XVFB_PID" 2>/dev/null; then
+		echo "Xvfb did not start:" >&2
+		cat "$TMP_DIR/xvfb.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+DISPLAY=:$(cat "$TMP_DIR/display")
+export DISPLAY
+
+I3LOCK="$BENCH_DIR/i3lock-e2e --nofork --config=$BENCH_DIR/config.ini"
+
+printf '{\n"permit": '
+I3LOCK_PAM_SERVICE=i3lock \
+	"$BENCH_DIR/xlatency" -r "$RUNS" -k "$KEYS" -- $I3LOCK
+printf ',\n"deny": '
+I3LOCK_PAM_SERVICE=i3lock-deny \
+	"$BENCH_DIR/xlatency" -r "$RUNS" -k "$KEYS" -d -- $I3LOCK
+
+if [ -z "${ALLOC_STATS:-}" ]; then
+	printf '}\n'
+	exit 0
+fi
+
+# The fixed configuration, with the clock and the statistics file.
+sed -e 's/^show_clock.*/show_clock = 1/' \
+	-e "s|^\\[i3lock\\]\$|[i3lock]\\nstats_file = $TMP_DIR/stats|" \
+	"$BENCH_DIR/config.ini" >"$TMP_DIR/idle.ini"
+I3LOCK_PAM_SERVICE=i3lock \
+	"$BENCH_DIR/i3lock-e2e" --nofork --config="$TMP_DIR/idle.ini" &
+I3LOCK_PID=$!
+sleep "${IDLE:-5}"
+kill -USR1 "$I3LOCK_PID"
+sleep 0.5
+kill "$I3LOCK_PID"
+wait "$I3LOCK_PID" || true
+
+# steady count N own allocating N own max N library max N
+set -- $(grep '^steady' "$TMP_DIR/stats" 2>/dev/null)
+if [ $# -ne 12 ] || [ "$3" -eq 0 ]; then
+	echo "No steady frames counted, was i3lock-e2e built with ALLOC_STATS=1?" >&2
+	exit 1
+fi
+printf ',\n"idle_allocations": {"frames": %s, "own_max": %s, "library_max": %s}\n}\n' \
+	"$3" "$9" "${12}"
+if [ "$9" -ne 0 ]; then
+	echo "Idle frames allocated memory in i3lock's own code" >&2
+	exit 1
+fi
@@ -0,0 +1,431 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * xlatency.c: Measures the latency of i3lock as seen by another X11 client.
+ *             Used by the end-to-end benchmark (see e2e.sh).
+ *
+ * Usage: xlatency [-r runs] [-k keys] [-d] -- command [arguments...]
+ *
+ * For every run, the command (i3lock, started with --nofork) is executed and
+ * the following is measured:
+ *   exec_to_map:    exec until the lock window is mapped
+ *   exec_to_grab:   exec until the keyboard is grabbed
+ *   key_to_frame:   XTest keypress until the lock window is damaged
+ *   enter_to_exit:  XTest Return until the command exits (-d not given)
+ *   enter_to_frame: XTest Return until the lock window is damaged, the
+ *                   command is terminated afterwards (-d given, for a PAM
+ *                   service which rejects every password)
+ *
+ * Once the lock screen is idle, the memory use of the command and its child
+ * processes is measured as well:
+ *   processes:      number of processes (the command and its children)
+ *   rss_kb:         sum of their resident set sizes
+ *   pss_kb:         sum of their proportional set sizes, which counts pages
+ *                   shared between the processes only once
+ *
+ * The results (in microseconds, unless noted otherwise) are printed as JSON
+ * on stdout.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <err.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <xcb/damage.h>
+
+#define MAX_RUNS 1000
+#define MAX_KEYS 100
+
+/* Give up waiting for i3lock after this long. */
+#define TIMEOUT_USEC 5000000
+
+/* The window counts as idle after not being damaged for this long. */
+#define QUIET_USEC 200000
+
+#define XK_a 0x0061
+#define XK_Return 0xff0d
+
+typedef struct samples {
+    const char *name;
+    int count;
+    uint64_t values[MAX_RUNS * MAX_KEYS];
+} samples_t;
+
+static samples_t exec_to_map = {"exec_to_map"};
+static samples_t exec_to_grab = {"exec_to_grab"};
+static samples_t key_to_frame = {"key_to_frame"};
+static samples_t enter_to_exit = {"enter_to_exit"};
+static samples_t enter_to_frame = {"enter_to_frame"};
+static samples_t processes = {"processes"};
+static samples_t rss_kb = {"rss_kb"};
+static samples_t pss_kb = {"pss_kb"};
+
+static xcb_connection_t *conn;
+static xcb_screen_t *screen;
+static uint8_t damage_event;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_sample(samples_t *samples, uint64_t value) {
+    if (samples->count < MAX_RUNS * MAX_KEYS)
+        samples->values[samples->count++] = value;
+}
+
+/*
+ * Returns the next event, or NULL if there was none until the given
+ * (absolute) deadline.
+ *
+ */
+static xcb_generic_event_t *wait_for_event(uint64_t deadline) {
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(conn)) == NULL) {
+        if (xcb_connection_has_error(conn))
+            errx(EXIT_FAILURE, "X11 connection broke");
+
+        uint64_t now = now_usec();
+        if (now >= deadline)
+            return NULL;
+
+        struct pollfd pfd = {xcb_get_file_descriptor(conn), POLLIN, 0};
+        poll(&pfd, 1, (deadline - now + 999) / 1000);
+    }
+    return event;
+}
+
+/* Waits until the server processed all requests sent so far. */
+static void sync_with_server(void) {
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+}
+
+static xcb_keycode_t keysym_to_keycode(xcb_keysym_t keysym) {
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+    int count = setup->max_keycode - setup->min_keycode + 1;
+    xcb_get_keyboard_mapping_reply_t *reply = xcb_get_keyboard_mapping_reply(
+        conn, xcb_get_keyboard_mapping(conn, setup->min_keycode, count), NULL);
+    if (reply == NULL)
+        errx(EXIT_FAILURE, "Could not get the keyboard mapping");
+
+    xcb_keysym_t *keysyms = xcb_get_keyboard_mapping_keysyms(reply);
+    xcb_keycode_t keycode = 0;
+    for (int i = 0; i < count * reply->keysyms_per_keycode && keycode == 0; i++)
+        if (keysyms[i] == keysym)
+            keycode = setup->min_keycode + i / reply->keysyms_per_keycode;
+
+    free(reply);
+    if (keycode == 0)
+        errx(EXIT_FAILURE, "No keycode for keysym 0x%x", keysym);
+    return keycode;
+}
+
+static void press_key(xcb_keycode_t keycode) {
+    xcb_test_fake_input(conn, XCB_KEY_PRESS, keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_test_fake_input(conn, XCB_KEY_RELEASE, keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_flush(conn);
+}
+
+/* Waits for the command's (override redirect) window to be mapped. */
+static xcb_window_t wait_for_map(pid_t pid, uint64_t deadline) {
+    xcb_generic_event_t *event;
+    while ((event = wait_for_event(deadline)) != NULL) {
+        int type = event->response_type & 0x7F;
+        if (type == XCB_MAP_NOTIFY) {
+            xcb_map_notify_event_t *map = (xcb_map_notify_event_t *)event;
+            if (map->override_redirect) {
+                xcb_window_t window = map->window;
+                free(event);
+                return window;
+            }
+        }
+        free(event);
+    }
+
+    kill(pid, SIGTERM);
+    errx(EXIT_FAILURE, "The lock window was not mapped");
+}
+
+/*
+ * Waits for somebody else to hold the keyboard grab. Our own grab is
+ * released in the same batch of requests, so it is only held for the time
+ * the server needs to process the two requests.
+ *
+ */
+static void wait_for_grab(pid_t pid, uint64_t deadline) {
+    while (now_usec() < deadline) {
+        xcb_grab_keyboard_cookie_t cookie = xcb_grab_keyboard(
+            conn, false, screen->root, XCB_CURRENT_TIME,
+            XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+        xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+
+        xcb_grab_keyboard_reply_t *reply = xcb_grab_keyboard_reply(conn, cookie, NULL);
+        bool grabbed = reply && reply->status == XCB_GRAB_STATUS_ALREADY_GRABBED;
+        free(reply);
+        if (grabbed)
+            return;
+        usleep(200);
+    }
+
+    kill(pid, SIGTERM);
+    errx(EXIT_FAILURE, "The keyboard was not grabbed");
+}
+
+/*
+ * Waits for the next DamageNotify. Returns false if there was none until the
+ * deadline.
+ *
+ */
+static bool wait_for_damage(xcb_damage_damage_t damage, uint64_t deadline) {
+    xcb_generic_event_t *event;
+    while ((event = wait_for_event(deadline)) != NULL) {
+        bool damaged = (event->response_type & 0x7F) == damage_event + XCB_DAMAGE_NOTIFY;
+        free(event);
+        if (damaged) {
+            xcb_damage_subtract(conn, damage, XCB_NONE, XCB_NONE);
+            xcb_flush(conn);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Waits until the window was not damaged for QUIET_USEC. */
+static void wait_for_quiet(xcb_damage_damage_t damage) {
+    xcb_damage_subtract(conn, damage, XCB_NONE, XCB_NONE);
+    xcb_flush(conn);
+    while (wait_for_damage(damage, now_usec() + QUIET_USEC))
+        ;
+}
+
+/*
+ * Returns the value (in kB) of the given field of a /proc file like
+ * /proc/<pid>/status, or 0 if it cannot be read.
+ *
+ */
+static uint64_t read_proc_kb(pid_t pid, const char *file, const char *field) {
+    char path[64];
+    char line[256];
+    uint64_t value = 0;
+    size_t length = strlen(field);
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, length) == 0 && line[length] == ':') {
+            value = strtoull(line + length + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+/* Returns the parent of the given process, or -1 if it is gone. */
+static pid_t parent_of(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char line[256];
+    pid_t ppid = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "PPid:", 5) == 0) {
+            ppid = atoi(line + 5);
+            break;
+        }
+    }
+    fclose(f);
+    return ppid;
+}
+
+/*
+ * Records the number of processes and the memory used by the command and its
+ * (direct) children.
+ *
+ */
+static void measure_memory(pid_t pid) {
+    uint64_t count = 1;
+    uint64_t rss = read_proc_kb(pid, "status", "VmRSS");
+    uint64_t pss = read_proc_kb(pid, "smaps_rollup", "Pss");
+
+    DIR *dir = opendir("/proc");
+    if (dir == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        pid_t child = atoi(entry->d_name);
+        if (child <= 0 || parent_of(child) != pid)
+            continue;
+        count++;
+        rss += read_proc_kb(child, "status", "VmRSS");
+        pss += read_proc_kb(child, "smaps_rollup", "Pss");
+    }
+    closedir(dir);
+
+    add_sample(&processes, count);
+    add_sample(&rss_kb, rss);
+    add_sample(&pss_kb, pss);
+}
+
+static bool wait_for_exit(pid_t pid, uint64_t deadline) {
+    while (now_usec() < deadline) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return true;
+        usleep(100);
+    }
+    return false;
+}
+
+static void run(char **command, int keys, bool deny) {
+    uint64_t start = now_usec();
+    pid_t pid = fork();
+    if (pid == -1)
+        err(EXIT_FAILURE, "fork");
+    if (pid == 0) {
+        execvp(command[0], command);
+        err(EXIT_FAILURE, "Could not execute %s", command[0]);
+    }
+
+    xcb_window_t window = wait_for_map(pid, start + TIMEOUT_USEC);
+    add_sample(&exec_to_map, now_usec() - start);
+
+    wait_for_grab(pid, start + TIMEOUT_USEC);
+    add_sample(&exec_to_grab, now_usec() - start);
+
+    xcb_damage_damage_t damage = xcb_generate_id(conn);
+    xcb_damage_create(conn, damage, window, XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+    wait_for_quiet(damage);
+    measure_memory(pid);
+
+    xcb_keycode_t key_a = keysym_to_keycode(XK_a);
+    xcb_keycode_t key_return = keysym_to_keycode(XK_Return);
+
+    for (int i = 0; i < keys; i++) {
+        sync_with_server();
+        uint64_t pressed = now_usec();
+        press_key(key_a);
+        if (wait_for_damage(damage, pressed + TIMEOUT_USEC))
+            add_sample(&key_to_frame, now_usec() - pressed);
+        wait_for_quiet(damage);
+    }
+
+    sync_with_server();
+    uint64_t entered = now_usec();
+    press_key(key_return);
+    if (deny) {
+        if (wait_for_damage(damage, entered + TIMEOUT_USEC))
+            add_sample(&enter_to_frame, now_usec() - entered);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    } else {
+        if (wait_for_exit(pid, entered + TIMEOUT_USEC)) {
+            add_sample(&enter_to_exit, now_usec() - entered);
+        } else {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            warnx("The command did not exit after Return");
+        }
+    }
+
+    /* The damage object is gone with the window, drop its events. */
+    sync_with_server();
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(conn)) != NULL)
+        free(event);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_samples(samples_t *samples, bool last) {
+    printf("    \"%s\": {\"count\": %d", samples->name, samples->count);
+    if (samples->count > 0) {
+        qsort(samples->values, samples->count, sizeof(uint64_t), compare_samples);
+        printf(", \"min\": %llu, \"median\": %llu, \"max\": %llu",
+               (unsigned long long)samples->values[0],
+               (unsigned long long)samples->values[samples->count / 2],
+               (unsigned long long)samples->values[samples->count - 1]);
+    }
+    printf("}%s\n", last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 10;
+    int keys = 10;
+    bool deny = false;
+    int o;
+
+    while ((o = getopt(argc, argv, "r:k:d")) != -1) {
+        switch (o) {
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'k':
+                keys = atoi(optarg);
+                break;
+            case 'd':
+                deny = true;
+                break;
+            default:
+                errx(EXIT_FAILURE, "Syntax: xlatency [-r runs] [-k keys] [-d] -- command [arguments...]");
+        }
+    }
+    if (optind >= argc)
+        errx(EXIT_FAILURE, "Syntax: xlatency [-r runs] [-k keys] [-d] -- command [arguments...]");
+    if (runs < 1 || runs > MAX_RUNS || keys < 0 || keys > MAX_KEYS)
+        errx(EXIT_FAILURE, "runs must be 1-%d, keys 0-%d", MAX_RUNS, MAX_KEYS);
+
+    if ((conn = xcb_connect(NULL, NULL)) == NULL || xcb_connection_has_error(conn))
+        errx(EXIT_FAILURE, "Could not connect to X11");
+    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+
+    const xcb_query_extension_reply_t *extension = xcb_get_extension_data(conn, &xcb_damage_id);
+    if (!extension || !extension->present)
+        errx(EXIT_FAILURE, "The X server does not support DAMAGE");
+    damage_event = extension->first_event;
+    free(xcb_damage_query_version_reply(conn,
+        xcb_damage_query_version(conn, XCB_DAMAGE_MAJOR_VERSION, XCB_DAMAGE_MINOR_VERSION), NULL));
+
+    extension = xcb_get_extension_data(conn, &xcb_test_id);
+    if (!extension || !extension->present)
+        errx(EXIT_FAILURE, "The X server does not support XTEST");
+
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY});
+    sync_with_server();
+
+    for (int i = 0; i < runs; i++)
+        run(&argv[optind], keys, deny);
+
+    printf("{\n  \"runs\": %d,\n  \"keys\": %d,\n  \"metrics\": {\n", runs, keys);
+    print_samples(&exec_to_map, false);
+    print_samples(&exec_to_grab, false);
+    print_samples(&key_to_frame, false);
+    print_samples(deny ? &enter_to_frame : &enter_to_exit, false);
+    print_samples(&processes, false);
+    print_samples(&rss_kb, false);
+    print_samples(&pss_kb, true);
+    printf("  }\n}\n");
+
+    xcb_disconnect(conn);
+    return EXIT_SUCCESS;
+}
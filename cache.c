@@ -0,0 +1,170 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * cache.c: Files in $XDG_CACHE_HOME/i3lock-fancier which hold data that is
+ *          expensive to compute on every start (the compiled keymap and the
+ *          compose table). Entries are named after a hash of everything they
+ *          were computed from, so a stale entry is simply never looked up.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "i3lock.h"
+#include "cache.h"
+
+extern bool debug_mode;
+
+#define CACHE_DIR "i3lock-fancier"
+
+uint64_t cache_hits;
+uint64_t cache_misses;
+
+/*
+ * Stores the path of the cache entry with the given name in path. With
+ * create set, the cache directory is created if needed.
+ *
+ */
+static bool cache_path(const char *name, char *path, size_t size, bool create) {
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char base[PATH_MAX];
+    char dir[PATH_MAX + sizeof("/" CACHE_DIR)];
+    int n;
+
+    if (xdg_cache_home != NULL && *xdg_cache_home == '/')
+        n = snprintf(base, sizeof(base), "%s", xdg_cache_home);
+    else if (home != NULL && *home != '\0')
+        n = snprintf(base, sizeof(base), "%s/.cache", home);
+    else
+        return false;
+    if (n < 0 || (size_t)n >= sizeof(base))
+        return false;
+    snprintf(dir, sizeof(dir), "%s/" CACHE_DIR, base);
+
+    n = snprintf(path, size, "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= size)
+        return false;
+
+    if (create &&
+        ((mkdir(base, 0700) != 0 && errno != EEXIST) ||
+         (mkdir(dir, 0700) != 0 && errno != EEXIST))) {
+        DEBUG("Could not create cache directory %s\n", dir);
+        return false;
+    }
+    return true;
+}
+
+/* FNV-1a, good enough to tell cache entries apart. */
+uint64_t cache_hash(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Adds the identity of a file (its path, size and modification time) to the
+ * hash, so that the hash changes whenever the file does.
+ *
+ */
+uint64_t cache_hash_file(uint64_t hash, const char *path) {
+    struct stat st;
+
+    hash = cache_hash(hash, path, strlen(path) + 1);
+    if (stat(path, &st) != 0)
+        return cache_hash(hash, "-", 1);
+
+    int64_t stamp[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    return cache_hash(hash, stamp, sizeof(stamp));
+}
+
+/*
+ * Maps the cache entry with the given name into memory (read-only). Returns
+ * NULL if there is no such entry.
+ *
+ */
+const void *cache_map(const char *name, size_t *size) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!cache_path(name, path, sizeof(path), false))
+        goto miss;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        goto miss;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        goto miss;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        goto miss;
+
+    __atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+    *size = st.st_size;
+    return data;
+
+miss:
+    __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void cache_unmap(const void *data, size_t size) {
+    munmap((void *)data, size);
+}
+
+/*
+ * Stores data as the cache entry with the given name. The entry is replaced
+ * atomically, so concurrent readers see either the old or the new one.
+ *
+ */
+bool cache_write(const char *name, const void *data, size_t size) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+
+    if (!cache_path(name, path, sizeof(path), true))
+        return false;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        DEBUG("Could not create cache file %s\n", tmp);
+        return false;
+    }
+
+    const char *bytes = data;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, bytes + written, size - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += n;
+    }
+
+    if (close(fd) != 0 || written != size || rename(tmp, path) != 0) {
+        DEBUG("Could not write cache file %s\n", path);
+        unlink(tmp);
+        return false;
+    }
+
+    DEBUG("Wrote %zu bytes to cache file %s\n", size, path);
+    return true;
+}
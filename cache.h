@@ -0,0 +1,23 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Initial value for cache_hash(). */
+#define CACHE_HASH_INIT 14695981039346656037ULL
+
+/* How many cache_map() calls found their entry and how many did not, both
+ * updated atomically (entries are also mapped from tasks). */
+extern uint64_t cache_hits;
+extern uint64_t cache_misses;
+
+uint64_t cache_hash(uint64_t hash, const void *data, size_t size);
+uint64_t cache_hash_file(uint64_t hash, const char *path);
+
+const void *cache_map(const char *name, size_t *size);
+void cache_unmap(const void *data, size_t size);
+bool cache_write(const char *name, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,578 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * compose.c: Compose sequences (dead keys, Multi_key). Parsing the compose
+ *            files of a locale (tens of thousands of lines for en_US.UTF-8)
+ *            on every start is slow, so the parsed table is stored in the
+ *            cache as a compact trie which is mapped into memory on later
+ *            starts and matched against directly.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <xkbcommon/xkbcommon.h>
+#if XKBCOMPOSE == 1
+#include <xkbcommon/xkbcommon-compose.h>
+#endif
+
+#include "i3lock.h"
+#include "cache.h"
+#include "compose.h"
+
+#if XKBCOMPOSE == 1
+
+extern bool debug_mode;
+
+#define COMPOSE_MAGIC 0x54433349 /* "I3CT" */
+#define COMPOSE_VERSION 1
+
+/*
+ * Layout of a compiled table: the header, the nodes, then the NUL-terminated
+ * UTF-8 strings of all sequences. Node 0 is the root. The children of a node
+ * are adjacent and sorted by keysym, and always come after their parent.
+ */
+typedef struct compose_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nodes;
+    uint32_t strings;
+} compose_header_t;
+
+typedef struct compose_node {
+    uint32_t keysym;
+    /* Index of the first child and number of children (0 for a leaf). */
+    uint32_t first_child;
+    uint32_t children;
+    /* What a leaf produces: a keysym and an offset into the strings. */
+    uint32_t result;
+    uint32_t utf8;
+} compose_node_t;
+
+/* The compiled table in use, mapped from the cache or built in memory. */
+static const void *table;
+static size_t table_size;
+static bool table_mapped;
+static const compose_node_t *nodes;
+static const char *strings;
+
+/* Without a compiled table, the table of xkbcommon is used as is. */
+static struct xkb_compose_state *xkb_compose_state;
+
+/* The node the keysyms fed so far lead to. */
+static uint32_t context;
+static compose_status_t status;
+
+/* How deep xkbcommon follows include statements. */
+#define MAX_INCLUDE_DEPTH 5
+
+/*
+ * Hashes the compose file at path and the files it includes. In an include
+ * statement, %H stands for $HOME and %S for the system compose directory.
+ * %L is the Compose file of the locale, which cache_name() hashes anyway.
+ *
+ */
+static uint64_t hash_compose_file(uint64_t hash, const char *path, const char *xlocaledir,
+                                  const char *home, int depth) {
+    hash = cache_hash_file(hash, path);
+    if (depth >= MAX_INCLUDE_DEPTH)
+        return hash;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return hash;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        const char *p = line + strspn(line, " \t");
+        if (strncmp(p, "include", 7) != 0)
+            continue;
+        p += 7;
+        p += strspn(p, " \t");
+        if (*p++ != '"')
+            continue;
+
+        char include[PATH_MAX];
+        size_t len = 0;
+        for (; *p != '\0' && *p != '"' && len < sizeof(include) - 1; p++) {
+            const char *insert = NULL;
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            } else if (*p == '%') {
+                p++;
+                if (*p == 'H')
+                    insert = home != NULL ? home : "";
+                else if (*p == 'S')
+                    insert = xlocaledir;
+                else if (*p != '%')
+                    break; /* %L, or not a valid include */
+            }
+            if (insert == NULL) {
+                include[len++] = *p;
+                continue;
+            }
+            size_t n = strlen(insert);
+            if (n > sizeof(include) - 1 - len)
+                n = sizeof(include) - 1 - len;
+            memcpy(include + len, insert, n);
+            len += n;
+        }
+        include[len] = '\0';
+
+        if (*p == '"')
+            hash = hash_compose_file(hash, include, xlocaledir, home, depth + 1);
+    }
+    fclose(file);
+
+    return hash;
+}
+
+/*
+ * Returns the name of the cache entry for the compose table of the locale.
+ * It covers the files xkbcommon reads the table from (see
+ * xkb_compose_table_new_from_locale()), including the ones a user's compose
+ * file includes.
+ *
+ */
+static void cache_name(const char *locale, char *name, size_t size) {
+    const char *xlocaledir = getenv("XLOCALEDIR");
+    const char *xcomposefile = getenv("XCOMPOSEFILE");
+    const char *xdg_config_home = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    char path[PATH_MAX];
+    uint64_t hash = CACHE_HASH_INIT;
+    uint32_t version = COMPOSE_VERSION;
+
+    if (xlocaledir == NULL)
+        xlocaledir = "/usr/share/X11/locale";
+
+    hash = cache_hash(hash, &version, sizeof(version));
+    hash = cache_hash(hash, locale, strlen(locale) + 1);
+    if (xcomposefile != NULL)
+        hash = hash_compose_file(hash, xcomposefile, xlocaledir, home, 0);
+    if (xdg_config_home != NULL) {
+        snprintf(path, sizeof(path), "%s/XCompose", xdg_config_home);
+        hash = hash_compose_file(hash, path, xlocaledir, home, 0);
+    }
+    if (home != NULL) {
+        snprintf(path, sizeof(path), "%s/.config/XCompose", home);
+        hash = hash_compose_file(hash, path, xlocaledir, home, 0);
+        snprintf(path, sizeof(path), "%s/.XCompose", home);
+        hash = hash_compose_file(hash, path, xlocaledir, home, 0);
+    }
+
+    /* The Compose file of the locale itself is listed in compose.dir. The
+     * locale may be an alias (e.g. en_US.utf8 for en_US.UTF-8), so hash the
+     * files of every locale for the same language and territory. */
+    snprintf(path, sizeof(path), "%s/locale.alias", xlocaledir);
+    hash = cache_hash_file(hash, path);
+    snprintf(path, sizeof(path), "%s/compose.dir", xlocaledir);
+    hash = cache_hash_file(hash, path);
+
+    FILE *dir = fopen(path, "r");
+    if (dir != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), dir) != NULL) {
+            char file[256], file_locale[256];
+            if (line[0] == '#' || sscanf(line, "%255[^:]: %255s", file, file_locale) != 2)
+                continue;
+            if (strncmp(file_locale, locale, strcspn(locale, ".")) != 0)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", xlocaledir, file);
+            hash = cache_hash_file(hash, path);
+        }
+        fclose(dir);
+    }
+
+    snprintf(name, size, "compose-%016llx", (unsigned long long)hash);
+}
+
+/*
+ * Checks that data holds a well-formed compiled table and, if so, starts
+ * using it.
+ *
+ */
+static bool use_table(const void *data, size_t size, bool mapped) {
+    const compose_header_t *header = data;
+
+    if (size < sizeof(*header) ||
+        header->magic != COMPOSE_MAGIC ||
+        header->version != COMPOSE_VERSION ||
+        header->nodes == 0 || header->strings == 0 ||
+        (size - sizeof(*header)) / sizeof(compose_node_t) < header->nodes ||
+        size != sizeof(*header) + (size_t)header->nodes * sizeof(compose_node_t) + header->strings)
+        return false;
+
+    const compose_node_t *n = (const compose_node_t *)(header + 1);
+    const char *s = (const char *)(n + header->nodes);
+    if (s[header->strings - 1] != '\0')
+        return false;
+
+    for (uint32_t i = 0; i < header->nodes; i++) {
+        if (n[i].children > 0) {
+            if (n[i].first_child <= i ||
+                n[i].first_child > header->nodes ||
+                n[i].children > header->nodes - n[i].first_child)
+                return false;
+        } else if (n[i].utf8 >= header->strings) {
+            return false;
+        }
+    }
+
+    table = data;
+    table_size = size;
+    table_mapped = mapped;
+    nodes = n;
+    strings = s;
+    return true;
+}
+
+#if XKBCOMPOSE_ITERATOR == 1
+typedef struct compose_entry {
+    xkb_keysym_t *sequence;
+    size_t length;
+    xkb_keysym_t keysym;
+    uint32_t utf8;
+} compose_entry_t;
+
+typedef struct builder {
+    compose_entry_t *entries;
+    size_t entries_len;
+    compose_node_t *nodes;
+    size_t nodes_len;
+    size_t nodes_cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+    /* An allocation failed, the table is abandoned. */
+    bool failed;
+} builder_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const compose_entry_t *x = a;
+    const compose_entry_t *y = b;
+    for (size_t i = 0; i < x->length && i < y->length; i++) {
+        if (x->sequence[i] != y->sequence[i])
+            return (x->sequence[i] > y->sequence[i]) - (x->sequence[i] < y->sequence[i]);
+    }
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+static void free_builder(builder_t *b) {
+    for (size_t i = 0; i < b->entries_len; i++)
+        free(b->entries[i].sequence);
+    free(b->entries);
+    free(b->nodes);
+    free(b->strings);
+}
+
+static uint32_t add_string(builder_t *b, const char *string) {
+    size_t length = strlen(string) + 1;
+    if (b->failed)
+        return 0;
+    if (b->strings_len + length > b->strings_cap) {
+        size_t cap = (b->strings_cap + length) * 2;
+        char *grown = realloc(b->strings, cap);
+        if (grown == NULL) {
+            b->failed = true;
+            return 0;
+        }
+        b->strings = grown;
+        b->strings_cap = cap;
+    }
+    memcpy(b->strings + b->strings_len, string, length);
+    b->strings_len += length;
+    return b->strings_len - length;
+}
+
+/*
+ * Adds the children of the given node for the entries [lo, hi), which share
+ * their first depth keysyms and are all longer than that.
+ *
+ */
+static void add_children(builder_t *b, size_t parent, size_t lo, size_t hi, size_t depth) {
+    compose_entry_t *e = b->entries;
+    size_t count = 0;
+    for (size_t i = lo; i < hi; i++)
+        if (i == lo || e[i].sequence[depth] != e[i - 1].sequence[depth])
+            count++;
+
+    if (b->failed)
+        return;
+
+    size_t first = b->nodes_len;
+    if (b->nodes_len + count > b->nodes_cap) {
+        size_t cap = (b->nodes_cap + count) * 2;
+        compose_node_t *grown = realloc(b->nodes, cap * sizeof(compose_node_t));
+        if (grown == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->nodes = grown;
+        b->nodes_cap = cap;
+    }
+    b->nodes_len += count;
+    b->nodes[parent].first_child = first;
+    b->nodes[parent].children = count;
+
+    size_t node = first;
+    for (size_t start = lo; start < hi; node++) {
+        size_t end = start + 1;
+        while (end < hi && e[end].sequence[depth] == e[start].sequence[depth])
+            end++;
+
+        compose_node_t *n = &b->nodes[node];
+        memset(n, 0, sizeof(*n));
+        n->keysym = e[start].sequence[depth];
+
+        /* A sequence which is a prefix of longer ones can never complete,
+         * xkbcommon drops it as well. */
+        size_t longer = start;
+        while (longer < end && e[longer].length == depth + 1)
+            longer++;
+
+        if (longer == end) {
+            n->result = e[start].keysym;
+            n->utf8 = e[start].utf8;
+        } else {
+            add_children(b, node, longer, end, depth + 1);
+        }
+        start = end;
+    }
+}
+
+/*
+ * Compiles the xkbcommon compose table into our format. Returns the table
+ * (to be freed by the caller) or NULL, also when running out of memory: the
+ * table of xkbcommon is then used as is.
+ *
+ */
+static void *compile_table(struct xkb_compose_table *xkb_table, size_t *size) {
+    builder_t b = {0};
+    size_t entries_cap = 0;
+
+    struct xkb_compose_table_iterator *iter = xkb_compose_table_iterator_new(xkb_table);
+    if (iter == NULL)
+        return NULL;
+
+    add_string(&b, "");
+
+    struct xkb_compose_table_entry *entry;
+    while ((entry = xkb_compose_table_iterator_next(iter)) != NULL) {
+        size_t length;
+        const xkb_keysym_t *sequence = xkb_compose_table_entry_sequence(entry, &length);
+        if (length == 0)
+            continue;
+        if (b.entries_len == entries_cap) {
+            size_t cap = (entries_cap + 64) * 2;
+            compose_entry_t *grown = realloc(b.entries, cap * sizeof(compose_entry_t));
+            if (grown == NULL) {
+                b.failed = true;
+                break;
+            }
+            b.entries = grown;
+            entries_cap = cap;
+        }
+        xkb_keysym_t *copy = malloc(length * sizeof(xkb_keysym_t));
+        if (copy == NULL) {
+            b.failed = true;
+            break;
+        }
+        memcpy(copy, sequence, length * sizeof(xkb_keysym_t));
+        compose_entry_t *e = &b.entries[b.entries_len++];
+        e->sequence = copy;
+        e->length = length;
+        e->keysym = xkb_compose_table_entry_keysym(entry);
+        e->utf8 = add_string(&b, xkb_compose_table_entry_utf8(entry));
+    }
+    xkb_compose_table_iterator_free(iter);
+
+    if (!b.failed) {
+        qsort(b.entries, b.entries_len, sizeof(compose_entry_t), compare_entries);
+
+        /* The root. */
+        b.nodes_cap = b.entries_len + 1;
+        b.nodes = calloc(b.nodes_cap, sizeof(compose_node_t));
+        b.nodes_len = 1;
+        if (b.nodes == NULL)
+            b.failed = true;
+        else if (b.entries_len > 0)
+            add_children(&b, 0, 0, b.entries_len, 0);
+    }
+
+    compose_header_t header = {COMPOSE_MAGIC, COMPOSE_VERSION, b.nodes_len, b.strings_len};
+    *size = sizeof(header) + b.nodes_len * sizeof(compose_node_t) + b.strings_len;
+    char *data = b.failed ? NULL : malloc(*size);
+    if (data == NULL) {
+        fprintf(stderr, "[i3lock] out of memory compiling the compose table\n");
+        free_builder(&b);
+        return NULL;
+    }
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), b.nodes, b.nodes_len * sizeof(compose_node_t));
+    memcpy(data + sizeof(header) + b.nodes_len * sizeof(compose_node_t), b.strings, b.strings_len);
+
+    DEBUG("Compiled compose table: %zu sequences, %zu bytes\n", b.entries_len, *size);
+    free_builder(&b);
+    return data;
+}
+#endif
+
+static void compose_unload(void) {
+    if (table != NULL) {
+        if (table_mapped)
+            cache_unmap(table, table_size);
+        else
+            free((void *)table);
+        table = NULL;
+    }
+    xkb_compose_state_unref(xkb_compose_state);
+    xkb_compose_state = NULL;
+    compose_reset();
+}
+
+/*
+ * Loads the compose table of the given locale, from the cache if possible.
+ * Otherwise, the compose files are parsed and, where xkbcommon allows
+ * iterating the result, the compiled table is stored in the cache.
+ *
+ */
+bool compose_load(const char *locale) {
+    char name[64];
+    size_t size;
+
+    compose_unload();
+
+    cache_name(locale, name, sizeof(name));
+    const void *data = cache_map(name, &size);
+    if (data != NULL) {
+        if (use_table(data, size, true)) {
+            DEBUG("Using cached compose table %s\n", name);
+            return true;
+        }
+        cache_unmap(data, size);
+    }
+
+    /* This may run on a startup task, concurrently with other users of
+     * xkbcommon, so it cannot share their context. */
+    struct xkb_context *compose_context;
+    if ((compose_context = xkb_context_new(0)) == NULL) {
+        fprintf(stderr, "[i3lock] could not create xkb context for compose table\n");
+        return false;
+    }
+
+    struct xkb_compose_table *xkb_table = xkb_compose_table_new_from_locale(compose_context, locale, 0);
+    xkb_context_unref(compose_context);
+    if (xkb_table == NULL) {
+        fprintf(stderr, "[i3lock] xkb_compose_table_new_from_locale failed\n");
+        return false;
+    }
+
+#if XKBCOMPOSE_ITERATOR == 1
+    void *compiled = compile_table(xkb_table, &size);
+    if (compiled != NULL && use_table(compiled, size, false)) {
+        cache_write(name, compiled, size);
+        xkb_compose_table_unref(xkb_table);
+        return true;
+    }
+    free(compiled);
+#endif
+
+    xkb_compose_state = xkb_compose_state_new(xkb_table, 0);
+    xkb_compose_table_unref(xkb_table);
+    if (xkb_compose_state == NULL) {
+        fprintf(stderr, "[i3lock] xkb_compose_state_new failed\n");
+        return false;
+    }
+    return true;
+}
+
+/* Modifiers do not take part in compose sequences, like in xkbcommon. */
+static bool is_modifier(xkb_keysym_t keysym) {
+    return (keysym >= XKB_KEY_Shift_L && keysym <= XKB_KEY_Hyper_R) ||
+           (keysym >= XKB_KEY_ISO_Lock && keysym <= XKB_KEY_ISO_Level5_Lock) ||
+           keysym == XKB_KEY_Mode_switch ||
+           keysym == XKB_KEY_Num_Lock;
+}
+
+/*
+ * Feeds the keysym of a keypress into the current sequence and returns the
+ * state of the sequence. Keysyms which do not take part in compose
+ * sequences leave the state alone and return COMPOSE_NOTHING.
+ *
+ */
+compose_status_t compose_feed(xkb_keysym_t keysym) {
+    if (xkb_compose_state != NULL) {
+        if (xkb_compose_state_feed(xkb_compose_state, keysym) != XKB_COMPOSE_FEED_ACCEPTED)
+            return COMPOSE_NOTHING;
+        return (compose_status_t)xkb_compose_state_get_status(xkb_compose_state);
+    }
+
+    if (table == NULL || is_modifier(keysym))
+        return COMPOSE_NOTHING;
+
+    if (status == COMPOSE_COMPOSED || status == COMPOSE_CANCELLED)
+        context = 0;
+
+    /* Binary search among the children of the current node. */
+    const compose_node_t *node = &nodes[context];
+    uint32_t lo = node->first_child;
+    uint32_t hi = lo + node->children;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (nodes[mid].keysym < keysym)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == node->first_child + node->children || nodes[lo].keysym != keysym) {
+        status = (context == 0 ? COMPOSE_NOTHING : COMPOSE_CANCELLED);
+        context = 0;
+        return status;
+    }
+
+    context = lo;
+    status = (nodes[lo].children > 0 ? COMPOSE_COMPOSING : COMPOSE_COMPOSED);
+    return status;
+}
+
+/*
+ * Stores the text produced by the completed sequence in buffer and returns
+ * its length (without the terminating NUL byte).
+ *
+ */
+int compose_get_utf8(char *buffer, size_t size) {
+    if (xkb_compose_state != NULL)
+        return xkb_compose_state_get_utf8(xkb_compose_state, buffer, size);
+
+    if (size > 0)
+        buffer[0] = '\0';
+    if (status != COMPOSE_COMPOSED || size == 0)
+        return 0;
+
+    const compose_node_t *node = &nodes[context];
+    if (strings[node->utf8] == '\0' && node->result != XKB_KEY_NoSymbol) {
+        int n = xkb_keysym_to_utf8(node->result, buffer, size);
+        return (n > 0 ? n - 1 : 0);
+    }
+    return snprintf(buffer, size, "%s", strings + node->utf8);
+}
+
+xkb_keysym_t compose_get_one_sym(void) {
+    if (xkb_compose_state != NULL)
+        return xkb_compose_state_get_one_sym(xkb_compose_state);
+    return (status == COMPOSE_COMPOSED ? nodes[context].result : XKB_KEY_NoSymbol);
+}
+
+void compose_reset(void) {
+    if (xkb_compose_state != NULL)
+        xkb_compose_state_reset(xkb_compose_state);
+    context = 0;
+    status = COMPOSE_NOTHING;
+}
+
+#endif
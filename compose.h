@@ -0,0 +1,22 @@
+#ifndef _COMPOSE_H
+#define _COMPOSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <xkbcommon/xkbcommon.h>
+
+/* Same meaning as enum xkb_compose_status. */
+typedef enum {
+    COMPOSE_NOTHING = 0,
+    COMPOSE_COMPOSING,
+    COMPOSE_COMPOSED,
+    COMPOSE_CANCELLED
+} compose_status_t;
+
+bool compose_load(const char *locale);
+compose_status_t compose_feed(xkb_keysym_t keysym);
+int compose_get_utf8(char *buffer, size_t size);
+xkb_keysym_t compose_get_one_sym(void);
+void compose_reset(void);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * headless.c: Renders lock screen frames into in-memory image surfaces and
+ *             writes them to PNG files, without connecting to X11. Used to
+ *             look at (and time) the rendering code on machines without a
+ *             display.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "settings.h"
+#include "xinerama.h"
+#include "unlock_indicator.h"
+#include "metrics.h"
+
+extern unlock_state_t unlock_state;
+extern auth_state_t auth_state;
+
+/* Shown by the keyboard layout indicator, there is no keyboard to ask. */
+#define HEADLESS_LAYOUT "US"
+
+/*
+ * Parses a comma separated list of WIDTHxHEIGHT+X+Y rectangles into
+ * xr_resolutions and returns the size of the area covering all of them.
+ *
+ */
+static bool parse_screens(const char *spec, uint32_t *resolution) {
+    int count = 1;
+    for (const char *c = spec; *c != '\0'; c++)
+        if (*c == ',')
+            count++;
+
+    Rect *rects = calloc(count, sizeof(Rect));
+    if (rects == NULL)
+        return false;
+
+    resolution[0] = resolution[1] = 0;
+    const char *pos = spec;
+    for (int i = 0; i < count; i++) {
+        unsigned int width, height;
+        int x = 0, y = 0, n = 0;
+        if (sscanf(pos, "%ux%u%n+%d+%d%n", &width, &height, &n, &x, &y, &n) < 2 ||
+            width == 0 || height == 0 || width > UINT16_MAX || height > UINT16_MAX ||
+            x < 0 || y < 0 || x > INT16_MAX || y > INT16_MAX ||
+            (pos[n] != ',' && pos[n] != '\0')) {
+            fprintf(stderr, "Invalid screen \"%s\", expected WIDTHxHEIGHT+X+Y\n", pos);
+            free(rects);
+            return false;
+        }
+
+        rects[i] = (Rect){x, y, width, height};
+        if (x + width > resolution[0])
+            resolution[0] = x + width;
+        if (y + height > resolution[1])
+            resolution[1] = y + height;
+        pos += n + 1;
+    }
+
+    xr_resolutions = rects;
+    xr_screens = count;
+    return true;
+}
+
+/*
+ * Renders the frame for every combination of unlock and auth state onto the
+ * given screens (see parse_screens) and writes the frames to directory as
+ * frame-u<unlock_state>-a<auth_state>.png, printing the render time of each.
+ * The clock shows $SOURCE_DATE_EPOCH if set, to get reproducible images.
+ *
+ * Returns the exit status for i3lock.
+ *
+ */
+int render_headless(const char *directory, const char *screens) {
+    uint32_t resolution[2];
+    if (!parse_screens(screens, resolution))
+        return EXIT_FAILURE;
+
+    time_t now = time(NULL);
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    if (epoch != NULL)
+        now = strtoll(epoch, NULL, 10);
+
+    cairo_surface_t *surface = cairo_image_surface_create(
+        CAIRO_FORMAT_RGB24, resolution[0], resolution[1]);
+    cairo_t *ctx = cairo_create(surface);
+    if (cairo_status(ctx) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not create a %ux%u surface: %s\n",
+                resolution[0], resolution[1],
+                cairo_status_to_string(cairo_status(ctx)));
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int auth = STATE_AUTH_IDLE; auth <= STATE_I3LOCK_LOCK_FAILED; auth++) {
+        for (int unlock = STATE_STARTED; unlock <= STATE_BACKSPACE_ACTIVE; unlock++) {
+            auth_state = auth;
+            unlock_state = unlock;
+
+            uint64_t start = now_usec();
+            render_frame(ctx, NULL, resolution, HEADLESS_LAYOUT, true, now);
+            cairo_surface_flush(surface);
+            uint64_t elapsed = now_usec() - start;
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/frame-u%d-a%d.png", directory, unlock, auth);
+            cairo_status_t ret = cairo_surface_write_to_png(surface, path);
+            if (ret != CAIRO_STATUS_SUCCESS) {
+                fprintf(stderr, "Could not write %s: %s\n", path, cairo_status_to_string(ret));
+                status = EXIT_FAILURE;
+                continue;
+            }
+            printf("%s %llu usec\n", path, (unsigned long long)elapsed);
+        }
+    }
+
+    cairo_destroy(ctx);
+    cairo_surface_destroy(surface);
+    return status;
+}
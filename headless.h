@@ -0,0 +1,6 @@
+#ifndef _HEADLESS_H
+#define _HEADLESS_H
+
+int render_headless(const char *directory, const char *screens);
+
+#endif
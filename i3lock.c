@@ -16,12 +16,19 @@
 #include <stdlib.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <xcb/xcb.h>
 #include <xcb/xkb.h>
+#include <xcb/xinerama.h>
+#include <xcb/present.h>
 #include <err.h>
 #include <assert.h>
 #include <security/pam_appl.h>
@@ -30,9 +37,6 @@
 #include <ev.h>
 #include <sys/mman.h>
 #include <xkbcommon/xkbcommon.h>
-#if XKBCOMPOSE == 1
-#include <xkbcommon/xkbcommon-compose.h>
-#endif
 #include <xkbcommon/xkbcommon-x11.h>
 #include <ctype.h>
 #include <cairo.h>
@@ -46,13 +50,27 @@
 #include "cursors.h"
 #include "unlock_indicator.h"
 #include "xinerama.h"
+#include "metrics.h"
+#include "stats.h"
+#include "headless.h"
+#include "bench.h"
+#include "tasks.h"
+#include "compose.h"
+#include "cache.h"
+#include "theme.h"
+#include "reload.h"
+#include "trace.h"
+#include "alloc_stats.h"
+
+/* raise_loop() needs little more than what xcb_connect() uses. */
+#define RAISE_THREAD_STACK_SIZE (256 * 1024)
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
 #define START_TIMER(timer_obj, timeout, callback) \
-	timer_obj = start_timer(timer_obj, timeout, callback)
+	start_timer(&timer_obj, timeout, callback)
 #define STOP_TIMER(timer_obj) \
-	timer_obj = stop_timer(timer_obj)
+	ev_timer_stop(main_loop, &timer_obj)
 
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
 static void input_done(void);
@@ -60,24 +78,32 @@ static void input_done(void);
 /* Holds the password you enter (in UTF-8). */
 static char password[512];
 
-static struct ev_timer *clear_auth_wrong_timeout;
-static struct ev_timer *clear_indicator_timeout;
-static struct ev_timer *discard_passwd_timeout;
+/* The timers are restarted rather than allocated for every keypress. */
+static struct ev_timer clear_auth_wrong_timeout;
+static struct ev_timer clear_indicator_timeout;
+static struct ev_timer discard_passwd_timeout;
+static struct ev_timer redraw_timeout_timer;
+
+#if XKBCOMPOSE == 1
+/* Loads the compose table, see compose_available(). */
+static task_t compose_task;
+#endif
 
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
 static struct xkb_keymap *xkb_keymap;
 
-#if XKBCOMPOSE == 1
-static struct xkb_compose_table *xkb_compose_table;
-static struct xkb_compose_state *xkb_compose_state;
-#endif
-
 static uint8_t xkb_base_event;
 static uint8_t xkb_base_error;
+/* The core keyboard, queried once at startup instead of for every event. */
+static int32_t xkb_device_id;
+/* Name of the cache entry holding the keymap of the core keyboard. */
+static char keymap_cache_name[32];
 
-char *modifier_string = NULL;
+char modifier_string[96];
 static bool dont_fork = false;
+/* Written to once the window is mapped, see daemonize(). */
+static int mapped_pipe = -1;
 struct ev_loop *main_loop;
 
 extern unlock_state_t unlock_state;
@@ -111,67 +137,134 @@ void u8_dec(char *s, int *i) {
 	(void)(isutf(s[--(*i)]) || isutf(s[--(*i)]) || isutf(s[--(*i)]) || --(*i));
 }
 
-/*
- * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
- * Necessary so that we can properly let xkbcommon track the keyboard state and
- * translate keypresses to utf-8.
- *
- */
-static bool load_keymap(void) {
+static bool create_xkb_context(void) {
 	if (xkb_context == NULL) {
 		if ((xkb_context = xkb_context_new(0)) == NULL) {
 			fprintf(stderr, "[i3lock] could not create xkbcommon context\n");
 			return false;
 		}
 	}
+	return true;
+}
 
-	xkb_keymap_unref(xkb_keymap);
-
-	int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
-	DEBUG("device = %d\n", device_id);
-	if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
-		fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
-		return false;
-	}
-
+/*
+ * Starts using the given keymap, with the current keyboard state of the X11
+ * server.
+ *
+ */
+static bool use_keymap(struct xkb_keymap *keymap) {
 	struct xkb_state *new_state =
-		xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
+		xkb_x11_state_new_from_device(keymap, conn, xkb_device_id);
 	if (new_state == NULL) {
 		fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+		xkb_keymap_unref(keymap);
 		return false;
 	}
 
+	xkb_keymap_unref(xkb_keymap);
+	xkb_keymap = keymap;
 	xkb_state_unref(xkb_state);
 	xkb_state = new_state;
 
 	return true;
 }
 
-#if XKBCOMPOSE == 1
 /*
- * Loads the XKB compose table from the given locale.
+ * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
+ * Necessary so that we can properly let xkbcommon track the keyboard state and
+ * translate keypresses to utf-8.
  *
  */
-static bool load_compose_table(const char *locale) {
-	xkb_compose_table_unref(xkb_compose_table);
+static bool load_keymap(void) {
+	struct xkb_keymap *keymap;
 
-	if ((xkb_compose_table = xkb_compose_table_new_from_locale(xkb_context, locale, 0)) == NULL) {
-		fprintf(stderr, "[i3lock] xkb_compose_table_new_from_locale failed\n");
+	if (!create_xkb_context())
 		return false;
-	}
 
-	struct xkb_compose_state *new_compose_state = xkb_compose_state_new(xkb_compose_table, 0);
-	if (new_compose_state == NULL) {
-		fprintf(stderr, "[i3lock] xkb_compose_state_new failed\n");
+	DEBUG("device = %d\n", xkb_device_id);
+	if ((keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, xkb_device_id, 0)) == NULL) {
+		fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
 		return false;
 	}
 
-	xkb_compose_state_unref(xkb_compose_state);
-	xkb_compose_state = new_compose_state;
+	return use_keymap(keymap);
+}
 
-	return true;
+/*
+ * Sets keymap_cache_name for the core keyboard and the XKB rules, model,
+ * layout, variant and options its keymap was compiled from, as stored in the
+ * _XKB_RULES_NAMES property of the root window.
+ *
+ */
+static void set_keymap_cache_name(xcb_window_t root, xcb_atom_t rules_names) {
+	xcb_get_property_reply_t *reply = xcb_get_property_reply(conn,
+			xcb_get_property(conn, false, root, rules_names, XCB_ATOM_STRING, 0, 1024), NULL);
+	if (reply == NULL)
+		return;
+
+	int length = xcb_get_property_value_length(reply);
+	if (reply->type == XCB_ATOM_STRING && length > 0) {
+		uint64_t hash = CACHE_HASH_INIT;
+		hash = cache_hash(hash, &xkb_device_id, sizeof(xkb_device_id));
+		hash = cache_hash(hash, xcb_get_property_value(reply), length);
+		snprintf(keymap_cache_name, sizeof(keymap_cache_name), "keymap-%016llx",
+				(unsigned long long)hash);
+	}
+	free(reply);
+}
+
+/*
+ * Loads the keymap stored in the cache for the current keyboard. This avoids
+ * downloading the keymap from the X11 server before the screen is locked.
+ *
+ */
+static bool load_cached_keymap(void) {
+	struct xkb_keymap *keymap;
+	size_t size;
+
+	if (keymap_cache_name[0] == '\0' || !create_xkb_context())
+		return false;
+
+	const char *cached = cache_map(keymap_cache_name, &size);
+	if (cached == NULL)
+		return false;
+	keymap = xkb_keymap_new_from_buffer(xkb_context, cached, size,
+			XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	cache_unmap(cached, size);
+	if (keymap == NULL)
+		return false;
+
+	DEBUG("Using cached keymap %s\n", keymap_cache_name);
+	return use_keymap(keymap);
+}
+
+/*
+ * Stores the keymap in use in the cache, unless the cache already holds the
+ * same keymap.
+ *
+ */
+static void update_keymap_cache(void) {
+	size_t size;
+
+	if (keymap_cache_name[0] == '\0' || xkb_keymap == NULL)
+		return;
+
+	char *string = xkb_keymap_get_as_string(xkb_keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (string == NULL)
+		return;
+	size_t length = strlen(string);
+
+	const char *cached = cache_map(keymap_cache_name, &size);
+	bool current = (cached != NULL && size == length && memcmp(cached, string, length) == 0);
+	if (cached != NULL)
+		cache_unmap(cached, size);
+
+	if (!current) {
+		DEBUG("Keymap cache %s is %s\n", keymap_cache_name, cached ? "outdated" : "missing");
+		cache_write(keymap_cache_name, string, length);
+	}
+	free(string);
 }
-#endif /* XKBCOMPOSE */
 
 /*
  * Clears the memory which stored the password to be a bit safer against
@@ -190,29 +283,15 @@ static void clear_password_memory(void) {
 		vpassword[c] = c + (int)beep;
 }
 
-ev_timer *start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
-	if (timer_obj) {
-		ev_timer_stop(main_loop, timer_obj);
-		ev_timer_set(timer_obj, timeout, 0.);
-		ev_timer_start(main_loop, timer_obj);
-	} else {
-		/* When there is no memory, we just don’t have a timeout. We cannot
-		 * exit() here, since that would effectively unlock the screen. */
-		timer_obj = calloc(sizeof(struct ev_timer), 1);
-		if (timer_obj) {
-			ev_timer_init(timer_obj, callback, timeout, 0.);
-			ev_timer_start(main_loop, timer_obj);
-		}
-	}
-	return timer_obj;
-}
-
-ev_timer *stop_timer(ev_timer *timer_obj) {
-	if (timer_obj) {
-		ev_timer_stop(main_loop, timer_obj);
-		free(timer_obj);
-	}
-	return NULL;
+/*
+ * (Re)starts the one-shot timer, which fires after timeout seconds unless it
+ * is started again or stopped before.
+ *
+ */
+void start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
+	ev_timer_stop(main_loop, timer_obj);
+	ev_timer_init(timer_obj, callback, timeout, 0.);
+	ev_timer_start(main_loop, timer_obj);
 }
 
 /*
@@ -234,15 +313,11 @@ static void finish_input(void) {
 static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
 	DEBUG("clearing auth wrong\n");
 	auth_state = STATE_AUTH_IDLE;
-	redraw_screen();
+	schedule_redraw();
 
 	/* Clear modifier string. */
-	if (modifier_string != NULL) {
-		free(modifier_string);
-		modifier_string = NULL;
-	}
+	modifier_string[0] = '\0';
 
-	/* Now free this timeout. */
 	STOP_TIMER(clear_auth_wrong_timeout);
 
 	/* retry with input done during auth verification */
@@ -268,13 +343,41 @@ static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
 	STOP_TIMER(discard_passwd_timeout);
 }
 
+/*
+ * Appends the latency statistics to the configured stats_file.
+ *
+ */
+static void dump_stats(void) {
+	if (stats_file[0] == '\0')
+		return;
+
+	FILE *out = fopen(stats_file, "a");
+	if (out == NULL) {
+		fprintf(stderr, "Could not open %s for writing statistics\n", stats_file);
+		return;
+	}
+	metrics_dump(out);
+	alloc_stats_dump(out);
+	fclose(out);
+}
+
+static void dump_stats_cb(EV_P_ ev_signal *w, int revents) {
+	dump_stats();
+	trace_write();
+}
+
 static void input_done(void) {
 	STOP_TIMER(clear_auth_wrong_timeout);
 	auth_state = STATE_AUTH_VERIFY;
 	unlock_state = STATE_STARTED;
 	redraw_screen();
 
-	if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
+	uint64_t pam_start_usec = now_usec();
+	TRACE(TRACE_PAM_BEGIN, 0, 0);
+	int pam_result = pam_authenticate(pam_handle, 0);
+	TRACE(TRACE_PAM_END, 0, 0);
+	histogram_add(&pam_latency, now_usec() - pam_start_usec);
+	if (pam_result == PAM_SUCCESS) {
 		DEBUG("successfully authenticated\n");
 		clear_password_memory();
 
@@ -285,6 +388,7 @@ static void input_done(void) {
 		pam_setcred(pam_handle, PAM_REFRESH_CRED);
 		pam_end(pam_handle, PAM_SUCCESS);
 
+		dump_stats();
 		exit(0);
 	}
 
@@ -316,14 +420,9 @@ static void input_done(void) {
 		else if (strcmp(mod_name, XKB_MOD_NAME_LOGO) == 0)
 			mod_name = "Win";
 
-		char *tmp;
-		if (modifier_string == NULL) {
-			if (asprintf(&tmp, "%s", mod_name) != -1)
-				modifier_string = tmp;
-		} else if (asprintf(&tmp, "%s, %s", modifier_string, mod_name) != -1) {
-			free(modifier_string);
-			modifier_string = tmp;
-		}
+		size_t len = strlen(modifier_string);
+		snprintf(modifier_string + len, sizeof(modifier_string) - len,
+				"%s%s", len > 0 ? ", " : "", mod_name);
 	}
 
 	auth_state = STATE_AUTH_WRONG;
@@ -349,8 +448,7 @@ static void input_done(void) {
 }
 
 static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
-	redraw_screen();
-	STOP_TIMER(w);
+	schedule_redraw();
 }
 
 static bool skip_without_validation(void) {
@@ -363,6 +461,30 @@ static bool skip_without_validation(void) {
 	return false;
 }
 
+#if XKBCOMPOSE == 1
+/*
+ * The compose table is loaded in the background once the window is mapped.
+ * Returns whether it can be used, waiting for it only if the keysym starts a
+ * compose sequence (a dead key or Multi_key) and it is not loaded yet.
+ *
+ */
+static bool compose_available(xkb_keysym_t ksym) {
+	static bool compose_ready = false;
+
+	if (compose_ready)
+		return true;
+
+	bool starts_sequence = (ksym == XKB_KEY_Multi_key ||
+			(ksym >= XKB_KEY_dead_grave && ksym <= XKB_KEY_dead_longsolidusoverlay));
+	if (!task_done(&compose_task) && !starts_sequence)
+		return false;
+
+	task_join(&compose_task);
+	compose_ready = true;
+	return true;
+}
+#endif
+
 /*
  * Handle key presses. Fixes state, then looks up the key symbol for the
  * given keycode, then looks up the key symbol (as UCS-2), converts it to
@@ -378,6 +500,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
 	bool composed = false;
 #endif
 
+	metrics_key_received(event->time);
+
 	ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
 	ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
 
@@ -385,27 +509,25 @@ static void handle_key_press(xcb_key_press_event_t *event) {
 	memset(buffer, '\0', sizeof(buffer));
 
 #if XKBCOMPOSE == 1
-	if (xkb_compose_state && xkb_compose_state_feed(xkb_compose_state, ksym) == XKB_COMPOSE_FEED_ACCEPTED) {
-		switch (xkb_compose_state_get_status(xkb_compose_state)) {
-		case XKB_COMPOSE_NOTHING:
-			break;
-		case XKB_COMPOSE_COMPOSING:
-			return;
-		case XKB_COMPOSE_COMPOSED:
-			/*
-			 * xkb_compose_state_get_utf8 doesn't include
-			 * the terminating byte in the return value
-			 * as xkb_keysym_to_utf8 does. Adding one makes
-			 * the variable n consistent.
-			 */
-			n = xkb_compose_state_get_utf8(xkb_compose_state, buffer, sizeof(buffer)) + 1;
-			ksym = xkb_compose_state_get_one_sym(xkb_compose_state);
-			composed = true;
-			break;
-		case XKB_COMPOSE_CANCELLED:
-			xkb_compose_state_reset(xkb_compose_state);
-			return;
-		}
+	switch (compose_available(ksym) ? compose_feed(ksym) : COMPOSE_NOTHING) {
+	case COMPOSE_NOTHING:
+		break;
+	case COMPOSE_COMPOSING:
+		return;
+	case COMPOSE_COMPOSED:
+		/*
+		 * compose_get_utf8 doesn't include
+		 * the terminating byte in the return value
+		 * as xkb_keysym_to_utf8 does. Adding one makes
+		 * the variable n consistent.
+		 */
+		n = compose_get_utf8(buffer, sizeof(buffer)) + 1;
+		ksym = compose_get_one_sym();
+		composed = true;
+		break;
+	case COMPOSE_CANCELLED:
+		compose_reset();
+		return;
 	}
 
 	if (!composed) {
@@ -445,15 +567,13 @@ static void handle_key_press(xcb_key_press_event_t *event) {
 		case XKB_KEY_Escape:
 			if ((ksym == XKB_KEY_u && ctrl) ||
 					ksym == XKB_KEY_Escape) {
-				DEBUG("C-u pressed\n");
 				clear_input();
 				/* Hide the unlock indicator after a bit if the password buffer is
 				 * empty. */
 				if (unlock_indicator) {
 					START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
 					unlock_state = STATE_BACKSPACE_ACTIVE;
-					redraw_screen();
-					unlock_state = STATE_KEY_PRESSED;
+					schedule_redraw();
 				}
 				return;
 			}
@@ -483,8 +603,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
 			 * empty. */
 			START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
 			unlock_state = STATE_BACKSPACE_ACTIVE;
-			redraw_screen();
-			unlock_state = STATE_KEY_PRESSED;
+			schedule_redraw();
 			return;
 	}
 
@@ -508,15 +627,12 @@ static void handle_key_press(xcb_key_press_event_t *event) {
 	/* store it in the password array as UTF-8 */
 	memcpy(password + input_position, buffer, n - 1);
 	input_position += n - 1;
-	DEBUG("current password = %.*s\n", input_position, password);
 
 	if (unlock_indicator) {
 		unlock_state = STATE_KEY_ACTIVE;
-		redraw_screen();
-		unlock_state = STATE_KEY_PRESSED;
+		schedule_redraw();
 
-		struct ev_timer *timeout = NULL;
-		START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
+		START_TIMER(redraw_timeout_timer, TSTAMP_N_SECS(0.25), redraw_timeout);
 		STOP_TIMER(clear_indicator_timeout);
 	}
 
@@ -562,9 +678,16 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 		xcb_xkb_state_notify_event_t state_notify;
 	} *event = (union xkb_event *)gevent;
 
-	DEBUG("process_xkb_event for device %d\n", event->any.deviceID);
+	/* State changes follow the keys, see trace.h. */
+	if (event->any.xkbType != XCB_XKB_STATE_NOTIFY)
+		TRACE(TRACE_XKB_EVENT, event->any.xkbType, 0);
 
-	if (event->any.deviceID != xkb_x11_get_core_keyboard_device_id(conn))
+	/* The core keyboard changes when a different device is used, follow it. */
+	if (event->any.xkbType == XCB_XKB_NEW_KEYBOARD_NOTIFY &&
+			event->new_keyboard_notify.oldDeviceID == xkb_device_id)
+		xkb_device_id = event->new_keyboard_notify.deviceID;
+
+	if (event->any.deviceID != xkb_device_id)
 		return;
 
 	/*
@@ -648,14 +771,16 @@ void handle_screen_resize(void) {
 
 	free(geom);
 
-	redraw_screen();
+	/* The background pixmaps have the old size, get new ones. */
+	free_bg_pixmaps();
+	alloc_warm_up();
 
 	uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
 	xcb_configure_window(conn, win, mask, last_resolution);
 	xcb_flush(conn);
 
 	xinerama_query_screens();
-	redraw_screen();
+	schedule_redraw();
 }
 
 /*
@@ -668,10 +793,13 @@ static void xcb_got_event(EV_P_ struct ev_io *w, int revents) {
 }
 
 /*
- * Flush before blocking (and waiting for new events)
+ * Render the scheduled frame (if any) and flush before blocking (and waiting
+ * for new events)
  *
  */
 static void xcb_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+	wakeups++;
+	flush_redraw();
 	xcb_flush(conn);
 }
 
@@ -714,6 +842,11 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 
 		/* Strip off the highest bit (set if the event is generated) */
 		int type = (event->response_type & 0x7F);
+		/* Key events are not traced, see trace.h. */
+		if (type != XCB_KEY_PRESS && type != XCB_KEY_RELEASE)
+			TRACE(TRACE_X_EVENT, type, 0);
+		/* The event itself was allocated by libxcb, which is not counted. */
+		uint64_t allocations = alloc_count();
 
 		switch (type) {
 			case XCB_KEY_PRESS:
@@ -727,7 +860,7 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 				 * */
 				if (xkb_state_key_get_one_sym(xkb_state, ((xcb_key_press_event_t*)event)->detail) != XKB_KEY_BackSpace
 						&& xkb_state_key_get_one_sym(xkb_state, ((xcb_key_press_event_t*)event)->detail) != XKB_KEY_Escape)
-					redraw_screen();
+					schedule_redraw();
 
 				break;
 
@@ -735,18 +868,23 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 				handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
 				break;
 
-			case XCB_MAP_NOTIFY:
-				maybe_close_sleep_lock_fd();
-				if (!dont_fork) {
-					/* After the first MapNotify, we never fork again. We don’t
-					 * expect to get another MapNotify, but better be sure… */
-					dont_fork = true;
+			case XCB_EXPOSE:
+				handle_expose();
+				break;
 
-					/* In the parent process, we exit */
-					if (fork() != 0)
-						exit(0);
+			case XCB_GE_GENERIC:
+				handle_present_event(event);
+				break;
 
-					ev_loop_fork(EV_DEFAULT);
+			case XCB_MAP_NOTIFY:
+				maybe_close_sleep_lock_fd();
+				/* The screen is locked, let the parent waiting in
+				 * daemonize() exit. */
+				if (mapped_pipe != -1) {
+					if (write(mapped_pipe, "m", 1) != 1)
+						DEBUG("Could not notify the parent process\n");
+					close(mapped_pipe);
+					mapped_pipe = -1;
 				}
 				break;
 
@@ -759,24 +897,30 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 					process_xkb_event(event);
 		}
 
+		alloc_event_done(type, alloc_count() - allocations);
 		free(event);
 	}
 }
 
 /*
- * This function is called from a fork()ed child and will raise the i3lock
- * window when the window is obscured, even when the main i3lock process is
- * blocked due to the authentication backend.
+ * This function runs on its own thread, with its own X11 connection, and will
+ * raise the i3lock window when the window is obscured, even when the main
+ * thread is blocked due to the authentication backend.
  *
  */
-static void raise_loop(xcb_window_t window) {
+static void *raise_loop(void *arg) {
+	xcb_window_t window = (xcb_window_t)(uintptr_t)arg;
 	xcb_connection_t *conn;
 	xcb_generic_event_t *event;
+	bool watching = true;
 	int screens;
 
 	if ((conn = xcb_connect(NULL, &screens)) == NULL ||
-			xcb_connection_has_error(conn))
-		errx(EXIT_FAILURE, "Cannot open display\n");
+			xcb_connection_has_error(conn)) {
+		fprintf(stderr, "[i3lock] Cannot open display for raising the window\n");
+		xcb_disconnect(conn);
+		return NULL;
+	}
 
 	/* We need to know about the window being obscured or getting destroyed. */
 	xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
@@ -786,7 +930,7 @@ static void raise_loop(xcb_window_t window) {
 	xcb_flush(conn);
 
 	DEBUG("Watching window 0x%08x\n", window);
-	while ((event = xcb_wait_for_event(conn)) != NULL) {
+	while (watching && (event = xcb_wait_for_event(conn)) != NULL) {
 		if (event->response_type == 0) {
 			xcb_generic_error_t *error = (xcb_generic_error_t *)event;
 			DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
@@ -804,12 +948,12 @@ static void raise_loop(xcb_window_t window) {
 			case XCB_UNMAP_NOTIFY:
 				DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
 				if (((xcb_unmap_notify_event_t *)event)->window == window)
-					exit(EXIT_SUCCESS);
+					watching = false;
 				break;
 			case XCB_DESTROY_NOTIFY:
 				DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
 				if (((xcb_destroy_notify_event_t *)event)->window == window)
-					exit(EXIT_SUCCESS);
+					watching = false;
 				break;
 			default:
 				DEBUG("Unhandled event type %d\n", type);
@@ -817,6 +961,73 @@ static void raise_loop(xcb_window_t window) {
 		}
 		free(event);
 	}
+
+	xcb_disconnect(conn);
+	return NULL;
+}
+
+/*
+ * Starts raise_loop() for the lock window.
+ *
+ */
+static void start_raise_thread(void) {
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RAISE_THREAD_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* Failing is intentionally ignored here: while the thread is useful for
+	 * preventing other windows from popping up while i3lock blocks, it is
+	 * not critical. */
+	if (pthread_create(&thread, &attr, raise_loop, (void *)(uintptr_t)win) != 0)
+		DEBUG("Could not start the raise thread\n");
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Forks into the background. The parent waits until the lock window is mapped
+ * (so that e.g. "i3lock && echo mem > /sys/power/state" suspends with the
+ * screen locked) and exits, with the exit status of the child if the child
+ * fails before that.
+ *
+ * This is called before the image, the keymap or the cairo caches are
+ * allocated, so the fork only has a small address space to copy.
+ *
+ */
+static void daemonize(void) {
+	int fds[2];
+	if (pipe(fds) != 0)
+		err(EXIT_FAILURE, "pipe");
+	/* Keep the pipe out of processes started by PAM modules. */
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	pid_t pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+
+	if (pid == 0) {
+		close(fds[0]);
+		mapped_pipe = fds[1];
+		return;
+	}
+
+	/* The child holds the sleep lock until the window is mapped. */
+	close(fds[1]);
+	maybe_close_sleep_lock_fd();
+
+	char mapped;
+	ssize_t n;
+	while ((n = read(fds[0], &mapped, 1)) == -1 && errno == EINTR)
+		;
+	if (n == 1)
+		exit(EXIT_SUCCESS);
+
+	int status;
+	if (waitpid(pid, &status, 0) == pid && WIFEXITED(status))
+		exit(WEXITSTATUS(status));
+	exit(EXIT_FAILURE);
 }
 
 int verify_hex(char *arg, char *colortype, char *varname) {
@@ -866,24 +1077,77 @@ void build_kb_layout_groups(void){
 			kb_layouts_group[i][j] = toupper(kb_layouts_group[i][j]);
 }
 
+static void load_image(void) {
+	if (strlen(image_path) != 0) {
+		/* Create a pixmap to render on, fill it with the background color */
+		img = cairo_image_surface_create_from_png(image_path);
+		/* In case loading failed, we just pretend no -i was specified. */
+		if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "Could not load image \"%s\": %s\n",
+					image_path, cairo_status_to_string(cairo_surface_status(img)));
+			img = NULL;
+		}
+	}
+}
+
+/*
+ * Startup tasks, run concurrently with the X11 setup in main(). See tasks.c.
+ *
+ */
+struct pam_start_args {
+	const char *username;
+	struct pam_conv *conv;
+	int status;
+};
+
+static void pam_start_task(void *data) {
+	struct pam_start_args *args = data;
+
+#ifdef PAM_CONFDIR
+	/* Only in the end-to-end benchmark build (see bench/): use the PAM
+	 * services shipped there instead of the system configuration. */
+	const char *pam_service = getenv("I3LOCK_PAM_SERVICE");
+	args->status = pam_start_confdir(pam_service ? pam_service : "i3lock",
+			args->username, args->conv, PAM_CONFDIR, &pam_handle);
+#else
+	args->status = pam_start("i3lock", args->username, args->conv, &pam_handle);
+#endif
+	if (args->status != PAM_SUCCESS)
+		return;
+
+	args->status = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"));
+}
+
+static void load_image_task(void *data) {
+	load_image();
+}
+
+#if XKBCOMPOSE == 1
+static void load_compose_task(void *data) {
+	compose_load(data);
+}
+#endif
+
+static void warm_up_fonts_task(void *data) {
+	warm_up_fonts();
+}
+
 int main(int argc, char *argv[]) {
 	struct passwd *pw;
 	char *username;
 	char *config_path = "$HOME/.config/i3lock-fancier/config.ini";
-	int ret;
+	char *render_png_dir = NULL;
+	char *fake_screens = "1920x1080+0+0";
 	struct pam_conv conv = {conv_callback, NULL};
 	int curs_choice = CURS_NONE;
 	int o;
 	int longoptind = 0;
+	bool profile_startup = false;
+	char *profile_trace = NULL;
+	bool compile_theme = false;
+	bool theme_loaded = false;
 
-	/* Open display to determine keyboard layout */
-	int eventCode;
-	int errorReturn;
-	int major = XkbMajorVersion;
-	int minor = XkbMinorVersion;
-	int reasonReturn;
-	_display = XkbOpenDisplay("", &eventCode, &errorReturn, &major,
-			&minor, &reasonReturn);
+	startup_profile_start();
 
 
 	struct option longopts[] = {
@@ -891,6 +1155,12 @@ int main(int argc, char *argv[]) {
 		{"nofork", no_argument, NULL, 'n'},
 		{"beep", no_argument, NULL, 'b'},
 		{"config", required_argument, NULL, 'c'},
+		{"render-png", required_argument, NULL, 'R'},
+		{"screens", required_argument, NULL, 'S'},
+		{"bench", optional_argument, NULL, 'B'},
+		{"profile-startup", optional_argument, NULL, 'P'},
+		{"compile-theme", no_argument, NULL, 'T'},
+		{"trace", required_argument, NULL, 't'},
 
 		{NULL, no_argument, NULL, 0}};
 
@@ -898,6 +1168,7 @@ int main(int argc, char *argv[]) {
 		err(EXIT_FAILURE, "getpwuid() failed");
 	if ((username = pw->pw_name) == NULL)
 		errx(EXIT_FAILURE, "pw->pw_name is NULL.\n");
+	startup_phase_done("getpwuid");
 
 	char *optstring = "vnbc:";
 	while ((o = getopt_long(argc, argv, optstring, longopts, &longoptind)) != -1) {
@@ -913,6 +1184,24 @@ int main(int argc, char *argv[]) {
 			case 'c':
 				config_path = strdup(optarg);
 				break;
+			case 'R':
+				render_png_dir = optarg;
+				break;
+			case 'S':
+				fake_screens = optarg;
+				break;
+			case 'B':
+				exit(run_bench(optarg ? atoi(optarg) : BENCH_DEFAULT_FRAMES));
+			case 'P':
+				profile_startup = true;
+				profile_trace = optarg;
+				break;
+			case 'T':
+				compile_theme = true;
+				break;
+			case 't':
+				trace_start(optarg);
+				break;
 			default:
 				errx(EXIT_FAILURE, "Syntax: i3lock [-v] [-n] [-b]"
 						  " [-c config.ini]\n"
@@ -920,19 +1209,68 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	/** Parse configuration file **/
-	read_config(config_path);
+	startup_phase_done("parse arguments");
+
+	/** Parse configuration file, unless it was compiled into a theme **/
+	if (!compile_theme)
+		theme_loaded = theme_load(config_path);
+	if (!theme_loaded)
+		read_config(config_path);
+	startup_phase_done("read_config");
+
+	if (compile_theme) {
+		const char *expr = invalid_position_expr();
+		if (expr != NULL)
+			errx(EXIT_FAILURE, "Invalid position expression \"%s\"", expr);
+		load_image();
+		exit(theme_compile(config_path) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	/* Render all states to PNG files without locking anything. */
+	if (render_png_dir != NULL) {
+		if (!theme_loaded)
+			load_image();
+		exit(render_headless(render_png_dir, fake_screens));
+	}
 
 	/* We need (relatively) random numbers for highlighting a random part of
 	 * the unlock indicator upon keypresses. */
 	srand(time(NULL));
 
-	/* Initialize PAM */
-	if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
-		errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+	const char *locale = getenv("LC_ALL");
+	if (!locale || !*locale)
+		locale = getenv("LC_CTYPE");
+	if (!locale || !*locale)
+		locale = getenv("LANG");
+	if (!locale || !*locale) {
+		if (debug_mode)
+			fprintf(stderr, "Can't detect your locale, fallback to C\n");
+		locale = "C";
+	}
+
+	/* setlocale() is not thread-safe, call it before starting any tasks. */
+	setlocale(LC_ALL, locale);
+	startup_phase_done("setlocale");
+
+	/* Fork before any threads are started and anything big is allocated. */
+	if (!dont_fork) {
+		daemonize();
+		startup_phase_done("fork");
+	}
+	trace_write_at_exit();
 
-	if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
-		errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+	/*
+	 * Start the steps which do not need the X11 connection on their own
+	 * threads: PAM (loads its modules), the PNG decoding and fontconfig. They
+	 * are joined where their result is needed.
+	 */
+	task_t pam_task = {0}, image_task = {0}, fonts_task = {0};
+	struct pam_start_args pam_args = {username, &conv, PAM_SUCCESS};
+	task_start(&pam_task, "pam_start", pam_start_task, &pam_args);
+	if (!theme_loaded && strlen(image_path) != 0)
+		task_start(&image_task, "load image", load_image_task, NULL);
+	task_start(&fonts_task, "warm up fonts", warm_up_fonts_task, NULL);
+	startup_phase_done("start tasks");
 
 	/* Using mlock() as non-super-user seems only possible in Linux.
 	 * Users of other operating systems should use encrypted swap/no swap
@@ -946,6 +1284,17 @@ int main(int argc, char *argv[]) {
 	if (mlock(password, sizeof(password)) != 0)
 		err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
 #endif
+	startup_phase_done("mlock");
+
+	/* Open display to determine keyboard layout */
+	int eventCode;
+	int errorReturn;
+	int major = XkbMajorVersion;
+	int minor = XkbMinorVersion;
+	int reasonReturn;
+	_display = XkbOpenDisplay("", &eventCode, &errorReturn, &major,
+			&minor, &reasonReturn);
+	startup_phase_done("XkbOpenDisplay");
 
 	/* Double checking that connection is good and operatable with xcb */
 	int screennr;
@@ -953,16 +1302,52 @@ int main(int argc, char *argv[]) {
 			xcb_connection_has_error(conn))
 		errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
 
-	if (xkb_x11_setup_xkb_extension(conn,
-				XKB_X11_MIN_MAJOR_XKB_VERSION,
-				XKB_X11_MIN_MINOR_XKB_VERSION,
-				0,
-				NULL,
-				NULL,
-				&xkb_base_event,
-				&xkb_base_error) != 1)
+	/*
+	 * Everything up to the first frame is sent in two batches to keep the
+	 * number of round trips down: first the QueryExtension requests, then
+	 * every request needing an extension, before waiting for any reply.
+	 */
+	xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+	xcb_prefetch_extension_data(conn, &xcb_xinerama_id);
+	xcb_prefetch_extension_data(conn, &xcb_present_id);
+	startup_phase_done("xcb_connect");
+
+	const xcb_query_extension_reply_t *xkb_extension = xcb_get_extension_data(conn, &xcb_xkb_id);
+	if (!xkb_extension || !xkb_extension->present)
 		errx(EXIT_FAILURE, "Could not setup XKB extension.");
 
+	xcb_xkb_use_extension_cookie_t use_extension_cookie = xcb_xkb_use_extension(conn,
+			XKB_X11_MIN_MAJOR_XKB_VERSION,
+			XKB_X11_MIN_MINOR_XKB_VERSION);
+	xcb_xkb_get_device_info_cookie_t device_info_cookie = xcb_xkb_get_device_info(conn,
+			XCB_XKB_ID_USE_CORE_KBD, 0, 0, 0, 0, 0, 0);
+	xcb_intern_atom_cookie_t rules_names_cookie = xcb_intern_atom(conn, true,
+			strlen("_XKB_RULES_NAMES"), "_XKB_RULES_NAMES");
+	xinerama_init();
+	present_query_version(conn);
+
+	xcb_xkb_use_extension_reply_t *use_extension_reply =
+		xcb_xkb_use_extension_reply(conn, use_extension_cookie, NULL);
+	if (!use_extension_reply || !use_extension_reply->supported)
+		errx(EXIT_FAILURE, "Could not setup XKB extension.");
+	free(use_extension_reply);
+	xkb_base_event = xkb_extension->first_event;
+	xkb_base_error = xkb_extension->first_error;
+
+	xcb_xkb_get_device_info_reply_t *device_info_reply =
+		xcb_xkb_get_device_info_reply(conn, device_info_cookie, NULL);
+	if (!device_info_reply)
+		errx(EXIT_FAILURE, "Could not get the core keyboard device.");
+	xkb_device_id = device_info_reply->deviceID;
+	free(device_info_reply);
+
+	xcb_intern_atom_reply_t *rules_names_reply =
+		xcb_intern_atom_reply(conn, rules_names_cookie, NULL);
+	if (rules_names_reply && rules_names_reply->atom != XCB_NONE)
+		set_keymap_cache_name(xcb_setup_roots_iterator(xcb_get_setup(conn)).data->root,
+				rules_names_reply->atom);
+	free(rules_names_reply);
+
 	static const xcb_xkb_map_part_t required_map_parts =
 		(XCB_XKB_MAP_PART_KEY_TYPES |
 		 XCB_XKB_MAP_PART_KEY_SYMS |
@@ -979,37 +1364,24 @@ int main(int argc, char *argv[]) {
 
 	xcb_xkb_select_events(
 			conn,
-			xkb_x11_get_core_keyboard_device_id(conn),
+			xkb_device_id,
 			required_events,
 			0,
 			required_events,
 			required_map_parts,
 			required_map_parts,
 			0);
+	startup_phase_done("xkb extension setup");
 
-	/* When we cannot initially load the keymap, we better exit */
-	if (!load_keymap())
+	/* When we cannot initially load the keymap, we better exit. The keymap
+	 * is only used once the keyboard is grabbed, at which point it is
+	 * downloaded anyway, so the cached one is good enough until then. */
+	if (!load_cached_keymap() && !load_keymap())
 		errx(EXIT_FAILURE, "Could not load keymap");
+	startup_phase_done("load_keymap");
 
-	const char *locale = getenv("LC_ALL");
-	if (!locale || !*locale)
-		locale = getenv("LC_CTYPE");
-	if (!locale || !*locale)
-		locale = getenv("LANG");
-	if (!locale || !*locale) {
-		if (debug_mode)
-			fprintf(stderr, "Can't detect your locale, fallback to C\n");
-		locale = "C";
-	}
-
-	setlocale(LC_ALL, locale);
-
-#if XKBCOMPOSE == 1
-	load_compose_table(locale);
-#endif
-
-	xinerama_init();
 	xinerama_query_screens();
+	startup_phase_done("xinerama");
 
 	screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
 
@@ -1019,60 +1391,66 @@ int main(int argc, char *argv[]) {
 	xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
 			(uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
-	if (strlen(image_path) != 0) {
-		/* Create a pixmap to render on, fill it with the background color */
-		img = cairo_image_surface_create_from_png(image_path);
-		/* In case loading failed, we just pretend no -i was specified. */
-		if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-			fprintf(stderr, "Could not load image \"%s\": %s\n",
-					image_path, cairo_status_to_string(cairo_surface_status(img)));
-			img = NULL;
-		}
-	}
-
+	task_join(&image_task);
+	startup_phase_done("wait for image");
 
 	build_kb_layout_groups();
+	startup_phase_done("build_kb_layout_groups");
 
 	/* Pixmap on which the image is rendered to (if any) */
 	xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
+	startup_phase_done("draw_image");
+
+	/* Only lock the screen once we know we can unlock it again. */
+	task_join(&pam_task);
+	if (pam_args.status != PAM_SUCCESS)
+		errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, pam_args.status));
+	startup_phase_done("wait for pam_start");
 
 	/* Open the fullscreen window, already with the correct pixmap in place */
 	win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-	xcb_free_pixmap(conn, bg_pixmap);
+	init_present();
+	startup_phase_done("map window");
+
+#if XKBCOMPOSE == 1
+	/* Most passwords do not need the compose table, so load it off the way
+	 * to a locked screen. See compose_available(). */
+	task_start(&compose_task, "compose_load", load_compose_task, (void *)locale);
+#endif
 
 	cursor = create_cursor(conn, screen, win, curs_choice);
+	startup_phase_done("create_cursor");
+
+	/* Initialize the libev event loop. */
+	main_loop = EV_DEFAULT;
+	if (main_loop == NULL)
+		errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
 
 	/* Display the "locking…" message while trying to grab the pointer/keyboard. */
 	auth_state = STATE_AUTH_LOCK;
-	grab_pointer_and_keyboard(conn, screen, cursor);
+	grab_pointer_and_keyboard(main_loop, conn, screen, cursor);
+	startup_phase_done("grab_pointer_and_keyboard");
 
-	pid_t pid = fork();
-	/* The pid == -1 case is intentionally ignored here:
-	 * While the child process is useful for preventing other windows from
-	 * popping up while i3lock blocks, it is not critical. */
-	if (pid == 0) {
-		/* Child */
-		close(xcb_get_file_descriptor(conn));
-		maybe_close_sleep_lock_fd();
-		raise_loop(win);
-		exit(EXIT_SUCCESS);
-	}
+	task_join(&fonts_task);
+	startup_phase_done("wait for fonts");
+
+	start_raise_thread();
+	startup_phase_done("start raise thread");
 
 	/* Load the keymap again to sync the current modifier state. Since we first
 	 * loaded the keymap, there might have been changes, but starting from now,
 	 * we should get all key presses/releases due to having grabbed the
-	 * keyboard.
+	 * keyboard. This also replaces the cached keymap, should the cache have
+	 * been outdated.
 	 */
-	(void)load_keymap();
-
-	/* Initialize the libev event loop. */
-	main_loop = EV_DEFAULT;
-	if (main_loop == NULL)
-		errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
+	if (load_keymap())
+		update_keymap_cache();
+	startup_phase_done("load_keymap (grabbed)");
 
 	/* Explicitly call the screen redraw in case "locking…" message was displayed */
 	auth_state = STATE_AUTH_IDLE;
 	redraw_screen();
+	startup_phase_done("first redraw");
 
 	struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
 	struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
@@ -1094,5 +1472,27 @@ int main(int argc, char *argv[]) {
 	if (show_clock) {
 		start_time_redraw_tick(main_loop);
 	}
+
+	/* Only catch SIGUSR1 if asked to: by default it terminates i3lock. */
+	if (stats_file[0] != '\0' || trace_enabled) {
+		struct ev_signal *stats_signal = calloc(sizeof(struct ev_signal), 1);
+		ev_signal_init(stats_signal, dump_stats_cb, SIGUSR1);
+		ev_signal_start(main_loop, stats_signal);
+	}
+
+	/* Only listen for statistics clients if asked to. */
+	stats_socket_start(main_loop);
+
+	/* Pick up changes to the configuration without unlocking. */
+	config_watch_start(main_loop, config_path);
+	startup_phase_done("event loop setup");
+
+	if (profile_startup) {
+		if (profile_trace == NULL)
+			startup_profile_dump(stderr);
+		else if (!startup_profile_write_trace(profile_trace))
+			fprintf(stderr, "Could not write startup trace to %s\n", profile_trace);
+	}
+
 	ev_loop(main_loop, 0);
 }
@@ -257,6 +257,30 @@ const char* ini_get(ini_t *ini, const char *section, const char *key) {
 }
 
 
+void ini_each(ini_t *ini, ini_callback_t callback, void *udata) {
+  char *current_section = "";
+  char *val;
+  char *p = ini->data;
+
+  if (*p == '\0') {
+    p = next(ini, p);
+  }
+
+  while (p < ini->end) {
+    if (*p == '[') {
+      current_section = p + 1;
+
+    } else {
+      val = next(ini, p);
+      callback(current_section, p, val, udata);
+      p = val;
+    }
+
+    p = next(ini, p);
+  }
+}
+
+
 int ini_sget(
   ini_t *ini, const char *section, const char *key,
   const char *scanfmt, void *dst
@@ -11,10 +11,12 @@
 #define INI_VERSION "0.1.1"
 
 typedef struct ini_t ini_t;
+typedef void (*ini_callback_t)(const char *section, const char *key, const char *value, void *udata);
 
 ini_t*      ini_load(const char *filename);
 void        ini_free(ini_t *ini);
 const char* ini_get(ini_t *ini, const char *section, const char *key);
 int         ini_sget(ini_t *ini, const char *section, const char *key, const char *scanfmt, void *dst);
+void        ini_each(ini_t *ini, ini_callback_t callback, void *udata);
 
 #endif
@@ -0,0 +1,438 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * layout.c: Places the widgets on the screens. The position expressions of
+ *           the configuration are evaluated for all screens at once, with
+ *           the screen geometry in one array per variable, and the result is
+ *           kept until the screens or the configuration change. Frames in
+ *           between only look the placements up.
+ *
+ *           Each expression records the values it reads. When some of them
+ *           change, only the expressions depending on them (directly or via
+ *           ix/iy/tx/ty) are evaluated again, and only the widgets which
+ *           actually moved are reported as damaged.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <err.h>
+
+#include "i3lock.h"
+#include "settings.h"
+#include "xinerama.h"
+#include "tinyexpr.h"
+#include "layout.h"
+#include "trace.h"
+
+/* The widget expressions, in the order they have to be evaluated in. */
+enum {
+    UNLOCK_X, UNLOCK_Y,
+    TIME_X, TIME_Y,
+    DATE_X, DATE_Y,
+    KEY_X, KEY_Y,
+    EXPRS
+};
+
+/*
+ * The per-screen values, one array of capacity values each: the screen
+ * geometry, then the result of every expression (the first four of which
+ * are the variables ix, iy, tx and ty).
+ *
+ */
+enum {
+    COL_W, COL_H,
+    COL_X, COL_Y,
+    COL_EXPRS,
+    COLUMNS = COL_EXPRS + EXPRS
+};
+
+/* What an expression reads: one bit per column, then the constants. */
+enum {
+    DEP_CW = COLUMNS,
+    DEP_CH,
+    DEP_R
+};
+#define DEP(index) (1u << (index))
+#define DEP_EXPR(expr) DEP(COL_EXPRS + (expr))
+
+/* Everything the placements depend on, apart from the screens. */
+struct layout_key {
+    int screen_number;
+    int ring_diameter;
+    double radius;
+    int snap[4];
+    char exprs[EXPRS][32];
+};
+
+static struct {
+    bool valid;
+    struct layout_key key;
+    int xr_screens;
+    Rect *screens;
+    int capacity;
+    /* COLUMNS arrays of capacity values */
+    double *columns;
+    /* EXPRS arrays of capacity values, the widget origins */
+    double *placements;
+    /* the same, from before the widgets were placed again */
+    double *previous;
+    /* the previous values of an array, to tell whether it changed */
+    double *scratch;
+
+    /* compiled against the columns and the constants below */
+    te_expr *exprs[EXPRS];
+    te_program *programs[EXPRS];
+    uint32_t deps[EXPRS];
+    double clock_width;
+    double clock_height;
+    double radius;
+
+    layout_t layout;
+    layout_t previous_layout;
+} state;
+
+static double *column(int index) {
+    return &state.columns[(size_t)index * state.capacity];
+}
+
+/*
+ * Rounds a widget origin to the device pixel grid if snapping is enabled for
+ * that widget. Composites at integer offsets let pixman use a plain copy
+ * instead of resampling the whole layer through the bilinear filter.
+ */
+static double snap_to_pixel(double coord, int snap) {
+    return snap ? round(coord) : coord;
+}
+
+static void get_key(struct layout_key *key, int ring_diameter) {
+    const char *exprs[EXPRS] = {
+        unlock_x_expr, unlock_y_expr,
+        time_x_expr, time_y_expr,
+        date_x_expr, date_y_expr,
+        key_x_expr, key_y_expr
+    };
+
+    memset(key, 0, sizeof(*key));
+    key->screen_number = screen_number;
+    key->ring_diameter = ring_diameter;
+    key->radius = circle_radius;
+    key->snap[0] = snap_unlock;
+    key->snap[1] = snap_time;
+    key->snap[2] = snap_date;
+    key->snap[3] = snap_keyboard;
+    for (int i = 0; i < EXPRS; i++)
+        strncpy(key->exprs[i], exprs[i], sizeof(key->exprs[i]) - 1);
+}
+
+/*
+ * Returns the screens the widgets are placed on: the one given by
+ * screen_number, or all of them. Without Xinerama, the root window is
+ * treated as a single screen.
+ *
+ */
+static const Rect *get_screens(const uint32_t *resolution, Rect *root, int *count) {
+    if (xr_screens <= 0) {
+        *root = (Rect){0, 0, resolution[0], resolution[1]};
+        *count = 1;
+        return root;
+    } else if (screen_number != -1 && screen_number < xr_screens) {
+        *count = 1;
+        return &xr_resolutions[screen_number];
+    } else {
+        *count = xr_screens;
+        return xr_resolutions;
+    }
+}
+
+/* Points the origins of the layout into placements arrays of count values. */
+static void set_origins(layout_t *l, double *p, int count) {
+    l->ring_x = &p[UNLOCK_X * count];
+    l->ring_y = &p[UNLOCK_Y * count];
+    l->time_x = &p[TIME_X * count];
+    l->time_y = &p[TIME_Y * count];
+    l->date_x = &p[DATE_X * count];
+    l->date_y = &p[DATE_Y * count];
+    l->key_x = &p[KEY_X * count];
+    l->key_y = &p[KEY_Y * count];
+}
+
+/*
+ * Makes room for count screens. Returns false if the columns moved, in
+ * which case the expressions have to be compiled again.
+ *
+ */
+static bool reserve(int count) {
+    if (count <= state.capacity)
+        return true;
+
+    state.capacity = count;
+    state.screens = realloc(state.screens, sizeof(Rect) * count);
+    state.columns = realloc(state.columns, sizeof(double) * COLUMNS * count);
+    state.placements = realloc(state.placements, sizeof(double) * EXPRS * count);
+    state.previous = realloc(state.previous, sizeof(double) * EXPRS * count);
+    state.scratch = realloc(state.scratch, sizeof(double) * count);
+    if (!state.screens || !state.columns || !state.placements ||
+        !state.previous || !state.scratch)
+        err(EXIT_FAILURE, "Could not allocate the layout");
+
+    set_origins(&state.layout, state.placements, count);
+    set_origins(&state.previous_layout, state.previous, count);
+    state.layout.previous = &state.previous_layout;
+    return false;
+}
+
+/* Copies the screen geometry into the columns, returning what changed. */
+static uint32_t set_screens(const Rect *screens, int count) {
+    uint32_t changed = 0;
+    double *w = column(COL_W), *h = column(COL_H);
+    double *x = column(COL_X), *y = column(COL_Y);
+
+    for (int i = 0; i < count; i++) {
+        if (w[i] != screens[i].width)
+            changed |= DEP(COL_W);
+        if (h[i] != screens[i].height)
+            changed |= DEP(COL_H);
+        if (x[i] != screens[i].x)
+            changed |= DEP(COL_X);
+        if (y[i] != screens[i].y)
+            changed |= DEP(COL_Y);
+        w[i] = screens[i].width;
+        h[i] = screens[i].height;
+        x[i] = screens[i].x;
+        y[i] = screens[i].y;
+    }
+
+    memcpy(state.screens, screens, sizeof(Rect) * count);
+    state.xr_screens = xr_screens;
+    return changed;
+}
+
+/* The constants are folded into the programs. */
+static void flatten(int expr) {
+    const double *constants[] = {&state.clock_width, &state.clock_height, &state.radius};
+
+    te_program_free(state.programs[expr]);
+    state.programs[expr] = te_flatten(state.exprs[expr], constants, 3);
+}
+
+/* Compiles the expressions and records what each of them reads. */
+static void compile_exprs(const struct layout_key *key) {
+    const te_variable vars[] = {
+        {"w", column(COL_W)}, {"h", column(COL_H)},
+        {"x", column(COL_X)}, {"y", column(COL_Y)},
+        {"ix", column(COL_EXPRS + UNLOCK_X)}, {"iy", column(COL_EXPRS + UNLOCK_Y)},
+        {"tx", column(COL_EXPRS + TIME_X)}, {"ty", column(COL_EXPRS + TIME_Y)},
+        {"cw", &state.clock_width}, {"ch", &state.clock_height},
+        {"r", &state.radius}
+    };
+    const uint32_t var_deps[] = {
+        DEP(COL_W), DEP(COL_H),
+        DEP(COL_X), DEP(COL_Y),
+        DEP_EXPR(UNLOCK_X), DEP_EXPR(UNLOCK_Y),
+        DEP_EXPR(TIME_X), DEP_EXPR(TIME_Y),
+        DEP(DEP_CW), DEP(DEP_CH),
+        DEP(DEP_R)
+    };
+    const int var_count = sizeof(vars) / sizeof(vars[0]);
+
+    for (int i = 0; i < EXPRS; i++) {
+        int error;
+        te_program_free(state.programs[i]);
+        te_free(state.exprs[i]);
+        state.programs[i] = NULL;
+
+        state.exprs[i] = te_compile(key->exprs[i], vars, var_count, &error);
+        if (state.exprs[i] == NULL)
+            DEBUG("Invalid position expression \"%s\" (error at %d)\n", key->exprs[i], error);
+
+        state.deps[i] = 0;
+        for (int v = 0; v < var_count; v++)
+            if (te_reads(state.exprs[i], vars[v].address))
+                state.deps[i] |= var_deps[v];
+        flatten(i);
+    }
+
+    /* Without both expressions, the indicator goes to the screen center. */
+    if (!state.programs[UNLOCK_X] || !state.programs[UNLOCK_Y]) {
+        state.deps[UNLOCK_X] = DEP(COL_X) | DEP(COL_W);
+        state.deps[UNLOCK_Y] = DEP(COL_Y) | DEP(COL_H);
+    }
+    /* Without both expressions, there is no clock. */
+    if (!state.programs[TIME_X] || !state.programs[TIME_Y])
+        state.deps[TIME_X] = state.deps[TIME_Y] = 0;
+}
+
+/* Evaluates the expression for all screens into its column. */
+static void evaluate(int expr) {
+    int n = state.layout.count;
+    double *out = column(COL_EXPRS + expr);
+
+    if ((expr == UNLOCK_X || expr == UNLOCK_Y) &&
+        (!state.programs[UNLOCK_X] || !state.programs[UNLOCK_Y])) {
+        const double *pos = column(expr == UNLOCK_X ? COL_X : COL_Y);
+        const double *size = column(expr == UNLOCK_X ? COL_W : COL_H);
+        for (int i = 0; i < n; i++)
+            out[i] = pos[i] + size[i] / 2;
+    } else if (state.programs[expr] == NULL ||
+               ((expr == TIME_X || expr == TIME_Y) &&
+                (!state.programs[TIME_X] || !state.programs[TIME_Y]))) {
+        for (int i = 0; i < n; i++)
+            out[i] = NAN;
+    } else {
+        te_run_batch(state.programs[expr], out, n);
+    }
+}
+
+/* Whether the first n values differ, NaN being equal to NaN. */
+static bool values_differ(const double *a, const double *b, int n) {
+    for (int i = 0; i < n; i++)
+        if (a[i] != b[i] && !(isnan(a[i]) && isnan(b[i])))
+            return true;
+    return false;
+}
+
+/*
+ * Evaluates the expressions reading anything in changed (or all of them),
+ * in order. An expression whose results differ from before is added to
+ * changed, so that the ones using it are evaluated as well.
+ *
+ */
+static uint32_t evaluate_changed(uint32_t changed, bool all) {
+    int n = state.layout.count;
+
+    for (int i = 0; i < EXPRS; i++) {
+        if (!all && !(state.deps[i] & changed))
+            continue;
+
+        double *out = column(COL_EXPRS + i);
+        memcpy(state.scratch, out, sizeof(double) * n);
+        evaluate(i);
+        if (all || values_differ(state.scratch, out, n))
+            changed |= DEP_EXPR(i);
+    }
+
+    return changed;
+}
+
+/* Turns the position of expression expr on screen i into a widget origin. */
+static double placement(int expr, int i, const struct layout_key *key) {
+    double value = column(COL_EXPRS + expr)[i];
+
+    switch (expr) {
+        case UNLOCK_X:
+        case UNLOCK_Y:
+            return snap_to_pixel(value - key->ring_diameter / 2, key->snap[0]);
+        case TIME_X:
+        case TIME_Y:
+            return snap_to_pixel(value, key->snap[1]);
+        case DATE_X:
+        case DATE_Y:
+            /* The date is drawn with the clock. */
+            if (isnan(column(COL_EXPRS + TIME_X)[i]))
+                return NAN;
+            return snap_to_pixel(value, key->snap[2]);
+        default:
+            /* The keyboard indicators are centered on the position. */
+            return snap_to_pixel(value, key->snap[3]) -
+                   (expr == KEY_X ? INDICATORS_WIDTH : INDICATORS_HEIGHT) / 2;
+    }
+}
+
+/*
+ * Computes the origins of the widgets whose positions changed, and adds
+ * the ones which moved to the damage of the layout. Their previous origins
+ * are kept in state.previous.
+ *
+ */
+static void place_widgets(uint32_t changed, const struct layout_key *old, const struct layout_key *key) {
+    static const struct {
+        unsigned damage;
+        int expr;
+        uint32_t deps;
+    } widgets[] = {
+        {LAYOUT_RING, UNLOCK_X, DEP_EXPR(UNLOCK_X) | DEP_EXPR(UNLOCK_Y)},
+        {LAYOUT_TIME, TIME_X, DEP_EXPR(TIME_X) | DEP_EXPR(TIME_Y)},
+        {LAYOUT_DATE, DATE_X, DEP_EXPR(DATE_X) | DEP_EXPR(DATE_Y) | DEP_EXPR(TIME_X)},
+        {LAYOUT_KEY, KEY_X, DEP_EXPR(KEY_X) | DEP_EXPR(KEY_Y)},
+    };
+    int n = state.layout.count;
+
+    for (int w = 0; w < 4; w++) {
+        if (!(widgets[w].deps & changed) &&
+            old->snap[w] == key->snap[w] &&
+            (w != 0 || old->ring_diameter == key->ring_diameter))
+            continue;
+
+        for (int p = widgets[w].expr; p <= widgets[w].expr + 1; p++) {
+            double *out = &state.placements[(size_t)p * state.capacity];
+            double *before = &state.previous[(size_t)p * state.capacity];
+            memcpy(before, out, sizeof(double) * n);
+            for (int i = 0; i < n; i++)
+                out[i] = placement(p, i, key);
+            if (values_differ(before, out, n))
+                state.layout.damage |= widgets[w].damage;
+        }
+    }
+}
+
+/*
+ * Returns the placements of the widgets on all screens for the given root
+ * window resolution and unlock indicator size. Only what depends on changed
+ * screens, settings or arguments is computed again, layout->damage tells
+ * which widgets moved since the previous call.
+ *
+ */
+const layout_t *layout_update(const uint32_t *resolution, int ring_diameter) {
+    struct layout_key key;
+    Rect root;
+    int count;
+    const Rect *screens = get_screens(resolution, &root, &count);
+
+    get_key(&key, ring_diameter);
+    state.layout.damage = 0;
+
+    if (state.valid &&
+        memcmp(&key, &state.key, sizeof(key)) == 0 &&
+        state.xr_screens == xr_screens && count == state.layout.count &&
+        memcmp(screens, state.screens, sizeof(Rect) * count) == 0)
+        return &state.layout;
+
+    uint32_t changed;
+    if (!state.valid || !reserve(count) || count != state.layout.count ||
+        memcmp(key.exprs, state.key.exprs, sizeof(key.exprs)) != 0) {
+        /* Start over. */
+        reserve(count);
+        memset(state.columns, 0, sizeof(double) * COLUMNS * state.capacity);
+        memset(state.placements, 0, sizeof(double) * EXPRS * state.capacity);
+        state.layout.count = state.previous_layout.count = count;
+        state.clock_width = CLOCK_WIDTH;
+        state.clock_height = CLOCK_HEIGHT;
+        state.radius = key.radius;
+        compile_exprs(&key);
+        set_screens(screens, count);
+        evaluate_changed(0, true);
+        state.key = key;
+        place_widgets(~0u, &key, &key);
+        state.layout.damage = LAYOUT_ALL;
+    } else {
+        changed = set_screens(screens, count);
+        if (key.radius != state.key.radius) {
+            state.radius = key.radius;
+            changed |= DEP(DEP_R);
+            for (int i = 0; i < EXPRS; i++)
+                if (state.deps[i] & DEP(DEP_R))
+                    flatten(i);
+        }
+        changed = evaluate_changed(changed, false);
+        place_widgets(changed, &state.key, &key);
+        state.key = key;
+    }
+    state.valid = true;
+
+    TRACE(TRACE_LAYOUT, state.layout.count, state.layout.damage);
+    return &state.layout;
+}
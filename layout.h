@@ -0,0 +1,41 @@
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+#include <stdint.h>
+
+/* Size of the clock and date widgets. */
+#define CLOCK_WIDTH 400
+#define CLOCK_HEIGHT 200
+
+/* Size of the keyboard layout and caps lock widgets. */
+#define INDICATORS_WIDTH 300
+#define INDICATORS_HEIGHT 300
+
+/* Widgets which moved since the previous layout_update(). */
+#define LAYOUT_RING (1 << 0)
+#define LAYOUT_TIME (1 << 1)
+#define LAYOUT_DATE (1 << 2)
+#define LAYOUT_KEY (1 << 3)
+#define LAYOUT_ALL (LAYOUT_RING | LAYOUT_TIME | LAYOUT_DATE | LAYOUT_KEY)
+
+/*
+ * Where the widgets go on each screen, as widget origins in pixels. A
+ * coordinate is NaN if the widget is not placed (e.g. its expression is
+ * invalid).
+ *
+ */
+typedef struct layout {
+    int count;
+    unsigned damage;
+    double *ring_x, *ring_y;
+    double *time_x, *time_y;
+    double *date_x, *date_y;
+    double *key_x, *key_y;
+    /* Where the damaged widgets were before. Meaningless if all of them
+     * are damaged, which is also the case when the layout started over. */
+    const struct layout *previous;
+} layout_t;
+
+const layout_t *layout_update(const uint32_t *resolution, int ring_diameter);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * metrics.c: fixed-size latency histograms. Recording a value is a couple of
+ * integer operations and never allocates, so it is safe to use in the frame
+ * and input paths.
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+histogram_t present_latency;
+
+histogram_t key_queue_latency;
+histogram_t key_render_latency;
+histogram_t key_upload_latency;
+histogram_t key_present_latency;
+histogram_t key_total_latency;
+
+uint64_t grab_usec;
+int grab_retries;
+
+uint64_t frames_requested;
+uint64_t frames_rendered;
+uint64_t frames_merged;
+
+histogram_t render_background_time;
+histogram_t render_ring_time;
+histogram_t render_status_time;
+histogram_t render_keyboard_time;
+histogram_t render_clock_time;
+histogram_t render_composite_time;
+
+histogram_t pam_latency;
+
+uint64_t wakeups;
+
+/*
+ * Event timestamps are in milliseconds of the X server's clock, which is not
+ * the same as ours. The smallest difference seen between the two is taken as
+ * zero queueing delay; anything above it is time the event spent in transit.
+ */
+static bool have_server_clock;
+static uint32_t last_server_time;
+static uint64_t server_usec;
+static int64_t min_clock_offset;
+
+/* Receive time of the oldest keypress which was not rendered yet. */
+static uint64_t pending_input;
+
+/* Timestamps of the last frames, indexed by serial. */
+#define FRAME_QUEUE 8
+static struct frame_stamp {
+	uint32_t serial;
+	uint64_t input;
+	uint64_t rendered;
+	uint64_t flushed;
+} frames[FRAME_QUEUE];
+
+/* Returns the CLOCK_MONOTONIC time in microseconds. */
+uint64_t now_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void histogram_add(histogram_t *h, uint64_t usec) {
+	int bucket = 0;
+	while (bucket < HISTOGRAM_BUCKETS - 1 && (usec >> bucket) != 0)
+		bucket++;
+
+	h->buckets[bucket]++;
+	if (h->count == 0 || usec < h->min)
+		h->min = usec;
+	if (usec > h->max)
+		h->max = usec;
+	h->count++;
+	h->sum += usec;
+}
+
+/*
+ * Returns an estimate of the given percentile (0-100): the upper bound of the
+ * bucket containing it, clamped to the largest recorded value.
+ */
+uint64_t histogram_percentile(const histogram_t *h, double percentile) {
+	if (h->count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(h->count * percentile / 100.0);
+	if (rank >= h->count)
+		rank = h->count - 1;
+
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		seen += h->buckets[bucket];
+		if (seen > rank) {
+			uint64_t upper = (bucket == 0 ? 0 : ((uint64_t)1 << bucket) - 1);
+			if (upper > h->max)
+				upper = h->max;
+			if (upper < h->min)
+				upper = h->min;
+			return upper;
+		}
+	}
+
+	return h->max;
+}
+
+/*
+ * Called when a keypress event was read from the X connection, with the
+ * timestamp the server put into the event.
+ *
+ */
+void metrics_key_received(uint32_t server_time) {
+	uint64_t received = now_usec();
+
+	/* Extend the server time to 64 bit, it wraps around after ~49 days. */
+	if (have_server_clock)
+		server_usec += (uint64_t)(uint32_t)(server_time - last_server_time) * 1000;
+	else
+		server_usec = (uint64_t)server_time * 1000;
+	last_server_time = server_time;
+
+	int64_t offset = (int64_t)received - (int64_t)server_usec;
+	if (!have_server_clock || offset < min_clock_offset)
+		min_clock_offset = offset;
+	have_server_clock = true;
+
+	histogram_add(&key_queue_latency, offset - min_clock_offset);
+
+	if (pending_input == 0)
+		pending_input = received;
+}
+
+/*
+ * Called when the frame with the given serial was rendered. Returns true if
+ * it is the first frame showing a keypress, i.e. if its latency is tracked.
+ *
+ */
+bool metrics_frame_rendered(uint32_t serial) {
+	struct frame_stamp *frame = &frames[serial % FRAME_QUEUE];
+
+	frame->serial = serial;
+	frame->rendered = now_usec();
+	frame->flushed = 0;
+	frame->input = pending_input;
+	pending_input = 0;
+
+	if (frame->input != 0)
+		histogram_add(&key_render_latency, frame->rendered - frame->input);
+	return frame->input != 0;
+}
+
+void metrics_frame_flushed(uint32_t serial) {
+	struct frame_stamp *frame = &frames[serial % FRAME_QUEUE];
+	if (frame->serial != serial)
+		return;
+
+	frame->flushed = now_usec();
+	if (frame->input != 0)
+		histogram_add(&key_upload_latency, frame->flushed - frame->rendered);
+}
+
+/*
+ * Called when the frame with the given serial was shown, with the time it
+ * was shown at (CLOCK_MONOTONIC, as used by Present).
+ *
+ */
+void metrics_frame_shown(uint32_t serial, uint64_t usec) {
+	struct frame_stamp *frame = &frames[serial % FRAME_QUEUE];
+	if (frame->serial != serial || frame->flushed == 0 || usec < frame->flushed)
+		return;
+
+	histogram_add(&present_latency, usec - frame->flushed);
+	if (frame->input != 0) {
+		histogram_add(&key_present_latency, usec - frame->flushed);
+		histogram_add(&key_total_latency, usec - frame->input);
+	}
+
+	/* Frames may be reported more than once (e.g. after a timeout). */
+	frame->flushed = 0;
+}
+
+static void dump_histogram(FILE *out, const char *name, const histogram_t *h) {
+	fprintf(out, "%-12s count %-8llu", name, (unsigned long long)h->count);
+	if (h->count == 0) {
+		fprintf(out, "\n");
+		return;
+	}
+	fprintf(out, " mean %-8llu min %-8llu p50 %-8llu p90 %-8llu p99 %-8llu max %llu\n",
+			(unsigned long long)(h->sum / h->count),
+			(unsigned long long)h->min,
+			(unsigned long long)histogram_percentile(h, 50),
+			(unsigned long long)histogram_percentile(h, 90),
+			(unsigned long long)histogram_percentile(h, 99),
+			(unsigned long long)h->max);
+
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		if (h->buckets[bucket] == 0)
+			continue;
+		fprintf(out, "    < %-10llu %u\n",
+				(unsigned long long)1 << bucket, h->buckets[bucket]);
+	}
+}
+
+/*
+ * Writes all histograms in a human readable form. All values are in
+ * microseconds.
+ *
+ */
+void metrics_dump(FILE *out) {
+	fprintf(out, "# i3lock latency statistics (usec)\n");
+	dump_histogram(out, "key_queue", &key_queue_latency);
+	dump_histogram(out, "key_render", &key_render_latency);
+	dump_histogram(out, "key_upload", &key_upload_latency);
+	dump_histogram(out, "key_present", &key_present_latency);
+	dump_histogram(out, "key_total", &key_total_latency);
+	dump_histogram(out, "present", &present_latency);
+	dump_histogram(out, "pam", &pam_latency);
+	fprintf(out, "%-12s usec %-8llu retries %d\n", "grab",
+			(unsigned long long)grab_usec, grab_retries);
+	fprintf(out, "%-12s requested %-8llu rendered %-8llu merged %llu\n", "frames",
+			(unsigned long long)frames_requested,
+			(unsigned long long)frames_rendered,
+			(unsigned long long)frames_merged);
+	fprintf(out, "%-12s %llu\n", "wakeups", (unsigned long long)wakeups);
+	fflush(out);
+}
+
+/*
+ * Startup phases are consecutive: every phase starts when the previous one
+ * ended, the first one when startup_profile_start() was called. Tasks run
+ * on other threads, concurrently with the phases.
+ */
+static uint64_t startup_begin;
+static uint64_t last_phase_end;
+static int startup_phase_count;
+static struct startup_phase {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	bool task;
+} startup_phases[STARTUP_PHASES];
+
+void startup_profile_start(void) {
+	startup_begin = last_phase_end = now_usec();
+	startup_phase_count = 0;
+}
+
+static void add_startup_phase(const char *name, uint64_t start, uint64_t end, bool task) {
+	if (startup_phase_count == STARTUP_PHASES)
+		return;
+	startup_phases[startup_phase_count].name = name;
+	startup_phases[startup_phase_count].start = start;
+	startup_phases[startup_phase_count].end = end;
+	startup_phases[startup_phase_count].task = task;
+	startup_phase_count++;
+}
+
+void startup_phase_done(const char *name) {
+	uint64_t now = now_usec();
+	add_startup_phase(name, last_phase_end, now, false);
+	last_phase_end = now;
+}
+
+/* Records a task which ran from start to end on another thread. */
+void startup_task_done(const char *name, uint64_t start, uint64_t end) {
+	add_startup_phase(name, start, end, true);
+}
+
+/*
+ * Prints the startup phases as a waterfall: start, duration and a bar
+ * showing when the phase ran, relative to the whole startup. Tasks are
+ * marked with a '*'.
+ *
+ */
+#define WATERFALL_WIDTH 40
+
+void startup_profile_dump(FILE *out) {
+	if (startup_phase_count == 0)
+		return;
+
+	uint64_t total = last_phase_end - startup_begin;
+	fprintf(out, "%-28s %10s %10s\n", "phase", "start ms", "ms");
+	for (int phase = 0; phase < startup_phase_count; phase++) {
+		struct startup_phase *p = &startup_phases[phase];
+		uint64_t start = p->start - startup_begin;
+		uint64_t duration = p->end - p->start;
+
+		int from = total ? start * WATERFALL_WIDTH / total : 0;
+		int to = total ? (start + duration) * WATERFALL_WIDTH / total : 0;
+		if (from >= WATERFALL_WIDTH)
+			from = WATERFALL_WIDTH - 1;
+		if (to <= from)
+			to = from + 1;
+		if (to > WATERFALL_WIDTH)
+			to = WATERFALL_WIDTH;
+
+		char bar[WATERFALL_WIDTH + 1];
+		memset(bar, ' ', WATERFALL_WIDTH);
+		memset(bar + from, p->task ? '*' : '#', to - from);
+		bar[WATERFALL_WIDTH] = '\0';
+
+		fprintf(out, "%s%-26s %10.3f %10.3f |%s|\n", p->task ? "* " : "  ",
+				p->name, start / 1000.0, duration / 1000.0, bar);
+	}
+	fprintf(out, "  %-26s %10s %10.3f\n", "total", "", total / 1000.0);
+	fflush(out);
+}
+
+/*
+ * Writes the startup phases in the Chrome trace event format (load it in
+ * chrome://tracing or Perfetto), tasks on a separate track. Returns false if
+ * the file could not be written.
+ *
+ */
+bool startup_profile_write_trace(const char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+		return false;
+
+	int pid = getpid();
+	fprintf(out, "{\"traceEvents\": [\n");
+	for (int phase = 0; phase < startup_phase_count; phase++) {
+		struct startup_phase *p = &startup_phases[phase];
+		fprintf(out, "  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+				"\"ts\": %llu, \"dur\": %llu, \"pid\": %d, \"tid\": %d}%s\n",
+				p->name, p->task ? "task" : "startup",
+				(unsigned long long)p->start,
+				(unsigned long long)(p->end - p->start),
+				pid, p->task ? pid + 1 + phase : pid,
+				phase + 1 < startup_phase_count ? "," : "");
+	}
+	fprintf(out, "], \"displayTimeUnit\": \"ms\"}\n");
+
+	return fclose(out) == 0;
+}
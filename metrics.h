@@ -0,0 +1,82 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Histogram buckets are powers of two: bucket i counts values in
+ * [2^(i-1), 2^i) microseconds, bucket 0 counts zero. */
+#define HISTOGRAM_BUCKETS 28
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/* Time between submitting a frame and the server reporting it as shown. */
+extern histogram_t present_latency;
+
+/*
+ * Keypress to photon latency, split into the stages a keypress goes through:
+ *   queue:   X server generated the event -> i3lock read it
+ *   render:  i3lock read the event -> frame showing it rendered
+ *   upload:  frame rendered -> requests flushed to the X server
+ *   present: requests flushed -> frame shown
+ */
+extern histogram_t key_queue_latency;
+extern histogram_t key_render_latency;
+extern histogram_t key_upload_latency;
+extern histogram_t key_present_latency;
+extern histogram_t key_total_latency;
+
+/* How long grabbing pointer and keyboard took and how often it was retried. */
+extern uint64_t grab_usec;
+extern int grab_retries;
+
+/*
+ * Frames: redraws requested, frames rendered, and requests which were merged
+ * into a frame that was pending already.
+ */
+extern uint64_t frames_requested;
+extern uint64_t frames_rendered;
+extern uint64_t frames_merged;
+
+/* Time spent in the stages of rendering a frame (see render_timings_t). */
+extern histogram_t render_background_time;
+extern histogram_t render_ring_time;
+extern histogram_t render_status_time;
+extern histogram_t render_keyboard_time;
+extern histogram_t render_clock_time;
+extern histogram_t render_composite_time;
+
+/* Duration of the pam_authenticate() calls. */
+extern histogram_t pam_latency;
+
+/* Event loop iterations, i.e. how often i3lock woke up. */
+extern uint64_t wakeups;
+
+uint64_t now_usec(void);
+void histogram_add(histogram_t *h, uint64_t usec);
+uint64_t histogram_percentile(const histogram_t *h, double percentile);
+
+void metrics_key_received(uint32_t server_time);
+bool metrics_frame_rendered(uint32_t serial);
+void metrics_frame_flushed(uint32_t serial);
+void metrics_frame_shown(uint32_t serial, uint64_t usec);
+
+void metrics_dump(FILE *out);
+
+/* Startup profiler: main() marks the end of every phase of the startup. */
+#define STARTUP_PHASES 32
+
+void startup_profile_start(void);
+void startup_phase_done(const char *name);
+void startup_task_done(const char *name, uint64_t start, uint64_t end);
+void startup_profile_dump(FILE *out);
+bool startup_profile_write_trace(const char *path);
+
+#endif
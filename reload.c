@@ -0,0 +1,222 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * reload.c: Applies changes to the configuration file and the background
+ *           image while the screen stays locked. Both are watched with
+ *           inotify, SIGHUP forces a reload. Only what was derived from
+ *           changed settings is thrown away (see settings_reloaded()), the
+ *           next frame shows the new configuration.
+ *
+ *           An invalid configuration is reported and the previous one kept,
+ *           the lock is never given up because of a reload.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <signal.h>
+#include <wordexp.h>
+#include <sys/inotify.h>
+#include <cairo.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "settings.h"
+#include "unlock_indicator.h"
+#include "reload.h"
+
+extern cairo_surface_t *img;
+
+/* Editors tend to write several events for one save, apply them at once. */
+#define RELOAD_DELAY 0.1
+
+/* A file in a watched directory. */
+struct watched_file {
+    int wd;
+    char dir[PATH_MAX];
+    char name[NAME_MAX + 1];
+};
+
+static struct {
+    struct ev_loop *loop;
+    const char *config_path;
+    int fd;
+    struct watched_file config;
+    struct watched_file image;
+    bool image_changed;
+    ev_io inotify_watcher;
+    ev_timer delay_timer;
+    ev_signal hup_signal;
+} reload = {.fd = -1};
+
+/*
+ * Watches the directory of path (after following symlinks) for files being
+ * written or moved into place, which is how editors save. The watch of the
+ * previously watched directory is removed unless keep_wd still uses it.
+ *
+ */
+static void watch_file(struct watched_file *file, const char *path, int keep_wd) {
+    char resolved[PATH_MAX];
+    char copy[PATH_MAX];
+
+    if (path[0] == '\0' || realpath(path, resolved) == NULL) {
+        snprintf(resolved, sizeof(resolved), "%s", path);
+        if (resolved[0] == '\0')
+            goto unwatch;
+    }
+
+    snprintf(copy, sizeof(copy), "%s", resolved);
+    const char *dir = dirname(copy);
+    if (file->wd != -1 && strcmp(file->dir, dir) == 0) {
+        snprintf(file->name, sizeof(file->name), "%s", basename(resolved));
+        return;
+    }
+
+    if (file->wd != -1 && file->wd != keep_wd)
+        inotify_rm_watch(reload.fd, file->wd);
+    snprintf(file->dir, sizeof(file->dir), "%s", dir);
+    file->wd = inotify_add_watch(reload.fd, file->dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (file->wd == -1) {
+        DEBUG("Could not watch %s\n", file->dir);
+        return;
+    }
+    snprintf(file->name, sizeof(file->name), "%s", basename(resolved));
+    DEBUG("Watching %s/%s\n", file->dir, file->name);
+    return;
+
+unwatch:
+    if (file->wd != -1 && file->wd != keep_wd)
+        inotify_rm_watch(reload.fd, file->wd);
+    file->wd = -1;
+    file->dir[0] = '\0';
+    file->name[0] = '\0';
+}
+
+static void watch_files(void) {
+    wordexp_t p;
+
+    if (wordexp(reload.config_path, &p, 0) == 0) {
+        if (p.we_wordc > 0)
+            watch_file(&reload.config, p.we_wordv[0], reload.image.wd);
+        wordfree(&p);
+    }
+    watch_file(&reload.image, image_path, reload.config.wd);
+}
+
+/*
+ * Replaces img with the image at image_path. If it cannot be loaded, the
+ * current one is kept.
+ *
+ */
+static void reload_image(void) {
+    cairo_surface_t *new_img = NULL;
+
+    if (image_path[0] != '\0') {
+        new_img = cairo_image_surface_create_from_png(image_path);
+        if (cairo_surface_status(new_img) != CAIRO_STATUS_SUCCESS) {
+            fprintf(stderr, "Could not load image \"%s\": %s, keeping the previous one\n",
+                    image_path, cairo_status_to_string(cairo_surface_status(new_img)));
+            cairo_surface_destroy(new_img);
+            return;
+        }
+    }
+
+    if (img != NULL)
+        cairo_surface_destroy(img);
+    img = new_img;
+}
+
+static void reload_config(void) {
+    size_t size = settings_size();
+    char *old = malloc(size);
+    if (old == NULL)
+        return;
+    settings_save(old);
+
+    if (!try_read_config((char *)reload.config_path)) {
+        fprintf(stderr, "Keeping the previous configuration\n");
+        settings_restore(old);
+        free(old);
+        return;
+    }
+
+    if (reload.image_changed || settings_changed(old, image_path))
+        reload_image();
+    reload.image_changed = false;
+
+    settings_reloaded(old);
+    if (show_clock && (settings_changed(old, &show_clock) || settings_changed(old, &refresh_rate)))
+        start_time_redraw_tick(reload.loop);
+
+    watch_files();
+    free(old);
+
+    DEBUG("Configuration reloaded\n");
+    schedule_redraw();
+}
+
+static void delay_timer_cb(EV_P_ ev_timer *w, int revents) {
+    reload_config();
+}
+
+static void hup_signal_cb(EV_P_ ev_signal *w, int revents) {
+    ev_timer_stop(loop, &reload.delay_timer);
+    reload.image_changed = true;
+    reload_config();
+}
+
+static void inotify_cb(EV_P_ ev_io *w, int revents) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+
+    while ((n = read(reload.fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + n;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0)
+                continue;
+
+            if (event->wd == reload.config.wd && strcmp(event->name, reload.config.name) == 0)
+                changed = true;
+            if (event->wd == reload.image.wd && strcmp(event->name, reload.image.name) == 0)
+                changed = reload.image_changed = true;
+        }
+    }
+
+    if (changed) {
+        ev_timer_set(&reload.delay_timer, RELOAD_DELAY, 0.);
+        ev_timer_start(loop, &reload.delay_timer);
+    }
+}
+
+/*
+ * Starts watching the configuration file and the image for changes, and
+ * reloads them on SIGHUP. config_path is kept and must stay valid.
+ *
+ */
+void config_watch_start(struct ev_loop *loop, const char *config_path) {
+    reload.loop = loop;
+    reload.config_path = config_path;
+    reload.config.wd = -1;
+    reload.image.wd = -1;
+
+    ev_timer_init(&reload.delay_timer, delay_timer_cb, RELOAD_DELAY, 0.);
+
+    ev_signal_init(&reload.hup_signal, hup_signal_cb, SIGHUP);
+    ev_signal_start(loop, &reload.hup_signal);
+
+    reload.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reload.fd == -1) {
+        DEBUG("inotify is not available, only reloading on SIGHUP\n");
+        return;
+    }
+    watch_files();
+
+    ev_io_init(&reload.inotify_watcher, inotify_cb, reload.fd, EV_READ);
+    ev_io_start(loop, &reload.inotify_watcher);
+}
@@ -0,0 +1,8 @@
+#ifndef _RELOAD_H
+#define _RELOAD_H
+
+#include <ev.h>
+
+void config_watch_start(struct ev_loop *loop, const char *config_path);
+
+#endif
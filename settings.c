@@ -1,12 +1,17 @@
 #include "ini.h"
+#include "cache.h"
 
 #include <xcb/xcb.h>
 #include <xcb/xkb.h>
 #include <cairo.h>
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <err.h>
 
 #include <wordexp.h>
@@ -79,6 +84,11 @@ char date_y_expr[32] 		= "ty+30\0";
 char key_x_expr[32]		= "x + (w / 2)\0";
 char key_y_expr[32]		= "y + (h / 2)\0";
 
+int snap_unlock			= 1;
+int snap_time			= 1;
+int snap_date			= 1;
+int snap_keyboard		= 1;
+
 double time_size 		= 32.0;
 double date_size 		= 14.0;
 double text_size 		= 28.0;
@@ -87,258 +97,349 @@ double modifier_size 		= 14.0;
 double circle_radius 		= 90.0;
 
 char image_path[256]		= {0};
+char stats_file[256]		= {0};
+char stats_socket[256]		= {0};
 
 char verif_text[64]		= "Verifying...\0";
 char wrong_text[64] 		= "Wrong Password!\0";
 
-static ini_t * config;
-
-/** Configuration file functions prototypes **/
-int read_config(char * file)
+/*
+ * Every option the configuration file understands. read_config() goes over
+ * the file once and looks each key up in a hash table built from this list,
+ * instead of scanning the whole file again for every option.
+ */
+typedef enum {
+	OPT_INT,
+	OPT_FLOAT,
+	OPT_DOUBLE,
+	OPT_STRING,	/* copied as is */
+	OPT_PATH,	/* word expanded */
+	OPT_COLOR	/* hexadecimal, size - 1 digits */
+} option_type_t;
+
+typedef struct {
+	const char * section;
+	const char * key;
+	option_type_t type;
+	void * target;
+	size_t size;
+} option_t;
+
+#define OPTION(section, key, type, target) \
+	{ section, key, type, (void *) &target, sizeof(target) }
+
+static const option_t options[] = {
+	OPTION("i3lock", "debug", OPT_INT, debug_mode),
+	OPTION("i3lock", "show_failed_attempts", OPT_INT, show_failed_attempts),
+	OPTION("i3lock", "ignore_empty_password", OPT_INT, ignore_empty_password),
+	OPTION("i3lock", "tile", OPT_INT, tile),
+	OPTION("i3lock", "screen_number", OPT_INT, screen_number),
+	OPTION("i3lock", "internal_line_source", OPT_INT, internal_line_source),
+	OPTION("i3lock", "image_path", OPT_PATH, image_path),
+	OPTION("i3lock", "stats_file", OPT_PATH, stats_file),
+	OPTION("i3lock", "stats_socket", OPT_PATH, stats_socket),
+
+	OPTION("text", "verif_text", OPT_STRING, verif_text),
+	OPTION("text", "wrong_text", OPT_STRING, wrong_text),
+	OPTION("text", "text_size", OPT_DOUBLE, text_size),
+	OPTION("text", "modifier_size", OPT_DOUBLE, modifier_size),
+
+	OPTION("unlock", "show_indicator", OPT_INT, unlock_indicator),
+	OPTION("unlock", "always_show_indicator", OPT_INT, always_show_indicator),
+	OPTION("unlock", "unlock_x_expr", OPT_STRING, unlock_x_expr),
+	OPTION("unlock", "unlock_y_expr", OPT_STRING, unlock_y_expr),
+	OPTION("unlock", "circle_radius", OPT_DOUBLE, circle_radius),
+	OPTION("unlock", "snap_to_pixel", OPT_INT, snap_unlock),
+
+	OPTION("colors", "color", OPT_COLOR, color),
+	OPTION("colors", "insidevercolor", OPT_COLOR, insidevercolor),
+	OPTION("colors", "insidewrongcolor", OPT_COLOR, insidewrongcolor),
+	OPTION("colors", "insidecolor", OPT_COLOR, insidecolor),
+	OPTION("colors", "ringvercolor", OPT_COLOR, ringvercolor),
+	OPTION("colors", "ringwrongcolor", OPT_COLOR, ringwrongcolor),
+	OPTION("colors", "ringcolor", OPT_COLOR, ringcolor),
+	OPTION("colors", "linecolor", OPT_COLOR, linecolor),
+	OPTION("colors", "textcolor", OPT_COLOR, textcolor),
+	OPTION("colors", "timecolor", OPT_COLOR, timecolor),
+	OPTION("colors", "datecolor", OPT_COLOR, datecolor),
+	OPTION("colors", "keyhlcolor", OPT_COLOR, keyhlcolor),
+	OPTION("colors", "bshlcolor", OPT_COLOR, bshlcolor),
+	OPTION("colors", "separatorcolor", OPT_COLOR, separatorcolor),
+	OPTION("colors", "indicatorscolor", OPT_COLOR, indicatorscolor),
+
+	OPTION("clock", "show_clock", OPT_INT, show_clock),
+	OPTION("clock", "refresh_rate", OPT_FLOAT, refresh_rate),
+	OPTION("clock", "format", OPT_STRING, time_format),
+	OPTION("clock", "font", OPT_STRING, time_font),
+	OPTION("clock", "x_expr", OPT_STRING, time_x_expr),
+	OPTION("clock", "y_expr", OPT_STRING, time_y_expr),
+	OPTION("clock", "font_size", OPT_DOUBLE, time_size),
+	OPTION("clock", "snap_to_pixel", OPT_INT, snap_time),
+
+	OPTION("date", "format", OPT_STRING, date_format),
+	OPTION("date", "font", OPT_STRING, date_font),
+	OPTION("date", "x_expr", OPT_STRING, date_x_expr),
+	OPTION("date", "y_expr", OPT_STRING, date_y_expr),
+	OPTION("date", "font_size", OPT_DOUBLE, date_size),
+	OPTION("date", "snap_to_pixel", OPT_INT, snap_date),
+
+	OPTION("keyboard", "show_key_layout", OPT_INT, show_keyboard_layout),
+	OPTION("keyboard", "show_caps_state", OPT_INT, show_caps_lock_state),
+	OPTION("keyboard", "font", OPT_STRING, keyl_font),
+	OPTION("keyboard", "x_expr", OPT_STRING, key_x_expr),
+	OPTION("keyboard", "y_expr", OPT_STRING, key_y_expr),
+	OPTION("keyboard", "font_size", OPT_DOUBLE, indicators_size),
+	OPTION("keyboard", "snap_to_pixel", OPT_INT, snap_keyboard),
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+/* Open addressing, kept at most half full. Slots hold index + 1, 0 is empty. */
+#define OPTION_SLOTS 128
+
+static unsigned char option_slots[OPTION_SLOTS];
+static bool option_slots_built = false;
+
+/* Case insensitive FNV-1a over section and key, like ini_get() compares them */
+static uint32_t option_hash(const char * section, const char * key)
 {
+	uint32_t hash = 2166136261u;
 
-	if (!file || file[0] == '\0') {
-		errx(EXIT_FAILURE, "Invalid configuration file path\n");
-	}
+	for (const char * c = section; *c; c++)
+		hash = (hash ^ (unsigned char) tolower(*c)) * 16777619u;
+	hash = (hash ^ '.') * 16777619u;
+	for (const char * c = key; *c; c++)
+		hash = (hash ^ (unsigned char) tolower(*c)) * 16777619u;
 
-	/** Word expansion variables **/
-	wordexp_t p;
-	char **w;
+	return hash;
+}
 
-	/** Word expansion of configuration path **/
-	wordexp(file, &p, 0);
-	w = p.we_wordv;
+static void build_option_table(void)
+{
+	_Static_assert(NUM_OPTIONS * 2 <= OPTION_SLOTS, "OPTION_SLOTS is too small");
 
-	printf("DEBUG: loading configuration from %s\n", w[0]);
+	if (option_slots_built)
+		return;
 
-	/** open config file **/
-	config = ini_load(w[0]);
-	if (!config) {
-		errx(EXIT_FAILURE, "Unable to load configuration file\n");
+	for (size_t i = 0; i < NUM_OPTIONS; i++) {
+		uint32_t slot = option_hash(options[i].section, options[i].key);
+		while (option_slots[slot % OPTION_SLOTS] != 0)
+			slot++;
+		option_slots[slot % OPTION_SLOTS] = i + 1;
 	}
+	option_slots_built = true;
+}
 
-	/** parse config file **/
-	/* temporary variables for checks */
-	const char * arg;
-
-	/** Parse [i3lock] section **/
-	ini_sget(config, "i3lock", "debug", "%d", &debug_mode);
-	ini_sget(config, "i3lock", "show_failed_attempts", "%d", &show_failed_attempts);
-	ini_sget(config, "i3lock", "ignore_empty_password", "%d", &ignore_empty_password);
-	ini_sget(config, "i3lock", "tile", "%d", &tile);
-
-	ini_sget(config, "i3lock", "screen_number", "%d", &screen_number);
-	ini_sget(config, "i3lock", "internal_line_source", "%d", &internal_line_source);
-
-
-	if ((arg = ini_get(config, "i3lock", "image_path")) != NULL) {
-		/** image path word expansion **/
-		wordexp(arg, &p, 0);
-		w = p.we_wordv;
-
-		strcpy(image_path, w[0]);
+static const option_t * find_option(const char * section, const char * key)
+{
+	uint32_t slot = option_hash(section, key);
+	unsigned char index;
+
+	while ((index = option_slots[slot % OPTION_SLOTS]) != 0) {
+		const option_t * option = &options[index - 1];
+		if (!strcasecmp(option->section, section) && !strcasecmp(option->key, key))
+			return option;
+		slot++;
 	}
 
-	/** Parse [text] section **/
-	if ((arg = ini_get(config, "text", "verif_text")) != NULL)
-		strcpy(verif_text, arg);
-
-	if ((arg = ini_get(config, "text", "wrong_text")) != NULL)
-		strcpy(wrong_text, arg);
-
-	ini_sget(config, "text", "text_size", "%lf", &text_size);
-	ini_sget(config, "text", "modifier_size", "%lf", &modifier_size);
-
-	/** Parse [unlock] section **/
-	ini_sget(config, "unlock", "show_indicator", "%d", &unlock_indicator);
-	ini_sget(config, "unlock", "always_show_indicator", "%d", &always_show_indicator);
-
-	if ((arg = ini_get(config, "unlock", "unlock_x_expr")) != NULL)
-		strcpy(unlock_x_expr, arg);
+	return NULL;
+}
 
-	if ((arg = ini_get(config, "unlock", "unlock_y_expr")) != NULL)
-		strcpy(unlock_y_expr, arg);
+static bool copy_string(const option_t * option, const char * value)
+{
+	if (strlen(value) >= option->size) {
+		warnx("%s is too long, it must be at most %zu characters\n",
+			option->key, option->size - 1);
+		return false;
+	}
+	strcpy(option->target, value);
+	return true;
+}
 
-	ini_sget(config, "unlock", "circle_radius", "%lf", &circle_radius);
+/* What set_option() keeps while reading one configuration file. */
+struct read_state {
+	bool valid;
+	/* Options set so far, the first value given for an option is used. */
+	bool seen[NUM_OPTIONS];
+};
 
-	/* Parse [colors] section */
-	/* parse background color */
-	if ((arg = ini_get(config, "colors", "color")) != NULL) {
-		if (arg[0] == '#') arg++; /* Skip # if present */
+/*
+ * Stores one value from the configuration file in its variable. Invalid
+ * values are reported and clear the valid flag of the read_state udata
+ * points to. Later values of an option which was set already are ignored.
+ */
+static void set_option(const char * section, const char * key, const char * value, void * udata)
+{
+	const option_t * option = find_option(section, key);
+	struct read_state * state = udata;
+	bool * valid = &state->valid;
+	wordexp_t p;
+	int parsed = 1;
 
-		if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color) != 1) {
-			errx(EXIT_FAILURE, "color is invalid, "
-			"it must be given in 3-byte hexadecimal format: rrggbb\n");
-		}
+	if (!option) {
+		fprintf(stderr, "Unknown option %s in section [%s], ignoring it\n", key, section);
+		return;
 	}
-
-	/* parse all other 4-byte colors */
-	arg = ini_get(config, "colors", "insidevercolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", insidevercolor) != 1) {
-			errx(EXIT_FAILURE, "insidevercolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
+	if (state->seen[option - options])
+		return;
+	state->seen[option - options] = true;
+
+	switch (option->type) {
+	case OPT_INT:
+		parsed = sscanf(value, "%d", (int *) option->target);
+		break;
+	case OPT_FLOAT:
+		parsed = sscanf(value, "%f", (float *) option->target);
+		break;
+	case OPT_DOUBLE:
+		parsed = sscanf(value, "%lf", (double *) option->target);
+		break;
+	case OPT_STRING:
+		if (!copy_string(option, value))
+			*valid = false;
+		break;
+	case OPT_PATH:
+		if (wordexp(value, &p, 0) != 0 || p.we_wordc == 0) {
+			warnx("%s is invalid, "
+			"it could not be expanded to a path\n", option->key);
+			*valid = false;
+			break;
 		}
-	}
-	arg = ini_get(config, "colors", "insidewrongcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", insidewrongcolor) != 1) {
-			errx(EXIT_FAILURE, "insidewrongcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "insidecolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", insidecolor) != 1) {
-			errx(EXIT_FAILURE, "insidecolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
+		if (!copy_string(option, p.we_wordv[0]))
+			*valid = false;
+		wordfree(&p);
+		break;
+	case OPT_COLOR:
+		if (value[0] == '#') value++; /* Skip # if present */
+
+		size_t digits = option->size - 1;
+		if (strlen(value) != digits || strspn(value, "0123456789abcdefABCDEF") != digits) {
+			warnx("%s is invalid, "
+			"it must be given in %zu-byte hexadecimal format: %s\n",
+			option->key, digits / 2, digits == 6 ? "rrggbb" : "rrggbbaa");
+			*valid = false;
+			break;
 		}
+		strcpy(option->target, value);
+		break;
 	}
 
-	arg = ini_get(config, "colors", "ringvercolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", ringvercolor) != 1) {
-			errx(EXIT_FAILURE, "ringvercolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "ringwrongcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", ringwrongcolor) != 1) {
-			errx(EXIT_FAILURE, "ringwrongcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "ringcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", ringcolor) != 1) {
-			errx(EXIT_FAILURE, "ringcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "linecolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", linecolor) != 1) {
-			errx(EXIT_FAILURE, "linecolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "textcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", textcolor) != 1) {
-			errx(EXIT_FAILURE, "textcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "timecolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", timecolor) != 1) {
-			errx(EXIT_FAILURE, "timecolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "datecolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", datecolor) != 1) {
-			errx(EXIT_FAILURE, "datecolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
+	if (parsed != 1)
+		fprintf(stderr, "%s in section [%s] is not a number, ignoring it\n", key, section);
+}
 
-	arg = ini_get(config, "colors", "keyhlcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", keyhlcolor) != 1) {
-			errx(EXIT_FAILURE, "keyhlcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "bshlcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", bshlcolor) != 1) {
-			errx(EXIT_FAILURE, "bshlcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "separatorcolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", separatorcolor) != 1) {
-			errx(EXIT_FAILURE, "separatorcolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
-	}
-	arg = ini_get(config, "colors", "indicatorscolor");
-	if (arg) {
-		if (arg[0] == '#') arg++;
-		if (strlen(arg) != 8 || sscanf(arg, "%08[0-9a-fA-F]", indicatorscolor) != 1) {
-			errx(EXIT_FAILURE, "indicatorscolor is invalid, "
-			"it must be given in 4-byte hexadecimal format: rrggbbaa\n");
-		}
+/*
+ * Snapshots of all options, as stored in compiled themes (see theme.c). The
+ * schema hash changes whenever the option table does, so a snapshot is only
+ * ever restored by a binary with the same table.
+ */
+uint64_t settings_schema(void)
+{
+	uint64_t hash = CACHE_HASH_INIT;
+
+	for (size_t i = 0; i < NUM_OPTIONS; i++) {
+		const option_t * option = &options[i];
+		uint64_t layout[2] = { option->type, option->size };
+		hash = cache_hash(hash, option->section, strlen(option->section) + 1);
+		hash = cache_hash(hash, option->key, strlen(option->key) + 1);
+		hash = cache_hash(hash, layout, sizeof(layout));
 	}
 
-	/* parse [clock] section */
-	ini_sget(config, "clock", "show_clock", "%d", &show_clock);
-	ini_sget(config, "clock", "refresh_rate", "%f", &refresh_rate);
+	return hash;
+}
 
-	if ((arg = ini_get(config, "clock", "format")) != NULL)
-		strcpy(time_format, arg);
+size_t settings_size(void)
+{
+	size_t size = 0;
 
-	if ((arg = ini_get(config, "clock", "font")) != NULL)
-		strcpy(time_font, arg);
+	for (size_t i = 0; i < NUM_OPTIONS; i++)
+		size += options[i].size;
 
-	if ((arg = ini_get(config, "clock", "x_expr")) != NULL)
-		strcpy(time_x_expr, arg);
+	return size;
+}
 
-	if ((arg = ini_get(config, "clock", "y_expr")) != NULL)
-		strcpy(time_y_expr, arg);
+void settings_save(void * buffer)
+{
+	char * p = buffer;
 
-	ini_sget(config, "clock", "font_size", "%lf", &time_size);
+	for (size_t i = 0; i < NUM_OPTIONS; i++) {
+		memcpy(p, options[i].target, options[i].size);
+		p += options[i].size;
+	}
+}
 
-	/* parse [date] section */
-	if ((arg = ini_get(config, "date", "format")) != NULL)
-		strcpy(date_format, arg);
+void settings_restore(const void * buffer)
+{
+	const char * p = buffer;
 
-	if ((arg = ini_get(config, "date", "font")) != NULL)
-		strcpy(date_font, arg);
+	for (size_t i = 0; i < NUM_OPTIONS; i++) {
+		memcpy(options[i].target, p, options[i].size);
+		p += options[i].size;
+	}
+}
 
-	ini_sget(config, "date", "font_size", "%lf", &date_size);
+/*
+ * Returns whether the variable at target has a different value in the given
+ * settings_save() snapshot than it has now.
+ */
+bool settings_changed(const void * snapshot, const void * target)
+{
+	const char * p = snapshot;
+
+	for (size_t i = 0; i < NUM_OPTIONS; i++) {
+		if (options[i].target == target)
+			return memcmp(p, target, options[i].size) != 0;
+		p += options[i].size;
+	}
 
-	if ((arg = ini_get(config, "date", "x_expr")) != NULL)
-		strcpy(date_x_expr, arg);
+	return false;
+}
 
-	if ((arg = ini_get(config, "date", "y_expr")) != NULL)
-		strcpy(date_y_expr, arg);
+/*
+ * Reads the configuration file. Errors are reported on stderr, in which case
+ * false is returned and some of the options may have been set already.
+ */
+bool try_read_config(char * file)
+{
+	ini_t * config;
+	wordexp_t p;
+	struct read_state state = { .valid = true };
 
-	/* parse [keyboard] section */
-	ini_sget(config, "keyboard", "show_key_layout", "%d", &show_keyboard_layout);
-	ini_sget(config, "keyboard", "show_caps_state", "%d", &show_caps_lock_state);
+	if (!file || file[0] == '\0') {
+		warnx("Invalid configuration file path\n");
+		return false;
+	}
 
-	if ((arg = ini_get(config, "keyboard", "font")) != NULL)
-		strcpy(keyl_font, arg);
+	/** Word expansion of configuration path **/
+	if (wordexp(file, &p, 0) != 0 || p.we_wordc == 0) {
+		warnx("Invalid configuration file path\n");
+		return false;
+	}
 
-	ini_sget(config, "keyboard", "font_size", "%lf", &indicators_size);
+	printf("DEBUG: loading configuration from %s\n", p.we_wordv[0]);
 
-	if ((arg = ini_get(config, "keyboard", "x_expr")) != NULL)
-		strcpy(key_x_expr, arg);
+	/** open config file **/
+	config = ini_load(p.we_wordv[0]);
+	wordfree(&p);
+	if (!config) {
+		warnx("Unable to load configuration file\n");
+		return false;
+	}
 
-	if ((arg = ini_get(config, "keyboard", "y_expr")) != NULL)
-		strcpy(key_y_expr, arg);
+	/** parse config file **/
+	build_option_table();
+	ini_each(config, set_option, &state);
 
-	/** Free config and wordexp **/
 	ini_free(config);
-	wordfree(&p);
+
+	return state.valid;
+}
+
+/** Configuration file functions prototypes **/
+int read_config(char * file)
+{
+	if (!try_read_config(file))
+		exit(EXIT_FAILURE);
 
 	return 0;
 }
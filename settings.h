@@ -4,6 +4,9 @@
 #include <xcb/xcb.h>
 #include <xcb/xkb.h>
 #include <cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /** Colors **/
 /* The background color to use (in hex). */
@@ -82,6 +85,12 @@ extern char date_y_expr[32];
 extern char key_x_expr[32];
 extern char key_y_expr[32];
 
+/* Snap widget origins to the device pixel grid */
+extern int snap_unlock;
+extern int snap_time;
+extern int snap_date;
+extern int snap_keyboard;
+
 extern double time_size;
 extern double date_size;
 extern double text_size;
@@ -91,13 +100,24 @@ extern double circle_radius;
 
 extern const char image_path[256];
 
+/* File the latency statistics are written to on exit and on SIGUSR1 */
+extern char stats_file[256];
+
+/* UNIX socket serving runtime counters as JSON, off if empty */
+extern char stats_socket[256];
+
 extern const char verif_text[64];
 extern const char wrong_text[64];
 
 /** Configuration file functions prototypes **/
 int read_config(char *);
-
-/** Release configuration file (because releasing it invalidates all strings **/
-void free_config(void);
+bool try_read_config(char *);
+
+/** Snapshots of all options, used by compiled themes **/
+uint64_t settings_schema(void);
+size_t settings_size(void);
+void settings_save(void *);
+void settings_restore(const void *);
+bool settings_changed(const void *, const void *);
 
 #endif // I3_LOCK_FANCIER_CONFIG_H
@@ -0,0 +1,229 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * stats.c: Serves the runtime counters of metrics.c (and a few more, like
+ *          memory use) as JSON on the UNIX socket configured as
+ *          stats_socket. Every client gets one JSON object and the
+ *          connection is closed, so `socat - UNIX-CONNECT:path` is enough
+ *          to read it.
+ *
+ *          Everything happens in the event loop without blocking: clients
+ *          which do not read fast enough are served as their socket becomes
+ *          writable. Only timing percentiles and resource use are reported.
+ *          Nothing is counted which follows the input: the number of
+ *          keypresses, frames, wakeups or PAM calls would tell a client how
+ *          many keys were typed, when, and how many attempts failed. Those
+ *          counts only go to stats_file (see metrics_dump()).
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "settings.h"
+#include "metrics.h"
+#include "cache.h"
+#include "stats.h"
+
+/* Connections being served at the same time, more are closed right away. */
+#define STATS_CLIENTS 4
+
+struct stats_client {
+    ev_io watcher;
+    char *buffer;
+    size_t size;
+    size_t written;
+};
+
+static struct {
+    int fd;
+    struct sockaddr_un addr;
+    uint64_t start;
+    ev_io accept_watcher;
+    struct stats_client clients[STATS_CLIENTS];
+} stats = {.fd = -1};
+
+/* Resident set size in kB, from /proc/self/statm. */
+static long current_rss(void) {
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%*s %ld", &pages) != 1)
+        pages = 0;
+    fclose(statm);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Percentiles only (0 without samples), the count follows the input. */
+static void write_histogram(FILE *out, const char *name, const histogram_t *h, bool last) {
+    fprintf(out, "\"%s\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu}%s", name,
+            (unsigned long long)histogram_percentile(h, 50),
+            (unsigned long long)histogram_percentile(h, 90),
+            (unsigned long long)histogram_percentile(h, 99),
+            last ? "" : ", ");
+}
+
+/* Writes the counters as one JSON object, times in microseconds. */
+static void write_stats(FILE *out) {
+    struct rusage usage;
+    long peak_rss = 0;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        peak_rss = usage.ru_maxrss;
+
+    uint64_t uptime = now_usec() - stats.start;
+    uint64_t hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+    uint64_t misses = __atomic_load_n(&cache_misses, __ATOMIC_RELAXED);
+
+    fprintf(out, "{\"uptime_usec\": %llu, ", (unsigned long long)uptime);
+
+    fprintf(out, "\"render\": {");
+    write_histogram(out, "background", &render_background_time, false);
+    write_histogram(out, "ring", &render_ring_time, false);
+    write_histogram(out, "status", &render_status_time, false);
+    write_histogram(out, "keyboard", &render_keyboard_time, false);
+    write_histogram(out, "clock", &render_clock_time, false);
+    write_histogram(out, "composite", &render_composite_time, true);
+    fprintf(out, "}, ");
+
+    fprintf(out, "\"key_latency\": {");
+    write_histogram(out, "queue", &key_queue_latency, false);
+    write_histogram(out, "render", &key_render_latency, false);
+    write_histogram(out, "upload", &key_upload_latency, false);
+    write_histogram(out, "present", &key_present_latency, false);
+    write_histogram(out, "total", &key_total_latency, true);
+    fprintf(out, "}, ");
+
+    write_histogram(out, "present", &present_latency, false);
+
+    fprintf(out, "\"grab\": {\"usec\": %llu, \"retries\": %d}, ",
+            (unsigned long long)grab_usec, grab_retries);
+    fprintf(out, "\"memory\": {\"rss_kb\": %ld, \"peak_rss_kb\": %ld}, ",
+            current_rss(), peak_rss);
+    fprintf(out, "\"cache\": {\"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.3f}}\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            hits + misses > 0 ? (double)hits / (hits + misses) : 0.0);
+}
+
+static void close_client(struct ev_loop *loop, struct stats_client *client) {
+    ev_io_stop(loop, &client->watcher);
+    close(client->watcher.fd);
+    free(client->buffer);
+    client->buffer = NULL;
+}
+
+static void client_cb(EV_P_ ev_io *w, int revents) {
+    struct stats_client *client = (struct stats_client *)w;
+
+    while (client->written < client->size) {
+        ssize_t n = send(w->fd, client->buffer + client->written,
+                         client->size - client->written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        client->written += n;
+    }
+
+    close_client(loop, client);
+}
+
+static void accept_cb(EV_P_ ev_io *w, int revents) {
+    int fd;
+
+    while ((fd = accept4(stats.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        struct stats_client *client = NULL;
+        for (int i = 0; i < STATS_CLIENTS; i++) {
+            if (stats.clients[i].buffer == NULL) {
+                client = &stats.clients[i];
+                break;
+            }
+        }
+
+        FILE *out = client ? open_memstream(&client->buffer, &client->size) : NULL;
+        if (out == NULL) {
+            DEBUG("Too many statistics clients, closing the connection\n");
+            close(fd);
+            continue;
+        }
+        write_stats(out);
+        if (fclose(out) != 0) {
+            free(client->buffer);
+            client->buffer = NULL;
+            close(fd);
+            continue;
+        }
+
+        client->written = 0;
+        ev_io_init(&client->watcher, client_cb, fd, EV_WRITE);
+        ev_io_start(loop, &client->watcher);
+        /* Most of the time, the whole object fits into the socket buffer. */
+        client_cb(loop, &client->watcher, EV_WRITE);
+    }
+}
+
+static void remove_socket(void) {
+    unlink(stats.addr.sun_path);
+}
+
+/*
+ * Starts serving the counters on stats_socket, if one is configured. The
+ * socket is only accessible by the user running i3lock. A stale socket left
+ * behind by a previous instance is replaced, other files are not touched.
+ *
+ */
+void stats_socket_start(struct ev_loop *loop) {
+    struct sockaddr_un *addr = &stats.addr;
+    struct stat st;
+
+    if (stats_socket[0] == '\0')
+        return;
+    if (strlen(stats_socket) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Statistics socket path %s is too long\n", stats_socket);
+        return;
+    }
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, stats_socket);
+
+    if (lstat(stats_socket, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket, not serving statistics\n", stats_socket);
+            return;
+        }
+        unlink(stats_socket);
+    }
+
+    stats.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stats.fd == -1) {
+        perror("socket");
+        return;
+    }
+
+    mode_t old_umask = umask(0077);
+    int bound = bind(stats.fd, (struct sockaddr *)addr, sizeof(*addr));
+    umask(old_umask);
+    if (bound == -1 || listen(stats.fd, STATS_CLIENTS) == -1) {
+        fprintf(stderr, "Could not listen on %s: %s\n", stats_socket, strerror(errno));
+        close(stats.fd);
+        stats.fd = -1;
+        return;
+    }
+    atexit(remove_socket);
+
+    stats.start = now_usec();
+    ev_io_init(&stats.accept_watcher, accept_cb, stats.fd, EV_READ);
+    ev_io_start(loop, &stats.accept_watcher);
+    DEBUG("Serving statistics on %s\n", stats_socket);
+}
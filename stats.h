@@ -0,0 +1,8 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <ev.h>
+
+void stats_socket_start(struct ev_loop *loop);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * tasks.c: Runs independent startup steps (PAM, compose table, fonts, image
+ *          decoding) concurrently with the X11 setup in main().
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "i3lock.h"
+#include "settings.h"
+#include "metrics.h"
+#include "tasks.h"
+
+static void *task_thread(void *data) {
+    task_t *task = data;
+
+    task->start = now_usec();
+    task->func(task->arg);
+    task->end = now_usec();
+    __atomic_store_n(&task->done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/*
+ * Starts running func(arg) on a new thread. If no thread can be created, the
+ * function is run right away instead.
+ *
+ */
+void task_start(task_t *task, const char *name, void (*func)(void *), void *arg) {
+    task->name = name;
+    task->func = func;
+    task->arg = arg;
+    task->started = true;
+    task->threaded = (pthread_create(&task->thread, NULL, task_thread, task) == 0);
+
+    if (!task->threaded) {
+        DEBUG("Could not start a thread for %s, running it now\n", name);
+        task_thread(task);
+    }
+}
+
+/*
+ * Returns whether the task has finished, without waiting for it.
+ *
+ */
+bool task_done(task_t *task) {
+    return __atomic_load_n(&task->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Waits for the task to finish. Joining a task which was already joined (or
+ * never started) does nothing.
+ *
+ */
+void task_join(task_t *task) {
+    if (!task->started)
+        return;
+
+    if (task->threaded)
+        pthread_join(task->thread, NULL);
+    task->started = false;
+
+    startup_task_done(task->name, task->start, task->end);
+}
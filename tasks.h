@@ -0,0 +1,29 @@
+#ifndef _TASKS_H
+#define _TASKS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A startup step running on its own thread, concurrently with main(). Tasks
+ * must be joined before forking.
+ */
+typedef struct task {
+    const char *name;
+    void (*func)(void *);
+    void *arg;
+    pthread_t thread;
+    bool started;
+    bool threaded;
+    /* Set by the task thread once func returned. */
+    bool done;
+    uint64_t start;
+    uint64_t end;
+} task_t;
+
+void task_start(task_t *task, const char *name, void (*func)(void *), void *arg);
+bool task_done(task_t *task);
+void task_join(task_t *task);
+
+#endif
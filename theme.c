@@ -0,0 +1,243 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * theme.c: Compiled themes (--compile-theme). A compiled theme holds the
+ *          parsed configuration and the decoded background image in one
+ *          file in the cache directory, which is mapped at startup instead
+ *          of parsing the configuration and decoding the PNG again.
+ *
+ *          It is only used as long as the configuration file and the image
+ *          are unchanged, otherwise i3lock falls back to reading them.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wordexp.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "cache.h"
+#include "settings.h"
+#include "theme.h"
+
+extern cairo_surface_t *img;
+
+#define THEME_MAGIC "I3TH"
+#define THEME_VERSION 1
+
+/* Start of the pixels, cairo wants them at least 4-byte aligned. */
+#define THEME_ALIGN 64
+
+/*
+ * The header is followed by the configuration path, the image path (both
+ * NUL-terminated), the settings snapshot and, at the next THEME_ALIGN
+ * boundary, the image in CAIRO_FORMAT_ARGB32.
+ *
+ */
+struct theme_header {
+    char magic[4];
+    uint32_t version;
+    /* settings_schema() of the binary which compiled the theme */
+    uint64_t schema;
+    /* cache_hash_file() of the configuration file and the image */
+    uint64_t sources;
+    uint32_t config_path_size;
+    uint32_t image_path_size;
+    uint32_t settings_size;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+};
+
+/* The theme is named after the configuration path as given by the user. */
+static void theme_name(const char *config_path, char *name, size_t size) {
+    uint64_t hash = cache_hash(CACHE_HASH_INIT, config_path, strlen(config_path) + 1);
+    snprintf(name, size, "theme-%016llx", (unsigned long long)hash);
+}
+
+static uint64_t sources_hash(const char *config_file, const char *image_file) {
+    uint64_t hash = cache_hash_file(CACHE_HASH_INIT, config_file);
+    if (image_file[0] != '\0')
+        hash = cache_hash_file(hash, image_file);
+    return hash;
+}
+
+static size_t align(size_t offset) {
+    return (offset + THEME_ALIGN - 1) & ~(size_t)(THEME_ALIGN - 1);
+}
+
+/*
+ * Writes the current settings and img (as loaded by read_config() and
+ * load_image()) as the compiled theme for config_path.
+ *
+ */
+bool theme_compile(const char *config_path) {
+    wordexp_t p;
+    if (wordexp(config_path, &p, 0) != 0 || p.we_wordc == 0) {
+        fprintf(stderr, "Invalid configuration file path\n");
+        return false;
+    }
+    const char *config_file = p.we_wordv[0];
+
+    struct theme_header header = {
+        .magic = THEME_MAGIC,
+        .version = THEME_VERSION,
+        .schema = settings_schema(),
+        .sources = sources_hash(config_file, image_path),
+        .config_path_size = strlen(config_file) + 1,
+        .image_path_size = strlen(image_path) + 1,
+        .settings_size = settings_size(),
+    };
+
+    if (img != NULL) {
+        cairo_surface_t *argb = img;
+        if (cairo_image_surface_get_format(img) != CAIRO_FORMAT_ARGB32) {
+            argb = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                              cairo_image_surface_get_width(img),
+                                              cairo_image_surface_get_height(img));
+            cairo_t *ctx = cairo_create(argb);
+            cairo_set_source_surface(ctx, img, 0, 0);
+            cairo_paint(ctx);
+            cairo_destroy(ctx);
+            cairo_surface_destroy(img);
+            img = argb;
+        }
+        cairo_surface_flush(img);
+        header.width = cairo_image_surface_get_width(img);
+        header.height = cairo_image_surface_get_height(img);
+        header.stride = cairo_image_surface_get_stride(img);
+    }
+
+    size_t pixels = align(sizeof(header) + header.config_path_size +
+                          header.image_path_size + header.settings_size);
+    size_t size = pixels + (size_t)header.stride * header.height;
+    char *data = calloc(1, size);
+    if (data == NULL) {
+        wordfree(&p);
+        return false;
+    }
+
+    char *q = data;
+    memcpy(q, &header, sizeof(header));
+    q += sizeof(header);
+    memcpy(q, config_file, header.config_path_size);
+    q += header.config_path_size;
+    memcpy(q, image_path, header.image_path_size);
+    q += header.image_path_size;
+    settings_save(q);
+    if (img != NULL)
+        memcpy(data + pixels, cairo_image_surface_get_data(img),
+               (size_t)header.stride * header.height);
+
+    char name[32];
+    theme_name(config_path, name, sizeof(name));
+    bool written = cache_write(name, data, size);
+    if (written)
+        printf("Compiled %s into %zu bytes\n", config_file, size);
+    else
+        fprintf(stderr, "Could not write the compiled theme\n");
+
+    free(data);
+    wordfree(&p);
+    return written;
+}
+
+/* Where the pixels of an img loaded from a compiled theme are mapped. */
+struct theme_mapping {
+    const void *data;
+    size_t size;
+};
+
+static const cairo_user_data_key_t mapping_key;
+
+/* Unmaps the theme once the img using its pixels is destroyed. */
+static void unmap_theme(void *data) {
+    struct theme_mapping *mapping = data;
+
+    cache_unmap(mapping->data, mapping->size);
+    free(mapping);
+}
+
+/*
+ * Loads the compiled theme for config_path, if there is one and the
+ * configuration file and the image did not change since it was compiled.
+ * This sets all settings and img. Returns false (changing nothing) if the
+ * configuration needs to be read with read_config() instead.
+ *
+ */
+bool theme_load(const char *config_path) {
+    char name[32];
+    size_t size;
+
+    theme_name(config_path, name, sizeof(name));
+    const char *data = cache_map(name, &size);
+    if (data == NULL)
+        return false;
+
+    struct theme_header header;
+    if (size < sizeof(header))
+        goto stale;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, THEME_MAGIC, 4) != 0 ||
+        header.version != THEME_VERSION ||
+        header.schema != settings_schema() ||
+        header.settings_size != settings_size())
+        goto stale;
+
+    const char *config_file = data + sizeof(header);
+    const char *image_file = config_file + header.config_path_size;
+    const char *settings = image_file + header.image_path_size;
+    size_t pixels = align(sizeof(header) + (size_t)header.config_path_size +
+                          header.image_path_size + header.settings_size);
+    if (pixels > size ||
+        header.config_path_size == 0 || config_file[header.config_path_size - 1] != '\0' ||
+        header.image_path_size == 0 || image_file[header.image_path_size - 1] != '\0')
+        goto stale;
+
+    if (header.width > 0) {
+        if (header.height <= 0 ||
+            header.stride != cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, header.width) ||
+            (size - pixels) / header.stride < (size_t)header.height)
+            goto stale;
+    }
+
+    if (header.sources != sources_hash(config_file, image_file)) {
+        DEBUG("Compiled theme %s is out of date\n", name);
+        goto stale;
+    }
+
+    cairo_surface_t *theme_img = NULL;
+    if (header.width > 0) {
+        /* The pixels stay mapped for as long as the image is used, and are
+         * unmapped when it is destroyed (e.g. by a reload). */
+        struct theme_mapping *mapping = malloc(sizeof(*mapping));
+        if (mapping == NULL)
+            goto stale;
+        *mapping = (struct theme_mapping){data, size};
+        theme_img = cairo_image_surface_create_for_data((unsigned char *)data + pixels,
+                                                        CAIRO_FORMAT_ARGB32,
+                                                        header.width, header.height,
+                                                        header.stride);
+        if (cairo_surface_set_user_data(theme_img, &mapping_key, mapping, unmap_theme) !=
+            CAIRO_STATUS_SUCCESS) {
+            cairo_surface_destroy(theme_img);
+            free(mapping);
+            goto stale;
+        }
+    } else {
+        cache_unmap(data, size);
+    }
+
+    settings_restore(settings);
+    img = theme_img;
+
+    DEBUG("Loaded compiled theme %s for %s\n", name, config_file);
+    return true;
+
+stale:
+    cache_unmap(data, size);
+    return false;
+}
@@ -0,0 +1,9 @@
+#ifndef _THEME_H
+#define _THEME_H
+
+#include <stdbool.h>
+
+bool theme_compile(const char *config_path);
+bool theme_load(const char *config_path);
+
+#endif
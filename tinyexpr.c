@@ -622,6 +622,261 @@ double te_interp(const char *expression, int *error) {
     return ret;
 }
 
+int te_reads(const te_expr *n, const void *address) {
+    int i;
+    if (!n) return 0;
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return 0;
+        case TE_VARIABLE: return n->bound == address;
+        default:
+            for (i = 0; i < ARITY(n->type); ++i) {
+                if (te_reads(n->parameters[i], address)) return 1;
+            }
+            return 0;
+    }
+}
+
+
+/* Flattened expressions: the tree in postfix order, evaluated on a stack. */
+enum {
+    OP_CONSTANT, OP_VARIABLE,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEGATE,
+    OP_FUNCTION, OP_CLOSURE
+};
+
+typedef struct te_op {
+    int op;
+    int arity;
+    union {double value; const double *bound; const void *function;};
+    void *context;
+} te_op;
+
+struct te_program {
+    int count;
+    te_op ops[];
+};
+
+
+typedef struct flatten_state {
+    te_program *program; /* NULL while only counting */
+    int count;
+    int depth;
+    int max_depth;
+    const double *const *constants;
+    int constant_count;
+} flatten_state;
+
+
+/* Whether n only depends on constants, so that it can be evaluated once. */
+static int is_known(const flatten_state *s, const te_expr *n) {
+    int i;
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return 1;
+        case TE_VARIABLE:
+            for (i = 0; i < s->constant_count; ++i) {
+                if (s->constants[i] == n->bound) return 1;
+            }
+            return 0;
+        default:
+            if (!IS_PURE(n->type) || IS_CLOSURE(n->type)) return 0;
+            for (i = 0; i < ARITY(n->type); ++i) {
+                if (!is_known(s, n->parameters[i])) return 0;
+            }
+            return 1;
+    }
+}
+
+
+static te_op *emit(flatten_state *s, int op, int arity) {
+    te_op *ret = s->program ? &s->program->ops[s->count] : 0;
+    s->count++;
+    s->depth += 1 - arity;
+    if (s->depth > s->max_depth) s->max_depth = s->depth;
+    if (ret) {
+        ret->op = op;
+        ret->arity = arity;
+        ret->context = 0;
+    }
+    return ret;
+}
+
+
+static void flatten(flatten_state *s, const te_expr *n) {
+    te_op *op;
+    int i, arity;
+
+    if (is_known(s, n)) {
+        if ((op = emit(s, OP_CONSTANT, 0))) op->value = te_eval(n);
+        return;
+    }
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_VARIABLE:
+            if ((op = emit(s, OP_VARIABLE, 0))) op->bound = n->bound;
+            return;
+
+        default:
+            arity = ARITY(n->type);
+            for (i = 0; i < arity; ++i) {
+                flatten(s, n->parameters[i]);
+            }
+
+            if (IS_CLOSURE(n->type)) {
+                if ((op = emit(s, OP_CLOSURE, arity))) {
+                    op->function = n->function;
+                    op->context = n->parameters[arity];
+                }
+            } else if (n->function == add) {
+                emit(s, OP_ADD, 2);
+            } else if (n->function == sub) {
+                emit(s, OP_SUB, 2);
+            } else if (n->function == mul) {
+                emit(s, OP_MUL, 2);
+            } else if (n->function == divide) {
+                emit(s, OP_DIV, 2);
+            } else if (n->function == negate) {
+                emit(s, OP_NEGATE, 1);
+            } else {
+                if ((op = emit(s, OP_FUNCTION, arity))) op->function = n->function;
+            }
+            return;
+    }
+}
+
+
+te_program *te_flatten(const te_expr *n, const double *const *constants, int constant_count) {
+    flatten_state s = {0, 0, 0, 0, constants, constant_count};
+    if (!n) return 0;
+
+    /* Count the instructions first, so that they fit in one allocation. */
+    flatten(&s, n);
+    if (s.max_depth > TE_MAX_STACK) return 0;
+
+    s.program = malloc(sizeof(te_program) + sizeof(te_op) * s.count);
+    if (!s.program) return 0;
+    s.program->count = s.count;
+    s.count = s.depth = s.max_depth = 0;
+    flatten(&s, n);
+
+    return s.program;
+}
+
+
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))op->function)
+#define A(e) args[e]
+
+/* Calls the function of an OP_FUNCTION or OP_CLOSURE instruction. */
+static double call(const te_op *op, const double *args) {
+    if (op->op == OP_FUNCTION) {
+        switch(op->arity) {
+            case 0: return TE_FUN(void)();
+            case 1: return TE_FUN(double)(A(0));
+            case 2: return TE_FUN(double, double)(A(0), A(1));
+            case 3: return TE_FUN(double, double, double)(A(0), A(1), A(2));
+            case 4: return TE_FUN(double, double, double, double)(A(0), A(1), A(2), A(3));
+            case 5: return TE_FUN(double, double, double, double, double)(A(0), A(1), A(2), A(3), A(4));
+            case 6: return TE_FUN(double, double, double, double, double, double)(A(0), A(1), A(2), A(3), A(4), A(5));
+            case 7: return TE_FUN(double, double, double, double, double, double, double)(A(0), A(1), A(2), A(3), A(4), A(5), A(6));
+            default: return NAN;
+        }
+    } else {
+        switch(op->arity) {
+            case 0: return TE_FUN(void*)(op->context);
+            case 1: return TE_FUN(void*, double)(op->context, A(0));
+            case 2: return TE_FUN(void*, double, double)(op->context, A(0), A(1));
+            case 3: return TE_FUN(void*, double, double, double)(op->context, A(0), A(1), A(2));
+            case 4: return TE_FUN(void*, double, double, double, double)(op->context, A(0), A(1), A(2), A(3));
+            case 5: return TE_FUN(void*, double, double, double, double, double)(op->context, A(0), A(1), A(2), A(3), A(4));
+            case 6: return TE_FUN(void*, double, double, double, double, double, double)(op->context, A(0), A(1), A(2), A(3), A(4), A(5));
+            case 7: return TE_FUN(void*, double, double, double, double, double, double, double)(op->context, A(0), A(1), A(2), A(3), A(4), A(5), A(6));
+            default: return NAN;
+        }
+    }
+}
+
+#undef TE_FUN
+#undef A
+
+
+double te_run(const te_program *p) {
+    double stack[TE_MAX_STACK];
+    double *sp = stack;
+    const te_op *op, *end;
+
+    if (!p) return NAN;
+
+    for (op = p->ops, end = p->ops + p->count; op < end; ++op) {
+        switch(op->op) {
+            case OP_CONSTANT: *sp++ = op->value; break;
+            case OP_VARIABLE: *sp++ = *op->bound; break;
+            case OP_ADD: --sp; sp[-1] += sp[0]; break;
+            case OP_SUB: --sp; sp[-1] -= sp[0]; break;
+            case OP_MUL: --sp; sp[-1] *= sp[0]; break;
+            case OP_DIV: --sp; sp[-1] /= sp[0]; break;
+            case OP_NEGATE: sp[-1] = -sp[-1]; break;
+            case OP_FUNCTION:
+            case OP_CLOSURE:
+                sp -= op->arity;
+                *sp = call(op, sp);
+                ++sp;
+                break;
+            default: return NAN;
+        }
+    }
+
+    return sp[-1];
+}
+
+
+#define LANES for (i = 0; i < lanes; ++i)
+
+void te_run_batch(const te_program *p, double *out, int count) {
+    double stack[TE_MAX_STACK][TE_BATCH];
+    double args[7];
+    const te_op *op, *end;
+    int base, lanes, sp, i, k;
+
+    for (base = 0; base < count; base += TE_BATCH) {
+        lanes = count - base < TE_BATCH ? count - base : TE_BATCH;
+        if (!p) {
+            LANES out[base + i] = NAN;
+            continue;
+        }
+
+        sp = 0;
+        for (op = p->ops, end = p->ops + p->count; op < end; ++op) {
+            switch(op->op) {
+                case OP_CONSTANT: LANES stack[sp][i] = op->value; ++sp; break;
+                case OP_VARIABLE: LANES stack[sp][i] = op->bound[base + i]; ++sp; break;
+                case OP_ADD: --sp; LANES stack[sp - 1][i] += stack[sp][i]; break;
+                case OP_SUB: --sp; LANES stack[sp - 1][i] -= stack[sp][i]; break;
+                case OP_MUL: --sp; LANES stack[sp - 1][i] *= stack[sp][i]; break;
+                case OP_DIV: --sp; LANES stack[sp - 1][i] /= stack[sp][i]; break;
+                case OP_NEGATE: LANES stack[sp - 1][i] = -stack[sp - 1][i]; break;
+                case OP_FUNCTION:
+                case OP_CLOSURE:
+                    sp -= op->arity;
+                    LANES {
+                        for (k = 0; k < op->arity; ++k) args[k] = stack[sp + k][i];
+                        stack[sp][i] = call(op, args);
+                    }
+                    ++sp;
+                    break;
+            }
+        }
+
+        LANES out[base + i] = stack[0][i];
+    }
+}
+
+#undef LANES
+
+
+void te_program_free(te_program *p) {
+    free(p);
+}
+
 static void pn (const te_expr *n, int depth) {
     int i, arity;
     printf("%*s", depth, "");
@@ -71,6 +71,36 @@ te_expr *te_compile(const char *expression, const te_variable *variables, int va
 /* Evaluates the expression. */
 double te_eval(const te_expr *n);
 
+/* Returns whether the expression reads the variable bound to address. */
+int te_reads(const te_expr *n, const void *address);
+
+/* Flattened form of a compiled expression, for repeated evaluation. */
+typedef struct te_program te_program;
+
+/* Deepest evaluation stack te_run() supports. */
+#define TE_MAX_STACK 64
+
+/* Flattens the expression into stack bytecode in a single allocation. */
+/* Variables bound to one of the constants are read now and folded, */
+/* along with all pure functions of them. */
+/* Returns NULL on error. */
+te_program *te_flatten(const te_expr *n, const double *const *constants, int constant_count);
+
+/* Evaluates the flattened expression. */
+double te_run(const te_program *p);
+
+/* Values te_run_batch() computes at once. */
+#define TE_BATCH 8
+
+/* Evaluates the flattened expression count times, into out[0..count-1]. */
+/* Every variable must be bound to an array of count values, run i */
+/* reads element i of each. */
+void te_run_batch(const te_program *p, double *out, int count);
+
+/* Frees the flattened expression. */
+/* This is safe to call on NULL pointers. */
+void te_program_free(te_program *p);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
@@ -0,0 +1,109 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * trace2json.c: Converts a trace written by i3lock --trace into the Chrome
+ *               trace event format, to be loaded in chrome://tracing or
+ *               Perfetto.
+ *
+ * Usage: trace2json trace.bin > trace.json
+ *
+ * Spans (frames, rendering, PAM) become begin/end events, everything else
+ * instant events. The two numbers recorded with an event are shown as its
+ * arguments a and b, see trace.h for their meaning.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "../trace.h"
+
+/* Longest event name read from the file. */
+#define NAME_MAX_LENGTH 64
+
+struct event {
+    char phase;
+    char name[NAME_MAX_LENGTH];
+};
+
+static bool read_name(FILE *in, struct event *event) {
+    int c = fgetc(in);
+    if (c == EOF)
+        return false;
+    event->phase = c;
+
+    for (size_t i = 0; i < sizeof(event->name); i++) {
+        if ((c = fgetc(in)) == EOF)
+            return false;
+        event->name[i] = c;
+        if (c == '\0')
+            return true;
+    }
+    return false;
+}
+
+/* Writes s as a JSON string. */
+static void write_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+    struct trace_header header;
+
+    if (argc != 2)
+        errx(EXIT_FAILURE, "Usage: %s trace.bin > trace.json", argv[0]);
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL)
+        err(EXIT_FAILURE, "%s", argv[1]);
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, 4) != 0)
+        errx(EXIT_FAILURE, "%s is not an i3lock trace", argv[1]);
+    if (header.version != TRACE_VERSION)
+        errx(EXIT_FAILURE, "%s has version %u, only %d is supported",
+             argv[1], header.version, TRACE_VERSION);
+
+    struct event *events = calloc(header.event_count, sizeof(struct event));
+    if (header.event_count > 0 && events == NULL)
+        err(EXIT_FAILURE, "calloc");
+    for (uint32_t e = 0; e < header.event_count; e++)
+        if (!read_name(in, &events[e]))
+            errx(EXIT_FAILURE, "%s: invalid event table", argv[1]);
+
+    printf("{\"traceEvents\": [\n");
+    bool first = true;
+    for (uint64_t i = 0; i < header.record_count; i++) {
+        struct trace_file_record record;
+        if (fread(&record, sizeof(record), 1, in) != 1)
+            errx(EXIT_FAILURE, "%s is truncated", argv[1]);
+        if (record.event >= header.event_count)
+            continue;
+
+        const struct event *event = &events[record.event];
+        printf("%s  {\"name\": ", first ? "" : ",\n");
+        write_string(event->name);
+        printf(", \"ph\": \"%c\", \"ts\": %llu, \"pid\": %u, \"tid\": %u, ",
+               event->phase, (unsigned long long)record.usec, header.pid, header.pid);
+        if (event->phase == 'i')
+            printf("\"s\": \"t\", ");
+        printf("\"args\": {\"a\": %u, \"b\": %llu}}", record.a, (unsigned long long)record.b);
+        first = false;
+    }
+    printf("\n], \"displayTimeUnit\": \"ms\"}\n");
+
+    free(events);
+    fclose(in);
+    return EXIT_SUCCESS;
+}
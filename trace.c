@@ -0,0 +1,153 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * trace.c: A fixed-size ring of binary trace records (--trace). Recording an
+ *          event takes a timestamp and fills in a slot claimed with one
+ *          atomic increment: there is no lock, no allocation and no
+ *          formatting, so tracing the frame and input paths barely changes
+ *          their timing. Once the ring is full, the oldest records are
+ *          overwritten.
+ *
+ *          The ring is written to the trace file on SIGUSR1 and at exit.
+ *          tools/trace2json converts it to the Chrome trace event format.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+/* Records in the ring, a power of two. */
+#define TRACE_RECORDS 8192
+
+typedef struct trace_slot {
+    uint64_t usec;
+    uint64_t b;
+    uint32_t event;
+    uint32_t a;
+    /* Index + 1 of the record in the slot, 0 while it is being written. */
+    uint64_t sequence;
+} trace_slot_t;
+
+static const struct {
+    const char *name;
+    char phase;
+} events[TRACE_EVENT_COUNT] = {
+#define TRACE_INFO(id, name, phase) [id] = {name, phase},
+    TRACE_EVENTS(TRACE_INFO)
+#undef TRACE_INFO
+};
+
+bool trace_enabled;
+
+static const char *trace_path;
+static trace_slot_t ring[TRACE_RECORDS];
+static uint64_t head;
+
+void trace_record(enum trace_event event, uint32_t a, uint64_t b) {
+    uint64_t index = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    trace_slot_t *slot = &ring[index & (TRACE_RECORDS - 1)];
+
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    slot->usec = now_usec();
+    slot->event = event;
+    slot->a = a;
+    slot->b = b;
+    __atomic_store_n(&slot->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+static void write_at_exit(void) {
+    trace_write();
+}
+
+/* Starts recording, the trace is written to path. */
+void trace_start(const char *path) {
+    trace_path = path;
+    trace_enabled = true;
+}
+
+/*
+ * Writes the trace when the process exits. Called after forking, so that the
+ * parent exiting in daemonize() does not replace the trace with its own.
+ *
+ */
+void trace_write_at_exit(void) {
+    if (trace_enabled)
+        atexit(write_at_exit);
+}
+
+/*
+ * Writes the records in the ring to the trace file, replacing it
+ * atomically. Records still being written are left out. The file is only
+ * readable by the user, the timing of frames says something about what
+ * happens on the locked screen.
+ *
+ */
+bool trace_write(void) {
+    if (!trace_enabled)
+        return false;
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", trace_path, (int)getpid()) >= (int)sizeof(tmp))
+        return false;
+    /* A leftover of a process with the same pid. */
+    unlink(tmp);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s for writing the trace\n", tmp);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        return false;
+    }
+
+    uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint64_t start = end > TRACE_RECORDS ? end - TRACE_RECORDS : 0;
+    struct trace_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .pid = getpid(),
+        .event_count = TRACE_EVENT_COUNT,
+    };
+    for (uint64_t i = start; i < end; i++)
+        if (__atomic_load_n(&ring[i & (TRACE_RECORDS - 1)].sequence, __ATOMIC_ACQUIRE) == i + 1)
+            header.record_count++;
+
+    fwrite(&header, sizeof(header), 1, out);
+    for (int e = 0; e < TRACE_EVENT_COUNT; e++) {
+        fputc(events[e].phase, out);
+        fwrite(events[e].name, strlen(events[e].name) + 1, 1, out);
+    }
+
+    uint64_t written = 0;
+    for (uint64_t i = start; i < end && written < header.record_count; i++) {
+        trace_slot_t *slot = &ring[i & (TRACE_RECORDS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != i + 1)
+            continue;
+        struct trace_file_record record = {slot->usec, slot->b, slot->event, slot->a};
+        /* Overwritten while copying it. */
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != i + 1)
+            record.event = TRACE_EVENT_COUNT;
+        fwrite(&record, sizeof(record), 1, out);
+        written++;
+    }
+    /* Keep the record count right if records were overwritten meanwhile. */
+    struct trace_file_record filler = {.event = TRACE_EVENT_COUNT};
+    for (; written < header.record_count; written++)
+        fwrite(&filler, sizeof(filler), 1, out);
+
+    if (fclose(out) != 0 || rename(tmp, trace_path) != 0) {
+        fprintf(stderr, "Could not write the trace to %s\n", trace_path);
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The trace events: identifier, name and phase in the Chrome trace event
+ * format ('B'egin and 'E'nd of a span, 'i'nstant). The two numbers recorded
+ * with an event are:
+ *   frame:            a = frame serial
+ *   render:           a = ring diameter (at the beginning)
+ *   layout:           a = number of screens, b = damaged widgets
+ *   redraw scheduled: a = whether a frame was pending already
+ *   frame timeout:    a = frame serial
+ *   present complete: a = frame serial, b = msc
+ *   x event:          a = event type (key events are not traced)
+ *   xkb event:        a = xkb event type (state changes are not traced)
+ *
+ * Nothing is recorded per keystroke: the number and timing of the key events
+ * would give away the length and rhythm of the password.
+ */
+#define TRACE_EVENTS(X)                                 \
+    X(TRACE_FRAME_BEGIN, "frame", 'B')                  \
+    X(TRACE_FRAME_END, "frame", 'E')                    \
+    X(TRACE_RENDER_BEGIN, "render", 'B')                \
+    X(TRACE_RENDER_END, "render", 'E')                  \
+    X(TRACE_LAYOUT, "layout", 'i')                      \
+    X(TRACE_REDRAW_SCHEDULED, "redraw scheduled", 'i')  \
+    X(TRACE_FRAME_TIMEOUT, "frame timeout", 'i')        \
+    X(TRACE_PRESENT_COMPLETE, "present complete", 'i')  \
+    X(TRACE_X_EVENT, "x event", 'i')                    \
+    X(TRACE_XKB_EVENT, "xkb event", 'i')                \
+    X(TRACE_PAM_BEGIN, "pam_authenticate", 'B')         \
+    X(TRACE_PAM_END, "pam_authenticate", 'E')
+
+enum trace_event {
+#define TRACE_ID(id, name, phase) id,
+    TRACE_EVENTS(TRACE_ID)
+#undef TRACE_ID
+    TRACE_EVENT_COUNT
+};
+
+/*
+ * The trace file (see tools/trace2json.c): this header, then for every event
+ * its phase character and NUL-terminated name, then record_count records,
+ * oldest first. Records with an event of event_count or more are invalid.
+ */
+#define TRACE_MAGIC "I3TR"
+#define TRACE_VERSION 1
+
+struct trace_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t pid;
+    uint32_t event_count;
+    uint64_t record_count;
+};
+
+struct trace_file_record {
+    /* CLOCK_MONOTONIC */
+    uint64_t usec;
+    uint64_t b;
+    uint32_t event;
+    uint32_t a;
+};
+
+/* Set by trace_start(), TRACE() does nothing otherwise. */
+extern bool trace_enabled;
+
+/*
+ * Records an event in the trace ring: a timestamp and two numbers, nothing
+ * is formatted. Never pass anything derived from the password or the keys.
+ */
+#define TRACE(event, a, b)                  \
+    do {                                    \
+        if (trace_enabled)                  \
+            trace_record(event, a, b);      \
+    } while (0)
+
+void trace_record(enum trace_event event, uint32_t a, uint64_t b);
+void trace_start(const char *path);
+void trace_write_at_exit(void);
+bool trace_write(void);
+
+#endif
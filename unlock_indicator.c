@@ -8,11 +8,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
 #include <math.h>
 #include <xcb/xcb.h>
 #include <ev.h>
 #include <cairo.h>
 #include <cairo/cairo-xcb.h>
+#include <xcb/present.h>
+#include <xcb/xcb_aux.h>
 
 #include "settings.h"
 #include "i3lock.h"
@@ -20,6 +23,10 @@
 #include "unlock_indicator.h"
 #include "xinerama.h"
 #include "tinyexpr.h"
+#include "metrics.h"
+#include "layout.h"
+#include "trace.h"
+#include "alloc_stats.h"
 
 /* clock stuff */
 #include <time.h>
@@ -33,11 +40,6 @@ extern double circle_radius;
 #define BUTTON_SPACE (BUTTON_RADIUS + 5)
 #define BUTTON_CENTER (BUTTON_RADIUS + 5)
 #define BUTTON_DIAMETER (2 * BUTTON_SPACE)
-#define CLOCK_WIDTH 400
-#define CLOCK_HEIGHT 200
-
-#define INDICATORS_WIDTH 300
-#define INDICATORS_HEIGHT 300
 
 /*******************************************************************************
  * Variables defined in i3lock.c and settings.c
@@ -53,8 +55,8 @@ extern xcb_window_t win;
 /* The current resolution of the X11 root window. */
 extern uint32_t last_resolution[2];
 
-/* List of pressed modifiers, or NULL if none are pressed. */
-extern char *modifier_string;
+/* List of pressed modifiers, empty if none are pressed. */
+extern char modifier_string[96];
 
 /* A Cairo surface containing the specified image (-i), if any. */
 extern cairo_surface_t *img;
@@ -92,6 +94,39 @@ char CAPS_LOCK_STRING[] = "CAPS";
 /* Cache the screen’s visual, necessary for creating a Cairo context. */
 static xcb_visualtype_t *vistype;
 
+/*
+ * The window background is double-buffered: every frame is drawn on the
+ * pixmap which is not currently shown, which then becomes the window
+ * background. The pixmaps (and their cairo surfaces) are kept until the
+ * resolution changes.
+ */
+#define BG_PIXMAPS 2
+static struct {
+	xcb_pixmap_t pixmap;
+	cairo_surface_t *surface;
+	cairo_t *ctx;
+	/* Presented, but not released by the server yet (IdleNotify). */
+	bool busy;
+	render_target_t target;
+} bg_pixmaps[BG_PIXMAPS];
+static int bg_current;
+static uint32_t bg_resolution[2];
+
+/*
+ * Frame scheduling. With the Present extension every frame is shown at a
+ * vblank and at most one frame is in flight: redraws requested in the
+ * meantime are merged into one frame, rendered once the previous frame was
+ * shown. Without Present, requests are merged per event loop iteration.
+ */
+static uint8_t present_opcode;
+static bool frame_pending;
+static bool frame_in_flight;
+static uint32_t frame_serial;
+static uint64_t last_msc;
+
+/* Stops waiting for a frame the server never reported back. */
+static struct ev_timer frame_timeout;
+
 /* Maintain the current unlock/PAM state to draw the appropriate unlock
  * indicator. */
 unlock_state_t unlock_state;
@@ -110,6 +145,10 @@ XKeyboardState xKeyboardState;
  */
 static double scaling_factor(void)
 {
+	/* Rendering without a display (see headless.c). */
+	if (screen == NULL)
+		return 1.0;
+
 	const int dpi = (double)screen->height_in_pixels * 25.4 /
 		(double)screen->height_in_millimeters;
 	return (dpi / 96.0);
@@ -144,155 +183,202 @@ void cairo_set_source_rgba_long(cairo_t * tx, uint32_t longs[4])
 }
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Colors parsed from the hex strings in settings.c. They are parsed on the
+ * first frame and again after the configuration was reloaded.
  */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
-	xcb_pixmap_t bg_pixmap = XCB_NONE;
-	int button_diameter_physical = ceil(scaling_factor() * BUTTON_DIAMETER);
-	int clock_width_physical = ceil(scaling_factor() * CLOCK_WIDTH);
-	int clock_height_physical = ceil(scaling_factor() * CLOCK_HEIGHT);
-	int indicators_height_physical = ceil(scaling_factor() * INDICATORS_HEIGHT);
-	int indicators_width_physical = ceil(scaling_factor() * INDICATORS_WIDTH);
-	DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
-			scaling_factor(), button_diameter_physical);
-
-	if (!vistype) vistype = get_root_visual_type(screen);
-	bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
-	/*
-	 * Initialize cairo: Create one in-memory surface to render the unlock
-	 * indicator on, create one XCB surface to actually draw (one or more,
-	 * depending on the amount of screens) unlock indicators on.
-	 * Also, create two more surfaces for time and date display
-	 * and one more for keyboard layout and caps lock indicator
-	 */
-	cairo_surface_t *output = cairo_image_surface_create(
-			CAIRO_FORMAT_ARGB32,
-			button_diameter_physical,
-			button_diameter_physical
-	);
-	cairo_t *ctx = cairo_create(output);
-
-	cairo_surface_t *time_output = cairo_image_surface_create(
-			CAIRO_FORMAT_ARGB32,
-			clock_width_physical,
-			clock_height_physical
-	);
-	cairo_t *time_ctx = cairo_create(time_output);
+static struct {
+	uint32_t insidever[4];
+	uint32_t insidewrong[4];
+	uint32_t inside[4];
+	uint32_t ringver[4];
+	uint32_t ringwrong[4];
+	uint32_t ring[4];
+	uint32_t line[4];
+	uint32_t text[4];
+	uint32_t indicator[4];
+	uint32_t time[4];
+	uint32_t date[4];
+	uint32_t keyhl[4];
+	uint32_t bshl[4];
+	uint32_t sep[4];
+} palette;
+static bool palette_loaded;
+
+static void load_palette(void)
+{
+	color_hex_to_long(insidevercolor, palette.insidever);
+	color_hex_to_long(insidewrongcolor, palette.insidewrong);
+	color_hex_to_long(insidecolor, palette.inside);
+	color_hex_to_long(ringvercolor, palette.ringver);
+	color_hex_to_long(ringwrongcolor, palette.ringwrong);
+	color_hex_to_long(ringcolor, palette.ring);
+	color_hex_to_long(linecolor, palette.line);
+	color_hex_to_long(textcolor, palette.text);
+	color_hex_to_long(indicatorscolor, palette.indicator);
+	color_hex_to_long(timecolor, palette.time);
+	color_hex_to_long(datecolor, palette.date);
+	color_hex_to_long(keyhlcolor, palette.keyhl);
+	color_hex_to_long(bshlcolor, palette.bshl);
+	color_hex_to_long(separatorcolor, palette.sep);
+	palette_loaded = true;
+}
 
-	cairo_surface_t *date_output = cairo_image_surface_create(
-			CAIRO_FORMAT_ARGB32,
-			clock_width_physical,
-			clock_height_physical
-	);
-	cairo_t *date_ctx = cairo_create(date_output);
+/*******************************************************************************
+ * Widgets.
+ *
+ * Every element of the lock screen (unlock indicator ring, status text, clock,
+ * date, keyboard layout and caps lock state) is rendered on its own retained
+ * image surface. A widget remembers the inputs its surface was rendered with
+ * and only renders again when they change, so most frames just composite the
+ * existing surfaces onto the screen pixmap.
+ ******************************************************************************/
 
-	cairo_surface_t *indicators_output = cairo_image_surface_create(
-			CAIRO_FORMAT_ARGB32,
-			indicators_width_physical,
-			indicators_height_physical
-	);
-	cairo_t *ind_ctx = cairo_create(indicators_output);
+#define WIDGET_KEY_SIZE 160
+
+typedef struct widget {
+	cairo_surface_t *surface;
+	cairo_t *ctx;
+	int width;
+	int height;
+	/* Whether the surface currently has anything drawn on it. */
+	bool visible;
+	/* Whether key holds the inputs of the current surface contents. */
+	bool valid;
+	/* Rendered again since the last frame took note of it. */
+	bool damaged;
+	unsigned char key[WIDGET_KEY_SIZE];
+} widget_t;
+
+static widget_t ring_widget;
+static widget_t status_widget;
+static widget_t time_widget;
+static widget_t date_widget;
+static widget_t layout_widget;
+static widget_t caps_widget;
+
+/* Inputs of the unlock indicator ring and its keypress highlight. */
+struct ring_inputs {
+	double scale;
+	double radius;
+	bool show_ring;
+	auth_state_t auth_state;
+	unlock_state_t unlock_state;
+	double highlight_start;
+};
+
+/* Inputs of the status text drawn inside the ring. */
+struct status_inputs {
+	double scale;
+	double radius;
+	double font_size;
+	char text[32];
+	char modifiers[96];
+};
+
+/* Inputs of the text widgets: clock, date, layout and caps lock. */
+struct text_inputs {
+	char text[WIDGET_KEY_SIZE];
+};
 
-	cairo_surface_t *xcb_output = cairo_xcb_surface_create(
-			conn, bg_pixmap,
-			vistype,
-			resolution[0],
-			resolution[1]
-	);
-	cairo_t *xcb_ctx = cairo_create(xcb_output);
+/*
+ * Makes sure the widget has a surface of the given physical size and checks
+ * the inputs against the ones the surface was rendered with. Returns true
+ * (with a cleared surface) if the widget has to be rendered again.
+ */
+static bool widget_update(widget_t *widget, int width, int height,
+		const void *inputs, size_t size)
+{
+	assert(size <= sizeof(widget->key));
 
-	if (img) {
-		if (!tile) {
-			cairo_set_source_surface(xcb_ctx, img, 0, 0);
-			cairo_paint(xcb_ctx);
-		} else {
-			/* create a pattern and fill a rectangle as big as the screen */
-			cairo_pattern_t *pattern;
-			pattern = cairo_pattern_create_for_surface(img);
-			cairo_set_source(xcb_ctx, pattern);
-			cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-			cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-			cairo_fill(xcb_ctx);
-			cairo_pattern_destroy(pattern);
-		}
+	if (widget->surface && (widget->width != width || widget->height != height)) {
+		cairo_destroy(widget->ctx);
+		cairo_surface_destroy(widget->surface);
+		widget->surface = NULL;
+	}
 
-	} else {
-		char strgroups[3][3] = {
-			{color[0], color[1], '\0'},
-			{color[2], color[3], '\0'},
-			{color[4], color[5], '\0'}
-		};
-		uint32_t rgb16[3] = {
-			(strtol(strgroups[0], NULL, 16)),
-			(strtol(strgroups[1], NULL, 16)),
-			(strtol(strgroups[2], NULL, 16))
-		};
-		cairo_set_source_rgb(
-				xcb_ctx,
-				rgb16[0] / 255.0,
-				rgb16[1] / 255.0,
-				rgb16[2] / 255.0
+	if (!widget->surface) {
+		widget->surface = cairo_image_surface_create(
+				CAIRO_FORMAT_ARGB32,
+				width,
+				height
 		);
-		cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-		cairo_fill(xcb_ctx);
+		widget->ctx = cairo_create(widget->surface);
+		widget->width = width;
+		widget->height = height;
+		widget->valid = false;
 	}
 
-	/* build indicator color arrays */
-	uint32_t insidever16[4];
-	color_hex_to_long(insidevercolor, insidever16);
-
-	uint32_t insidewrong16[4];
-	color_hex_to_long(insidewrongcolor, insidewrong16);
-
-	uint32_t inside16[4];
-	color_hex_to_long(insidecolor, inside16);
-
-	uint32_t ringver16[4];
-	color_hex_to_long(ringvercolor, ringver16);
+	if (widget->valid && memcmp(widget->key, inputs, size) == 0)
+		return false;
 
-	uint32_t ringwrong16[4];
-	color_hex_to_long(ringwrongcolor, ringwrong16);
+	memcpy(widget->key, inputs, size);
+	widget->valid = true;
+	widget->visible = false;
+	widget->damaged = true;
 
-	uint32_t ring16[4];
-	color_hex_to_long(ringcolor, ring16);
+	cairo_t *ctx = widget->ctx;
+	cairo_save(ctx);
+	cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(ctx);
+	cairo_restore(ctx);
+	cairo_identity_matrix(ctx);
+	cairo_new_path(ctx);
 
-	uint32_t line16[4];
-	color_hex_to_long(linecolor, line16);
+	return true;
+}
 
-	uint32_t text16[4];
-	color_hex_to_long(textcolor, text16);
+/* Composites the widget surface onto the screen at the given position. */
+static void composite_widget(cairo_t *ctx, widget_t *widget,
+		double x, double y, double width, double height)
+{
+	if (!widget->visible)
+		return;
 
-	uint32_t indicator16[4];
-	color_hex_to_long(indicatorscolor, indicator16);
+	cairo_set_source_surface(ctx, widget->surface, x, y);
+	cairo_rectangle(ctx, x, y, width, height);
+	cairo_fill(ctx);
+}
 
-	uint32_t time16[4];
-	color_hex_to_long(timecolor, time16);
+/* Draws text centered horizontally around x with its baseline at y. */
+static void show_text_centered(cairo_t *ctx, const char *text, double x, double y)
+{
+	cairo_text_extents_t extents;
 
-	uint32_t date16[4];
-	color_hex_to_long(datecolor, date16);
+	cairo_text_extents(ctx, text, &extents);
+	cairo_move_to(ctx, x - ((extents.width / 2) + extents.x_bearing), y);
+	cairo_show_text(ctx, text);
+	cairo_close_path(ctx);
+}
 
-	uint32_t keyhl16[4];
-	color_hex_to_long(keyhlcolor, keyhl16);
+/*
+ * Renders the unlock indicator ring and, after the user pressed any valid key
+ * or the backspace key, the highlight of a random part of it.
+ */
+static void render_ring(int diameter, bool show_ring)
+{
+	struct ring_inputs in;
+	memset(&in, 0, sizeof(in));
+	in.scale = scaling_factor();
+	in.radius = BUTTON_RADIUS;
+	in.show_ring = show_ring;
+	in.auth_state = auth_state;
+	in.unlock_state = unlock_state;
+	/* Every keypress highlights another part of the ring, so an active
+	 * highlight always needs a new render. */
+	if (unlock_state == STATE_KEY_ACTIVE
+	||  unlock_state == STATE_BACKSPACE_ACTIVE)
+		in.highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
 
-	uint32_t bshl16[4];
-	color_hex_to_long(bshlcolor, bshl16);
+	if (!widget_update(&ring_widget, diameter, diameter, &in, sizeof(in)))
+		return;
 
-	uint32_t sep16[4];
-	color_hex_to_long(separatorcolor, sep16);
+	cairo_t *ctx = ring_widget.ctx;
+	cairo_scale(ctx, in.scale, in.scale);
 
-	/* https://github.com/ravinrabbid/i3lock-clock/commit/0de3a411fa5249c3a4822612c2d6c476389a1297 */
-	time_t rawtime;
-	struct tm* timeinfo;
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
+	if (show_ring) {
+		uint32_t line16[4];
+		memcpy(line16, palette.line, sizeof(line16));
 
-	if (unlock_indicator &&
-		(unlock_state >= STATE_KEY_PRESSED
-		|| auth_state > STATE_AUTH_IDLE
-		|| always_show_indicator)
-	) {
-		cairo_scale(ctx, scaling_factor(), scaling_factor());
 		/* Draw a (centered) circle with transparent background. */
 		cairo_set_line_width(ctx, 7.0);
 		cairo_arc(ctx,
@@ -307,14 +393,14 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
 		switch (auth_state) {
 		case STATE_AUTH_VERIFY:
 		case STATE_AUTH_LOCK:
-			cairo_set_source_rgba_long(ctx, insidever16);
+			cairo_set_source_rgba_long(ctx, palette.insidever);
 			break;
 		case STATE_AUTH_WRONG:
 		case STATE_I3LOCK_LOCK_FAILED:
-			cairo_set_source_rgba_long(ctx, insidewrong16);
+			cairo_set_source_rgba_long(ctx, palette.insidewrong);
 			break;
 		default:
-			cairo_set_source_rgba_long(ctx, inside16);
+			cairo_set_source_rgba_long(ctx, palette.inside);
 			break;
 		}
 
@@ -323,24 +409,24 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
 		switch (auth_state) {
 		case STATE_AUTH_VERIFY:
 		case STATE_AUTH_LOCK:
-			cairo_set_source_rgba_long(ctx, ringver16);
+			cairo_set_source_rgba_long(ctx, palette.ringver);
 			if (internal_line_source == 1)
-				memcpy(line16, ringver16, sizeof(uint32_t) * 4);
+				memcpy(line16, palette.ringver, sizeof(uint32_t) * 4);
 
 			break;
 
 		case STATE_AUTH_WRONG:
 		case STATE_I3LOCK_LOCK_FAILED:
-			cairo_set_source_rgba_long(ctx, ringwrong16);
+			cairo_set_source_rgba_long(ctx, palette.ringwrong);
 			if (internal_line_source == 1)
-				memcpy(line16, ringwrong16, sizeof(uint32_t) * 4);
+				memcpy(line16, palette.ringwrong, sizeof(uint32_t) * 4);
 
 			break;
 
 		case STATE_AUTH_IDLE:
-			cairo_set_source_rgba_long(ctx, ring16);
+			cairo_set_source_rgba_long(ctx, palette.ring);
 			if (internal_line_source == 1)
-				memcpy(line16, ring16, sizeof(uint32_t) * 4);
+				memcpy(line16, palette.ring, sizeof(uint32_t) * 4);
 
 			break;
 		}
@@ -363,573 +449,890 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
 			cairo_stroke(ctx);
 		}
 
-		cairo_set_line_width(ctx, 10.0);
+		ring_widget.visible = true;
+	}
 
-		const char *text = NULL;
+	if (unlock_state == STATE_KEY_ACTIVE
+	||  unlock_state == STATE_BACKSPACE_ACTIVE) {
+		double highlight_start = in.highlight_start;
 
-		/* We don't want to show more than a 3-digit number. */
-		char buf[4];
-		cairo_set_source_rgba_long(ctx, text16);
-		cairo_select_font_face(ctx,
-			"sans-serif",
-			CAIRO_FONT_SLANT_NORMAL,
-			CAIRO_FONT_WEIGHT_NORMAL
+		cairo_set_line_width(ctx, 7.0);
+		cairo_new_sub_path(ctx);
+		cairo_arc(ctx,
+			BUTTON_CENTER /* x */,
+			BUTTON_CENTER /* y */,
+			BUTTON_RADIUS /* radius */,
+			highlight_start,
+			highlight_start + (M_PI / 3.0)
 		);
+		if (unlock_state == STATE_KEY_ACTIVE) {
+			cairo_set_source_rgba_long(ctx, palette.keyhl);
+		} else {
+			cairo_set_source_rgba_long(ctx, palette.bshl);
+		}
 
-		cairo_set_font_size(ctx, text_size);
+		cairo_stroke(ctx);
+
+		/* Draw two little separators for the highlighted part of the
+		 * unlock indicator. */
+		cairo_set_source_rgba_long(ctx, palette.sep);
+		cairo_arc(ctx,
+			BUTTON_CENTER /* x */,
+			BUTTON_CENTER /* y */,
+			BUTTON_RADIUS /* radius */,
+			highlight_start /* start */,
+			highlight_start + (M_PI / 128.0) /* end */
+		);
+		cairo_stroke(ctx);
+		cairo_arc(ctx,
+			BUTTON_CENTER /* x */,
+			BUTTON_CENTER /* y */,
+			BUTTON_RADIUS /* radius */,
+			(highlight_start + (M_PI / 3.0)) - (M_PI / 128.0) /* start */,
+			highlight_start + (M_PI / 3.0) /* end */);
+		cairo_stroke(ctx);
+
+		ring_widget.visible = true;
+	}
+}
+
+/*
+ * Renders the status text inside the ring: the PAM state, the number of
+ * failed attempts and the active modifiers after a wrong password.
+ */
+static void render_status(int diameter, bool show_ring)
+{
+	struct status_inputs in;
+	memset(&in, 0, sizeof(in));
+	in.scale = scaling_factor();
+	in.radius = BUTTON_RADIUS;
+	in.font_size = text_size;
+
+	if (show_ring) {
 		switch (auth_state) {
 		case STATE_AUTH_VERIFY:
-			text = verif_text;
+			snprintf(in.text, sizeof(in.text), "%s", verif_text);
 			break;
 		case STATE_AUTH_LOCK:
-			text = "locking…";
+			snprintf(in.text, sizeof(in.text), "locking…");
 			break;
 		case STATE_AUTH_WRONG:
-			text = wrong_text;
+			snprintf(in.text, sizeof(in.text), "%s", wrong_text);
 			break;
 		case STATE_I3LOCK_LOCK_FAILED:
-			text = "lock failed!";
+			snprintf(in.text, sizeof(in.text), "lock failed!");
 			break;
 		default:
+			/* We don't want to show more than a 3-digit number. */
 			if (show_failed_attempts && failed_attempts > 0) {
-				if (failed_attempts > 999) {
-					text = "> 999";
-				} else {
-					snprintf(buf, sizeof(buf), "%d", failed_attempts);
-					text = buf;
-				}
-				cairo_set_font_size(ctx, 32.0);
+				if (failed_attempts > 999)
+					snprintf(in.text, sizeof(in.text), "> 999");
+				else
+					snprintf(in.text, sizeof(in.text), "%d", failed_attempts);
+				in.font_size = 32.0;
 			}
 			break;
 		}
 
-		if (text) {
-			cairo_text_extents_t extents;
-			double x, y;
+		if (auth_state == STATE_AUTH_WRONG)
+			snprintf(in.modifiers, sizeof(in.modifiers), "%s", modifier_string);
+	}
+
+	if (!widget_update(&status_widget, diameter, diameter, &in, sizeof(in)))
+		return;
 
-			cairo_text_extents(ctx, text, &extents);
-			x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-			y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing);
+	cairo_t *ctx = status_widget.ctx;
+	cairo_scale(ctx, in.scale, in.scale);
 
-			cairo_move_to(ctx, x, y);
-			cairo_show_text(ctx, text);
-			cairo_close_path(ctx);
-		}
+	cairo_set_source_rgba_long(ctx, palette.text);
+	cairo_select_font_face(ctx,
+		"sans-serif",
+		CAIRO_FONT_SLANT_NORMAL,
+		CAIRO_FONT_WEIGHT_NORMAL
+	);
 
-		if (auth_state == STATE_AUTH_WRONG && (modifier_string != NULL)) {
-			cairo_text_extents_t extents;
-			double x, y;
+	if (in.text[0] != '\0') {
+		cairo_text_extents_t extents;
+		double x, y;
 
-			cairo_set_font_size(ctx, modifier_size);
+		cairo_set_font_size(ctx, in.font_size);
+		cairo_text_extents(ctx, in.text, &extents);
+		x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
+		y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing);
 
-			cairo_text_extents(ctx, modifier_string, &extents);
-			x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-			y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) + 28.0;
+		cairo_move_to(ctx, x, y);
+		cairo_show_text(ctx, in.text);
+		cairo_close_path(ctx);
+		status_widget.visible = true;
+	}
 
-			cairo_move_to(ctx, x, y);
-			cairo_show_text(ctx, modifier_string);
-			cairo_close_path(ctx);
-		}
+	if (in.modifiers[0] != '\0') {
+		cairo_text_extents_t extents;
+		double x, y;
 
+		cairo_set_font_size(ctx, modifier_size);
+
+		cairo_text_extents(ctx, in.modifiers, &extents);
+		x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
+		y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) + 28.0;
+
+		cairo_move_to(ctx, x, y);
+		cairo_show_text(ctx, in.modifiers);
+		cairo_close_path(ctx);
+		status_widget.visible = true;
 	}
+}
 
-	/** Draw Keyboard Layout and Caps Lock Indicator **/
-	int ind_x = INDICATORS_WIDTH / 2;
-	int ind_y = INDICATORS_HEIGHT / 2;
+/* Renders the clock or the date string, centered in its box. */
+static void render_clock_text(widget_t *widget, int width, int height,
+		const char *format, const char *font, double size, uint32_t color16[4],
+		struct tm *timeinfo)
+{
+	struct text_inputs in;
+	memset(&in, 0, sizeof(in));
+	strftime(in.text, 40, format, timeinfo);
+
+	/* Not valid before the first frame and after the font changed. */
+	bool warm = widget->valid;
+	if (!widget_update(widget, width, height, &in, sizeof(in)))
+		return;
+
+	cairo_t *ctx = widget->ctx;
+	cairo_set_font_size(ctx, size);
+	cairo_select_font_face(ctx,
+		font,
+		CAIRO_FONT_SLANT_NORMAL,
+		CAIRO_FONT_WEIGHT_NORMAL
+	);
+	cairo_set_source_rgba_long(ctx, color16);
+
+	/* Draw every digit once, so that cairo has them cached before the clock
+	 * ticks through them and a ticking clock does not allocate. */
+	if (!warm) {
+		show_text_centered(ctx, "0123456789", CLOCK_WIDTH / 2, CLOCK_HEIGHT / 2);
+		cairo_save(ctx);
+		cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+		cairo_paint(ctx);
+		cairo_restore(ctx);
+		cairo_new_path(ctx);
+	}
+	show_text_centered(ctx, in.text, CLOCK_WIDTH / 2, CLOCK_HEIGHT / 2);
+	widget->visible = true;
+}
 
-	if (show_keyboard_layout || show_caps_lock_state) {
-		cairo_set_source_rgba_long(ind_ctx, indicator16);
+/*
+ * Renders a keyboard indicator string (layout or caps lock), centered in the
+ * indicators box and moved down by the given number of text heights.
+ */
+static void render_indicator_text(widget_t *widget, int width, int height,
+		const char *text, double line)
+{
+	struct text_inputs in;
+	memset(&in, 0, sizeof(in));
+	if (text)
+		snprintf(in.text, sizeof(in.text), "%s", text);
+
+	if (!widget_update(widget, width, height, &in, sizeof(in)))
+		return;
+
+	if (!text)
+		return;
+
+	cairo_t *ctx = widget->ctx;
+	cairo_text_extents_t extents;
+	cairo_set_source_rgba_long(ctx, palette.indicator);
+	cairo_select_font_face(ctx,
+		keyl_font,
+		CAIRO_FONT_SLANT_NORMAL,
+		CAIRO_FONT_WEIGHT_NORMAL
+	);
+	cairo_set_font_size(ctx, indicators_size);
+	cairo_text_extents(ctx, text, &extents);
+
+	double x = INDICATORS_WIDTH / 2
+		- extents.width / 2
+		- extents.x_bearing;
+	double y = INDICATORS_HEIGHT / 2
+		- extents.height / 2
+		- extents.y_bearing
+		+ line * extents.height;
+
+	cairo_move_to(ctx, x, y);
+	cairo_show_text(ctx, text);
+	cairo_close_path(ctx);
+	widget->visible = true;
+}
 
-		cairo_select_font_face(ind_ctx,
-			keyl_font,
-			CAIRO_FONT_SLANT_NORMAL,
-			CAIRO_FONT_WEIGHT_NORMAL
-		);
+/* Fills the whole screen with the background color. */
+static void fill_background_color(cairo_t *ctx, uint32_t *resolution)
+{
+	char strgroups[3][3] = {
+		{color[0], color[1], '\0'},
+		{color[2], color[3], '\0'},
+		{color[4], color[5], '\0'}
+	};
+	uint32_t rgb16[3] = {
+		(strtol(strgroups[0], NULL, 16)),
+		(strtol(strgroups[1], NULL, 16)),
+		(strtol(strgroups[2], NULL, 16))
+	};
+	cairo_set_source_rgb(
+			ctx,
+			rgb16[0] / 255.0,
+			rgb16[1] / 255.0,
+			rgb16[2] / 255.0
+	);
+	cairo_rectangle(ctx, 0, 0, resolution[0], resolution[1]);
+	cairo_fill(ctx);
+}
 
-		cairo_set_font_size(ind_ctx, indicators_size);
+/*
+ * Loads the fonts used by the widgets into cairo's font cache, so that the
+ * first frame does not wait for fontconfig. Uses its own surface and may run
+ * on another thread while main() sets up the X11 connection.
+ */
+void warm_up_fonts(void)
+{
+	const char *fonts[] = {"sans-serif", time_font, date_font, keyl_font};
+	cairo_text_extents_t extents;
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+	cairo_t *ctx = cairo_create(surface);
+	for (size_t i = 0; i < sizeof(fonts) / sizeof(fonts[0]); i++) {
+		cairo_select_font_face(ctx, fonts[i],
+				CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+		cairo_text_extents(ctx, "0", &extents);
+	}
+	cairo_destroy(ctx);
+	cairo_surface_destroy(surface);
+}
 
+/*
+ * Frees the background pixmaps, they will be created again with the current
+ * resolution on the next draw_image() call.
+ */
+void free_bg_pixmaps(void) {
+	for (int i = 0; i < BG_PIXMAPS; i++) {
+		if (bg_pixmaps[i].pixmap == XCB_NONE)
+			continue;
+
+		cairo_destroy(bg_pixmaps[i].ctx);
+		cairo_surface_destroy(bg_pixmaps[i].surface);
+		xcb_free_pixmap(conn, bg_pixmaps[i].pixmap);
+		bg_pixmaps[i].pixmap = XCB_NONE;
+		bg_pixmaps[i].busy = false;
+		bg_pixmaps[i].target = (render_target_t){0};
+	}
+}
 
-		/* Get Keyboard Layout boundaries */
-		XkbGetState(_display, XkbUseCoreKbd, &xkbState);
-		char *kb_layout = kb_layouts_group[xkbState.group];
-		cairo_text_extents_t kb_layout_extents;
-		cairo_text_extents(ind_ctx, kb_layout, &kb_layout_extents);
-
-		/* Get Caps Lock indicator boundaries */
-		cairo_text_extents_t caps_extents;
-		cairo_text_extents(ind_ctx, CAPS_LOCK_STRING, &caps_extents);
-
-		// Keyboard layout
-		if (show_keyboard_layout) {
-
-
-			double kb_layout_x
-				= ind_x
-				- kb_layout_extents.width / 2
-				- kb_layout_extents.x_bearing;
-			double kb_layout_y
-				= ind_y
-				- kb_layout_extents.height / 2
-				- kb_layout_extents.y_bearing;
-
-			cairo_move_to(ind_ctx, kb_layout_x, kb_layout_y);
-			cairo_show_text(ind_ctx, kb_layouts_group[xkbState.group]);
-			cairo_close_path(ind_ctx);
-		}
+/*******************************************************************************
+ * Damage.
+ *
+ * Every frame records what it changes on the screen: the widgets which were
+ * rendered again, and the ones which moved (at their old and new places). A
+ * target only has the damage of the frames drawn since it was last drawn on
+ * repainted, the rest of it already shows the current frame. For the
+ * background pixmaps, that is the damage of the last two frames.
+ ******************************************************************************/
 
-		/* Caps Lock state */
-		if (show_caps_lock_state) {
-			double caps_lock_state_x
-				= ind_x
-				- caps_extents.width / 2
-				- caps_extents.x_bearing;
-
-			double caps_lock_state_y
-				= ind_y
-				- caps_extents.height / 2
-				- caps_extents.y_bearing
-				+ 1.5 * caps_extents.height;
-
-			XGetKeyboardControl(_display, &xKeyboardState);
-			/* if caps lock is switched on */
-			if (xKeyboardState.led_mask % 2 == 1) {
-				cairo_move_to(ind_ctx, caps_lock_state_x, caps_lock_state_y);
-				cairo_show_text(ind_ctx, CAPS_LOCK_STRING);
-				cairo_close_path(ind_ctx);
-			}
-		}
+#define DAMAGE_RECTS 32
+#define DAMAGE_FRAMES 4
+
+typedef struct damage {
+	/* The whole target has to be repainted. */
+	bool all;
+	int count;
+	cairo_rectangle_int_t rects[DAMAGE_RECTS];
+} damage_t;
+
+static struct {
+	/* Serial of the last frame, the first one is 1. */
+	uint64_t serial;
+	/* Set when the settings changed: the next frame repaints everything. */
+	bool all;
+	/* What the widget sizes depend on. */
+	int diameter;
+	double scale;
+	damage_t frames[DAMAGE_FRAMES];
+} damage;
+
+/* The pixels covered by the given rectangle. */
+static cairo_rectangle_int_t damage_rect(double x, double y, double width, double height)
+{
+	int x0 = floor(x), y0 = floor(y);
+	return (cairo_rectangle_int_t){x0, y0, ceil(x + width) - x0, ceil(y + height) - y0};
+}
 
+static void damage_add(damage_t *d, cairo_rectangle_int_t rect)
+{
+	if (d->all)
+		return;
+	if (d->count == DAMAGE_RECTS) {
+		d->all = true;
+		return;
 	}
+	d->rects[d->count++] = rect;
+}
 
+/* Adds the widget at the given origin, unless it is not placed. */
+static void damage_widget(damage_t *d, double x, double y, double width, double height)
+{
+	if (!isnan(x) && !isnan(y))
+		damage_add(d, damage_rect(x, y, width, height));
+}
 
-	/*
-	 * After the user pressed any valid key or the backspace key, we
-	 * highlight a random part of the unlock indicator to confirm this
-	 * keypress.
-	 */
-	if (unlock_state == STATE_KEY_ACTIVE
-	||  unlock_state == STATE_BACKSPACE_ACTIVE) {
-		cairo_set_line_width(ctx, 7.0);
-		cairo_new_sub_path(ctx);
-		double highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
-		cairo_arc(ctx,
-			BUTTON_CENTER /* x */,
-			BUTTON_CENTER /* y */,
-			BUTTON_RADIUS /* radius */,
-			highlight_start,
-			highlight_start + (M_PI / 3.0)
-		);
-		if (unlock_state == STATE_KEY_ACTIVE) {
-			cairo_set_source_rgba_long(ctx, keyhl16);
+static bool damage_intersects(const damage_t *d, cairo_rectangle_int_t rect)
+{
+	if (d->all)
+		return true;
+	for (int i = 0; i < d->count; i++) {
+		const cairo_rectangle_int_t *r = &d->rects[i];
+		if (r->x < rect.x + rect.width && rect.x < r->x + r->width &&
+			r->y < rect.y + rect.height && rect.y < r->y + r->height)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Collects what has to be repainted on the target for the current frame: the
+ * damage of the frames since the target was last drawn on, or everything if
+ * that is too long ago.
+ */
+static void damage_since(damage_t *d, const render_target_t *target,
+		const uint32_t *resolution)
+{
+	*d = (damage_t){0};
+	if (target == NULL || target->frame == 0 ||
+		damage.serial - target->frame > DAMAGE_FRAMES ||
+		target->resolution[0] != resolution[0] ||
+		target->resolution[1] != resolution[1]) {
+		d->all = true;
+		return;
+	}
+
+	for (uint64_t f = target->frame + 1; f <= damage.serial && !d->all; f++) {
+		const damage_t *frame = &damage.frames[f % DAMAGE_FRAMES];
+		d->all = frame->all;
+		for (int i = 0; i < frame->count; i++)
+			damage_add(d, frame->rects[i]);
+	}
+}
+
+/* Per-stage timings of render_frame(), only collected if set (see bench.c). */
+render_timings_t *render_timings;
+
+/* Returns the time since *start and restarts the measurement. */
+static uint64_t stage_elapsed(uint64_t *start)
+{
+	uint64_t now = now_usec();
+	uint64_t elapsed = now - *start;
+	*start = now;
+	return elapsed;
+}
+
+/* Paints the background image or color, clipped by the caller. */
+static void paint_background(cairo_t *ctx, uint32_t *resolution)
+{
+	if (img) {
+		if (!tile) {
+			/* The pixmap still holds an older frame, so fill what the
+			 * image does not cover with the background color. */
+			if (cairo_image_surface_get_width(img) < resolution[0] ||
+				cairo_image_surface_get_height(img) < resolution[1])
+				fill_background_color(ctx, resolution);
+			cairo_set_source_surface(ctx, img, 0, 0);
+			cairo_paint(ctx);
 		} else {
-			cairo_set_source_rgba_long(ctx, bshl16);
+			/* fill a rectangle as big as the screen with a pattern, which is
+			 * kept for as long as the image does not change */
+			static cairo_pattern_t *pattern;
+			static cairo_surface_t *pattern_img;
+			if (pattern_img != img) {
+				if (pattern)
+					cairo_pattern_destroy(pattern);
+				pattern = cairo_pattern_create_for_surface(img);
+				cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+				pattern_img = img;
+			}
+			cairo_set_source(ctx, pattern);
+			cairo_rectangle(ctx, 0, 0, resolution[0], resolution[1]);
+			cairo_fill(ctx);
 		}
 
-		cairo_stroke(ctx);
-
-		/* Draw two little separators for the highlighted part of the
-		 * unlock indicator. */
-		cairo_set_source_rgba_long(ctx, sep16);
-		cairo_arc(ctx,
-			BUTTON_CENTER /* x */,
-			BUTTON_CENTER /* y */,
-			BUTTON_RADIUS /* radius */,
-			highlight_start /* start */,
-			highlight_start + (M_PI / 128.0) /* end */
-		);
-		cairo_stroke(ctx);
-		cairo_arc(ctx,
-			BUTTON_CENTER /* x */,
-			BUTTON_CENTER /* y */,
-			BUTTON_RADIUS /* radius */,
-			(highlight_start + (M_PI / 3.0)) - (M_PI / 128.0) /* start */,
-			highlight_start + (M_PI / 3.0) /* end */);
-		cairo_stroke(ctx);
+	} else {
+		fill_background_color(ctx, resolution);
 	}
+}
+
+/*
+ * Renders a frame (background image or color, unlock indicator, clock and
+ * keyboard indicators) for the current state onto the given cairo context.
+ * Only what changed since target was last drawn on is repainted; without a
+ * target, the whole frame is. The screen layout is taken from
+ * xr_screens/xr_resolutions, the keyboard state is passed in by the caller,
+ * so this works on any cairo surface and does not need an X connection.
+ */
+void render_frame(cairo_t *ctx, render_target_t *target, uint32_t *resolution,
+		const char *kb_layout, bool caps_lock, time_t now) {
+	int button_diameter_physical = ceil(scaling_factor() * BUTTON_DIAMETER);
+	int clock_width_physical = ceil(scaling_factor() * CLOCK_WIDTH);
+	int clock_height_physical = ceil(scaling_factor() * CLOCK_HEIGHT);
+	int indicators_height_physical = ceil(scaling_factor() * INDICATORS_HEIGHT);
+	int indicators_width_physical = ceil(scaling_factor() * INDICATORS_WIDTH);
+	TRACE(TRACE_RENDER_BEGIN, button_diameter_physical, 0);
+
+	if (!palette_loaded) load_palette();
+
+	uint64_t stage_start = render_timings ? now_usec() : 0;
+
+	/* https://github.com/ravinrabbid/i3lock-clock/commit/0de3a411fa5249c3a4822612c2d6c476389a1297 */
+	struct tm* timeinfo;
+	timeinfo = localtime(&now);
+
+	/* Bring the widgets up to date, re-rendering only what changed. */
+	bool show_ring = unlock_indicator &&
+		(unlock_state >= STATE_KEY_PRESSED
+		|| auth_state > STATE_AUTH_IDLE
+		|| always_show_indicator);
+
+	render_ring(button_diameter_physical, show_ring);
+	if (render_timings)
+		render_timings->ring = stage_elapsed(&stage_start);
+	render_status(button_diameter_physical, show_ring);
+	if (render_timings)
+		render_timings->status = stage_elapsed(&stage_start);
+
+	/** Keyboard Layout and Caps Lock Indicator **/
+	render_indicator_text(&layout_widget,
+			indicators_width_physical, indicators_height_physical,
+			show_keyboard_layout ? kb_layout : NULL, 0);
+	render_indicator_text(&caps_widget,
+			indicators_width_physical, indicators_height_physical,
+			show_caps_lock_state && caps_lock ? CAPS_LOCK_STRING : NULL, 1.5);
+	if (render_timings)
+		render_timings->keyboard = stage_elapsed(&stage_start);
 
 	if (show_clock) {
-		char *text = NULL;
-		char *date = NULL;
-		char time_text[40] = {0};
-		char date_text[40] = {0};
-
-		strftime(time_text, 40, time_format, timeinfo);
-		strftime(date_text, 40, date_format, timeinfo);
-		text = time_text;
-		date = date_text;
-
-		if (text) {
-			double x, y;
-			cairo_text_extents_t extents;
-
-			cairo_set_font_size(time_ctx, time_size);
-			cairo_select_font_face(
-				time_ctx, time_font,
-				CAIRO_FONT_SLANT_NORMAL,
-				CAIRO_FONT_WEIGHT_NORMAL
-			);
-			cairo_set_source_rgba_long(time_ctx, time16);
-
-			cairo_text_extents(time_ctx, text, &extents);
-
-			x = (CLOCK_WIDTH / 2)
-				- ((extents.width / 2) + extents.x_bearing);
-			y = CLOCK_HEIGHT / 2;
-
-			cairo_move_to(time_ctx, x, y);
-			cairo_show_text(time_ctx, text);
-			cairo_close_path(time_ctx);
+		render_clock_text(&time_widget,
+				clock_width_physical, clock_height_physical,
+				time_format, time_font, time_size, palette.time, timeinfo);
+		render_clock_text(&date_widget,
+				clock_width_physical, clock_height_physical,
+				date_format, date_font, date_size, palette.date, timeinfo);
+	}
+	if (render_timings)
+		render_timings->clock = stage_elapsed(&stage_start);
+
+	const layout_t *layout = layout_update(resolution, button_diameter_physical);
+	const layout_t *previous = layout->previous;
+	const struct {
+		widget_t *widget;
+		unsigned moved;
+		const double *x, *y;
+		const double *old_x, *old_y;
+		double width, height;
+	} placed[] = {
+		{&ring_widget, LAYOUT_RING, layout->ring_x, layout->ring_y,
+			previous->ring_x, previous->ring_y,
+			button_diameter_physical, button_diameter_physical},
+		{&status_widget, LAYOUT_RING, layout->ring_x, layout->ring_y,
+			previous->ring_x, previous->ring_y,
+			button_diameter_physical, button_diameter_physical},
+		{&layout_widget, LAYOUT_KEY, layout->key_x, layout->key_y,
+			previous->key_x, previous->key_y,
+			indicators_width_physical, indicators_height_physical},
+		{&caps_widget, LAYOUT_KEY, layout->key_x, layout->key_y,
+			previous->key_x, previous->key_y,
+			indicators_width_physical, indicators_height_physical},
+		{&time_widget, LAYOUT_TIME, layout->time_x, layout->time_y,
+			previous->time_x, previous->time_y,
+			CLOCK_WIDTH, CLOCK_HEIGHT},
+		{&date_widget, LAYOUT_DATE, layout->date_x, layout->date_y,
+			previous->date_x, previous->date_y,
+			CLOCK_WIDTH, CLOCK_HEIGHT},
+	};
+	const int widgets = sizeof(placed) / sizeof(placed[0]);
+
+	/* Record the damage of this frame: the widgets rendered again, and the
+	 * ones which moved at their old and new places. */
+	damage.serial++;
+	damage_t *frame = &damage.frames[damage.serial % DAMAGE_FRAMES];
+	*frame = (damage_t){0};
+	frame->all = damage.all || layout->damage == LAYOUT_ALL ||
+		damage.diameter != button_diameter_physical ||
+		damage.scale != scaling_factor();
+	damage.all = false;
+	damage.diameter = button_diameter_physical;
+	damage.scale = scaling_factor();
+	for (int w = 0; w < widgets; w++) {
+		bool moved = layout->damage & placed[w].moved;
+		if (!placed[w].widget->damaged && !moved)
+			continue;
+		placed[w].widget->damaged = false;
+		for (int i = 0; i < layout->count; i++) {
+			damage_widget(frame, placed[w].x[i], placed[w].y[i],
+					placed[w].width, placed[w].height);
+			if (moved)
+				damage_widget(frame, placed[w].old_x[i], placed[w].old_y[i],
+						placed[w].width, placed[w].height);
 		}
+	}
+
+	damage_t clip;
+	damage_since(&clip, target, resolution);
+	if (target) {
+		target->frame = damage.serial;
+		target->resolution[0] = resolution[0];
+		target->resolution[1] = resolution[1];
+	}
+
+	cairo_save(ctx);
+	if (!clip.all) {
+		for (int i = 0; i < clip.count; i++)
+			cairo_rectangle(ctx, clip.rects[i].x, clip.rects[i].y,
+					clip.rects[i].width, clip.rects[i].height);
+		cairo_clip(ctx);
+	}
 
-		if (date) {
-			double x, y;
-			cairo_text_extents_t extents;
-
-			cairo_select_font_face(date_ctx,
-				date_font,
-				CAIRO_FONT_SLANT_NORMAL,
-				CAIRO_FONT_WEIGHT_NORMAL
-			);
-			cairo_set_source_rgba_long(date_ctx, date16);
-			cairo_set_font_size(date_ctx, date_size);
-
-			cairo_text_extents(date_ctx, date, &extents);
-			x = CLOCK_WIDTH / 2
-				- ((extents.width / 2) + extents.x_bearing);
-			y = CLOCK_HEIGHT / 2;
-
-			cairo_move_to(date_ctx, x, y);
-			cairo_show_text(date_ctx, date);
-			cairo_close_path(date_ctx);
+	if (clip.all || clip.count > 0)
+		paint_background(ctx, resolution);
+	if (render_timings)
+		render_timings->background = stage_elapsed(&stage_start);
+
+	/* Composite the widgets onto every screen, skipping the ones outside of
+	 * the damage. */
+	for (int i = 0; i < layout->count; i++) {
+		for (int w = 0; w < widgets; w++) {
+			double x = placed[w].x[i], y = placed[w].y[i];
+			if (isnan(x) || isnan(y) ||
+				!damage_intersects(&clip, damage_rect(x, y, placed[w].width, placed[w].height)))
+				continue;
+			composite_widget(ctx, placed[w].widget, x, y,
+					placed[w].width, placed[w].height);
 		}
 	}
+	cairo_restore(ctx);
+
+	if (render_timings)
+		render_timings->composite = stage_elapsed(&stage_start);
+	TRACE(TRACE_RENDER_END, 0, 0);
+}
 
-	/*
-	 * I'm not even going to try to refactor this code.
-	 * Screw it. It works. It's not my problem.
-	 */
-	double unx, uny;
-	double x, y;
-	double screen_x, screen_y;
-	double w, h;
-	double tx = 0;
-	double ty = 0;
-	double indx, indy;
-
-	double clock_width = CLOCK_WIDTH;
-	double clock_height = CLOCK_HEIGHT;
-
-	double radius = BUTTON_RADIUS;
-	int te_x_err;
-	int te_y_err;
-	// variable mapping for evaluating the clock position expression
+/* Whether any of the given settings differs from the snapshot. */
+static bool any_changed(const void *old, const void *targets[], size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		if (settings_changed(old, targets[i]))
+			return true;
+	return false;
+}
+
+#define ANY_CHANGED(old, ...) \
+	any_changed(old, (const void *[]){__VA_ARGS__}, \
+			sizeof((const void *[]){__VA_ARGS__}) / sizeof(const void *))
+
+/*
+ * Drops whatever was derived from settings which differ between the given
+ * settings_save() snapshot and the current settings, so that the next frame
+ * is rendered with the new ones. Everything else is kept.
+ */
+void settings_reloaded(const void *old)
+{
+	widget_t *widgets[] = {
+		&ring_widget, &status_widget, &time_widget,
+		&date_widget, &layout_widget, &caps_widget
+	};
+
+	if (ANY_CHANGED(old, &insidevercolor, &insidewrongcolor, &insidecolor,
+			&ringvercolor, &ringwrongcolor, &ringcolor, &linecolor,
+			&textcolor, &timecolor, &datecolor, &keyhlcolor, &bshlcolor,
+			&separatorcolor, &indicatorscolor)) {
+		DEBUG("colors changed, rendering all widgets again\n");
+		palette_loaded = false;
+		for (size_t i = 0; i < sizeof(widgets) / sizeof(widgets[0]); i++)
+			widgets[i]->valid = false;
+	}
+
+	if (ANY_CHANGED(old, &verif_text, &wrong_text, &text_size, &modifier_size))
+		status_widget.valid = false;
+	if (ANY_CHANGED(old, &time_font, &time_size))
+		time_widget.valid = false;
+	if (ANY_CHANGED(old, &date_font, &date_size))
+		date_widget.valid = false;
+	if (ANY_CHANGED(old, &keyl_font, &indicators_size)) {
+		layout_widget.valid = false;
+		caps_widget.valid = false;
+	}
+
+	/* The background pixmaps are created filled with the background color. */
+	if (ANY_CHANGED(old, &color))
+		free_bg_pixmaps();
+
+	/* Anything may look different now, including the background image. */
+	damage.all = true;
+
+	alloc_warm_up();
+}
+
+/*
+ * Returns the first position expression which does not compile with the
+ * variables render_frame() provides, or NULL if all of them do.
+ */
+const char *invalid_position_expr(void)
+{
+	double value = 0;
 	te_variable vars[] = {
-		{"w", &w}, {"h", &h},
-		{"x", &screen_x}, {"y", &screen_y},
-		{"ix", &unx}, {"iy", &uny},
-		{"tx", &tx}, {"ty", &ty},
-		{"cw", &clock_width}, {"ch", &clock_height},
-		{"r", &radius}
+		{"w", &value}, {"h", &value},
+		{"x", &value}, {"y", &value},
+		{"ix", &value}, {"iy", &value},
+		{"tx", &value}, {"ty", &value},
+		{"cw", &value}, {"ch", &value},
+		{"r", &value}
+	};
+	const char *exprs[] = {
+		unlock_x_expr, unlock_y_expr,
+		time_x_expr, time_y_expr,
+		date_x_expr, date_y_expr,
+		key_x_expr, key_y_expr
 	};
 
-	te_expr *te_unlock_x_expr = te_compile(unlock_x_expr, vars, 11, &te_x_err);
-	te_expr *te_unlock_y_expr = te_compile(unlock_y_expr, vars, 11, &te_y_err);
-	te_expr *te_time_x_expr = te_compile(time_x_expr, vars, 11, &te_x_err);
-	te_expr *te_time_y_expr = te_compile(time_y_expr, vars, 11, &te_y_err);
-	te_expr *te_date_x_expr = te_compile(date_x_expr, vars, 11, &te_x_err);
-	te_expr *te_date_y_expr = te_compile(date_y_expr, vars, 11, &te_y_err);
-	te_expr *te_key_x_expr	= te_compile(key_x_expr, vars, 11, &te_x_err);
-	te_expr *te_key_y_expr 	= te_compile(key_y_expr, vars, 11, &te_y_err);
-
-	if (xr_screens > 0) {
-		/* Composite the unlock indicator in the middle of each screen. */
-		// excuse me, just gonna hack something in right here
-		if (screen_number != -1 && screen_number < xr_screens) {
-			w = xr_resolutions[screen_number].width;
-			h = xr_resolutions[screen_number].height;
-			screen_x = xr_resolutions[screen_number].x;
-			screen_y = xr_resolutions[screen_number].y;
-			if (te_unlock_x_expr && te_unlock_y_expr) {
-				unx = 0;
-				uny = 0;
-				unx = te_eval(te_unlock_x_expr);
-				uny = te_eval(te_unlock_y_expr);
-				DEBUG("\tscreen x: %d "
-					"screen y: %d "
-					"screen w: %f "
-					"screen h: %f "
-					"ix: %f iy: %f\n",
-					xr_resolutions[screen_number].x,
-					xr_resolutions[screen_number].y,
-					w, h,
-					unx, uny
-				);
-			}
-			else {
-				unx = xr_resolutions[screen_number].x
-					+ (xr_resolutions[screen_number].width / 2);
+	for (size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+		int error;
+		te_expr *expr = te_compile(exprs[i], vars, 11, &error);
+		if (!expr)
+			return exprs[i];
+		te_free(expr);
+	}
 
-				uny = xr_resolutions[screen_number].y
-					+ (xr_resolutions[screen_number].height / 2);
-			}
+	return NULL;
+}
 
-			x = unx - (button_diameter_physical / 2);
-			y = uny - (button_diameter_physical / 2);
-
-			cairo_set_source_surface(xcb_ctx, output, x, y);
-			cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-			cairo_fill(xcb_ctx);
-
-			indx = te_eval(te_key_x_expr);
-			indy = te_eval(te_key_y_expr);
-			cairo_set_source_surface(xcb_ctx, indicators_output, indx - 150, indy - 150);
-			cairo_rectangle(xcb_ctx,
-					indx - 150,
-					indy - 150,
-					indicators_width_physical,
-					indicators_height_physical
-			);
-			cairo_fill(xcb_ctx);
-
-			if (te_time_x_expr && te_time_y_expr) {
-				tx = 0;
-				ty = 0;
-				tx = te_eval(te_time_x_expr);
-				ty = te_eval(te_time_y_expr);
-				double time_x = tx;
-				double time_y = ty;
-				double date_x = te_eval(te_date_x_expr);
-				double date_y = te_eval(te_date_y_expr);
-				DEBUG("\ttx: %f "
-					"ty: %f "
-					"unx: %f, uny: %f\n",
-					tx, ty,
-					unx, uny
-				);
-				DEBUG("\ttime_x: %f "
-					"time_y: %f "
-					"date_x: %f "
-					"date_y: %f "
-					"screen_number: %d\n",
-					time_x, time_y,
-					date_x, date_y,
-					screen_number
-				);
-				DEBUG("\tscreen x: %d "
-					"screen y: %d "
-					"screen w: %f "
-					"screen h: %f\n",
-					xr_resolutions[screen_number].x,
-					xr_resolutions[screen_number].y,
-					w, h
-				);
-				cairo_set_source_surface(xcb_ctx, time_output, time_x, time_y);
-				cairo_rectangle(xcb_ctx, time_x, time_y, CLOCK_WIDTH, CLOCK_HEIGHT);
-				cairo_fill(xcb_ctx);
-				cairo_set_source_surface(xcb_ctx, date_output, date_x, date_y);
-				cairo_rectangle(xcb_ctx, date_x, date_y, CLOCK_WIDTH, CLOCK_HEIGHT);
-				cairo_fill(xcb_ctx);
-			}
+/* Queries the keyboard layout and caps lock state shown by the indicators. */
+static void query_keyboard_state(const char **kb_layout, bool *caps_lock)
+{
+	*kb_layout = NULL;
+	*caps_lock = false;
 
-		} else {
-			for (int screen = 0; screen < xr_screens; screen++) {
-				w = xr_resolutions[screen].width;
-				h = xr_resolutions[screen].height;
-				screen_x = xr_resolutions[screen].x;
-				screen_y = xr_resolutions[screen].y;
-				if (te_unlock_x_expr && te_unlock_y_expr) {
-					unx = 0;
-					uny = 0;
-					unx = te_eval(te_unlock_x_expr);
-					uny = te_eval(te_unlock_y_expr);
-					DEBUG("\tscreen x: %d "
-						"screen y: %d "
-						"screen w: %f "
-						"screen h: %f "
-						"unx: %f uny: %f\n",
-						xr_resolutions[screen].x,
-						xr_resolutions[screen].y,
-						w, h,
-						unx, uny
-					);
-				} else {
-					unx = xr_resolutions[screen].x + (xr_resolutions[screen].width / 2);
-					uny = xr_resolutions[screen].y + (xr_resolutions[screen].height / 2);
-				}
-				x = unx - (button_diameter_physical / 2);
-				y = uny - (button_diameter_physical / 2);
-				cairo_set_source_surface(xcb_ctx, output, x, y);
-				cairo_rectangle(xcb_ctx,
-						x, y,
-						button_diameter_physical,
-						button_diameter_physical
-				);
-				cairo_fill(xcb_ctx);
-
-				/** Draw Keyboard indicator **/
-				/** Draw currently happens here **/
-				indx = te_eval(te_key_x_expr);
-				indy = te_eval(te_key_y_expr);
-
-				cairo_set_source_surface(xcb_ctx,
-						indicators_output,
-						indx - 150,
-						indy - 150
-				);
-				cairo_rectangle(xcb_ctx,
-						indx - 150,
-						indy - 150,
-						indicators_width_physical,
-						indicators_height_physical
-				);
-				cairo_fill(xcb_ctx);
-
-
-				if (te_time_x_expr && te_time_y_expr) {
-					tx = 0;
-					ty = 0;
-					tx = te_eval(te_time_x_expr);
-					ty = te_eval(te_time_y_expr);
-					double time_x = tx;
-					double time_y = ty;
-					double date_x = te_eval(te_date_x_expr);
-					double date_y = te_eval(te_date_y_expr);
-					DEBUG("\ttx: %f "
-						"ty: %f "
-						"unx: %f "
-						"uny: %f\n",
-						tx, ty,
-						unx, uny
-					);
-					DEBUG("\ttime_x: %f "
-						"time_y: %f "
-						"date_x: %f "
-						"date_y: %f "
-						"screen_number: %d\n",
-						time_x, time_y,
-						date_x, date_y,
-						screen
-					);
-					DEBUG("\tscreen x: %d "
-						"screen y: %d "
-						"screen w: %f "
-						"screen h: %f\n",
-						xr_resolutions[screen].x,
-						xr_resolutions[screen].y,
-						w, h
-					);
-					cairo_set_source_surface(xcb_ctx,
-							time_output,
-							time_x, time_y
-					);
-					cairo_rectangle(xcb_ctx,
-							time_x, time_y,
-							CLOCK_WIDTH,
-							CLOCK_HEIGHT
-					);
-					cairo_fill(xcb_ctx);
-					cairo_set_source_surface(xcb_ctx,
-							date_output,
-							date_x, date_y
-					);
-					cairo_rectangle(xcb_ctx,
-							date_x, date_y,
-							CLOCK_WIDTH,
-							CLOCK_HEIGHT
-					);
-					cairo_fill(xcb_ctx);
-				} else {
-					DEBUG("\terror codes for exprs are "
-						"%d, %d\n",
-						te_x_err, te_y_err
-					);
-					DEBUG("\texprs: %s, %s\n",
-						time_x_expr, time_y_expr
-					);
-				}
-			}
-		}
-	} else {
-		/* We have no information about the screen sizes/positions, so we just
-		 * place the unlock indicator in the middle of the X root window and
-		 * hope for the best. */
-		w = last_resolution[0];
-		h = last_resolution[1];
-		unx = last_resolution[0] / 2;
-		uny = last_resolution[1] / 2;
-		x = unx - (button_diameter_physical / 2);
-		y = uny - (button_diameter_physical / 2);
-		cairo_set_source_surface(xcb_ctx, output, x, y);
-		cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-		cairo_fill(xcb_ctx);
-		if (te_time_x_expr && te_time_y_expr) {
-			tx = te_eval(te_time_x_expr);
-			ty = te_eval(te_time_y_expr);
-			double time_x = tx - CLOCK_WIDTH / 2;
-			double time_y = tx - CLOCK_HEIGHT / 2;
-			double date_x = te_eval(te_date_x_expr) - CLOCK_WIDTH / 2;
-			double date_y = te_eval(te_date_y_expr) - CLOCK_HEIGHT / 2;
-			DEBUG("Placing time at %f, %f\n", time_x, time_y);
-			cairo_set_source_surface(xcb_ctx, time_output, time_x, time_y);
-			cairo_rectangle(xcb_ctx, time_x, time_y, CLOCK_WIDTH, CLOCK_HEIGHT);
-			cairo_fill(xcb_ctx);
-			cairo_set_source_surface(xcb_ctx, date_output, date_x, date_y);
-			cairo_rectangle(xcb_ctx, date_x, date_y, CLOCK_WIDTH, CLOCK_HEIGHT);
-			cairo_fill(xcb_ctx);
-		}
+	if (show_keyboard_layout) {
+		XkbGetState(_display, XkbUseCoreKbd, &xkbState);
+		*kb_layout = kb_layouts_group[xkbState.group];
+	}
 
-		/* Draw Keyboard indicator */
-		indx = te_eval(te_key_x_expr);
-		indy = te_eval(te_key_y_expr);
-		cairo_set_source_surface(xcb_ctx,
-				indicators_output,
-				indx - 150, indy - 150
-		);
-		cairo_rectangle(xcb_ctx,
-				indx - 150, indy - 150,
-				indicators_width_physical,
-				indicators_height_physical
+	if (show_caps_lock_state) {
+		XGetKeyboardControl(_display, &xKeyboardState);
+		/* if caps lock is switched on */
+		*caps_lock = (xKeyboardState.led_mask % 2 == 1);
+	}
+}
+
+/*
+ * Draws global image with fill color onto the next background pixmap with
+ * the given resolution and returns it. The pixmap stays owned by
+ * unlock_indicator.c and must not be freed by the caller.
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+	if (!vistype) vistype = get_root_visual_type(screen);
+
+	if (bg_resolution[0] != resolution[0] || bg_resolution[1] != resolution[1]) {
+		free_bg_pixmaps();
+		bg_resolution[0] = resolution[0];
+		bg_resolution[1] = resolution[1];
+	}
+
+	/* Draw on the pixmap which is not shown right now. */
+	bg_current = (bg_current + 1) % BG_PIXMAPS;
+	if (bg_pixmaps[bg_current].pixmap == XCB_NONE) {
+		xcb_pixmap_t pixmap = create_bg_pixmap(conn, screen, resolution, color);
+		/*
+		 * Initialize cairo: Create one XCB surface to actually draw (one
+		 * or more, depending on the amount of screens) the widgets on.
+		 */
+		bg_pixmaps[bg_current].pixmap = pixmap;
+		bg_pixmaps[bg_current].surface = cairo_xcb_surface_create(
+				conn, pixmap,
+				vistype,
+				resolution[0],
+				resolution[1]
 		);
-		cairo_fill(xcb_ctx);
+		bg_pixmaps[bg_current].ctx = cairo_create(bg_pixmaps[bg_current].surface);
 	}
+	xcb_pixmap_t bg_pixmap = bg_pixmaps[bg_current].pixmap;
+	cairo_t *ctx = bg_pixmaps[bg_current].ctx;
 
-	/* XXX: Free them */
-	cairo_surface_destroy(xcb_output);
-	cairo_surface_destroy(time_output);
-	cairo_surface_destroy(date_output);
-	cairo_surface_destroy(indicators_output);
-	cairo_surface_destroy(output);
-	cairo_destroy(ctx);
-	cairo_destroy(time_ctx);
-	cairo_destroy(date_ctx);
-	cairo_destroy(ind_ctx);
-	cairo_destroy(xcb_ctx);
-
-	te_free(te_unlock_x_expr);
-	te_free(te_unlock_y_expr);
-	te_free(te_time_x_expr);
-	te_free(te_time_y_expr);
-	te_free(te_date_x_expr);
-	te_free(te_date_y_expr);
-	te_free(te_key_x_expr);
-	te_free(te_key_y_expr);
+	const char *kb_layout;
+	bool caps_lock;
+	query_keyboard_state(&kb_layout, &caps_lock);
+
+	render_frame(ctx, &bg_pixmaps[bg_current].target, resolution,
+			kb_layout, caps_lock, time(NULL));
+	cairo_surface_flush(bg_pixmaps[bg_current].surface);
 
 	return bg_pixmap;
 }
 
 /*
- * Calls draw_image on a new pixmap and swaps that with the current pixmap
+ * Starts presenting frames through the Present extension if the server
+ * supports it. Must be called once the lock window exists.
+ *
+ */
+void init_present(void) {
+	present_opcode = present_select_window(conn, win);
+	DEBUG("Present extension %s\n", present_opcode ? "available" : "not available");
+}
+
+/*
+ * Calls draw_image on the back pixmap and swaps that with the current pixmap
+ * right away, regardless of any scheduled or unfinished frame. Use this when
+ * the event loop is about to be blocked (e.g. by PAM).
  *
  */
 void redraw_screen(void) {
-	DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
+	frame_pending = false;
+	TRACE(TRACE_FRAME_BEGIN, frame_serial + 1, 0);
+	/* Everything up to the end counts as the frame, presenting included. */
+	alloc_frame_begin();
+
+	/* The stage timings are only needed for the statistics socket. */
+	static render_timings_t timings;
+	bool timed = stats_socket[0] != '\0' && render_timings == NULL;
+	if (timed)
+		render_timings = &timings;
 	xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-	xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-	/* XXX: Possible optimization: Only update the area in the middle of the
-	 * screen instead of the whole screen. */
-	xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-	xcb_free_pixmap(conn, bg_pixmap);
+	if (timed) {
+		render_timings = NULL;
+		histogram_add(&render_background_time, timings.background);
+		histogram_add(&render_ring_time, timings.ring);
+		histogram_add(&render_status_time, timings.status);
+		histogram_add(&render_keyboard_time, timings.keyboard);
+		histogram_add(&render_clock_time, timings.clock);
+		histogram_add(&render_composite_time, timings.composite);
+	}
+	frames_rendered++;
+	bool tracked = metrics_frame_rendered(++frame_serial);
+	TRACE(TRACE_FRAME_END, frame_serial, 0);
+
+	/* A keypress highlights the indicator for one frame only. */
+	if (unlock_state == STATE_KEY_ACTIVE
+	||  unlock_state == STATE_BACKSPACE_ACTIVE)
+		unlock_state = STATE_KEY_PRESSED;
+
+	if (present_opcode) {
+		bg_pixmaps[bg_current].busy = true;
+		present_pixmap(conn, win, bg_pixmap, frame_serial,
+				last_msc ? last_msc + 1 : 0);
+		frame_in_flight = true;
+	} else {
+		xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
+		/* XXX: Possible optimization: Only update the area in the middle of the
+		 * screen instead of the whole screen. */
+		xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
+	}
 	xcb_flush(conn);
+	metrics_frame_flushed(frame_serial);
+
+	/* Without Present there is no completion event. When statistics are
+	 * collected, a round trip tells us at least when the server has
+	 * processed the frame. */
+	if (!present_opcode && tracked && stats_file[0] != '\0') {
+		xcb_aux_sync(conn);
+		metrics_frame_shown(frame_serial, now_usec());
+	}
+	alloc_frame_end();
+}
+
+/*
+ * Requests a redraw on the next vblank. Multiple requests before that are
+ * merged into a single frame, which shows the state at the time it is
+ * rendered.
+ *
+ */
+void schedule_redraw(void) {
+	frames_requested++;
+	if (frame_pending)
+		frames_merged++;
+	TRACE(TRACE_REDRAW_SCHEDULED, frame_pending, 0);
+	frame_pending = true;
+}
+
+static void frame_timeout_cb(EV_P_ ev_timer *w, int revents) {
+	TRACE(TRACE_FRAME_TIMEOUT, frame_serial, 0);
+	frame_in_flight = false;
+	for (int i = 0; i < BG_PIXMAPS; i++)
+		bg_pixmaps[i].busy = false;
+	flush_redraw();
+}
+
+/*
+ * Renders the frame requested with schedule_redraw(), unless the previous
+ * frame is still waiting for its vblank. Called before the event loop blocks.
+ *
+ */
+void flush_redraw(void) {
+	if (!frame_pending)
+		return;
+
+	if (frame_in_flight || bg_pixmaps[(bg_current + 1) % BG_PIXMAPS].busy) {
+		if (!ev_is_active(&frame_timeout)) {
+			ev_timer_init(&frame_timeout, frame_timeout_cb, 0.1, 0.);
+			ev_timer_start(EV_DEFAULT, &frame_timeout);
+		}
+		return;
+	}
+
+	if (ev_is_active(&frame_timeout))
+		ev_timer_stop(EV_DEFAULT, &frame_timeout);
+
+	redraw_screen();
+}
+
+/*
+ * Handles CompleteNotify and IdleNotify events of the Present extension.
+ * Returns false if the event does not belong to it.
+ *
+ */
+bool handle_present_event(xcb_generic_event_t *gevent) {
+	xcb_ge_generic_event_t *event = (xcb_ge_generic_event_t *)gevent;
+	if (present_opcode == 0 || event->extension != present_opcode)
+		return false;
+
+	switch (event->event_type) {
+	case XCB_PRESENT_EVENT_COMPLETE_NOTIFY: {
+		xcb_present_complete_notify_event_t *complete =
+			(xcb_present_complete_notify_event_t *)event;
+		if (complete->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+			break;
+
+		last_msc = complete->msc;
+		TRACE(TRACE_PRESENT_COMPLETE, complete->serial, complete->msc);
+		if (complete->mode != XCB_PRESENT_COMPLETE_MODE_SKIP)
+			metrics_frame_shown(complete->serial, complete->ust);
+
+		if (complete->serial == frame_serial)
+			frame_in_flight = false;
+		break;
+	}
+	case XCB_PRESENT_EVENT_IDLE_NOTIFY: {
+		xcb_present_idle_notify_event_t *idle =
+			(xcb_present_idle_notify_event_t *)event;
+		for (int i = 0; i < BG_PIXMAPS; i++)
+			if (bg_pixmaps[i].pixmap == idle->pixmap)
+				bg_pixmaps[i].busy = false;
+		break;
+	}
+	}
+
+	return true;
+}
+
+/*
+ * Without Present, the server repaints exposed parts of the window from its
+ * background pixmap. Presented content has to be presented again.
+ *
+ */
+void handle_expose(void) {
+	if (present_opcode)
+		schedule_redraw();
 }
 
 /*
@@ -942,11 +1345,11 @@ void clear_indicator(void) {
 		unlock_state = STATE_STARTED;
 	} else
 		unlock_state = STATE_KEY_PRESSED;
-	redraw_screen();
+	schedule_redraw();
 }
 
 static void time_redraw_cb(struct ev_loop *loop, ev_periodic *w, int revents) {
-	redraw_screen();
+	schedule_redraw();
 }
 
 void start_time_redraw_tick(struct ev_loop* main_loop) {
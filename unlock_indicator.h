@@ -1,15 +1,21 @@
 #ifndef _UNLOCK_INDICATOR_H
 #define _UNLOCK_INDICATOR_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <ev.h>
+#include <xcb/xcb.h>
+#include <cairo.h>
 
 typedef enum {
     STATE_STARTED = 0,         /* default state */
     STATE_KEY_PRESSED = 1,     /* key was pressed, show unlock indicator */
     STATE_KEY_ACTIVE = 2,      /* a key was pressed recently, highlight part
-                                   of the unlock indicator. */
+                                   of the unlock indicator in the next frame. */
     STATE_BACKSPACE_ACTIVE = 3 /* backspace was pressed recently, highlight
-                                   part of the unlock indicator in red. */
+                                   part of the unlock indicator in red in the
+                                   next frame. */
 } unlock_state_t;
 
 typedef enum {
@@ -20,8 +26,41 @@ typedef enum {
     STATE_I3LOCK_LOCK_FAILED = 4 /* i3lock failed to load */
 } auth_state_t;
 
+/* Time spent in the stages of render_frame(), in microseconds. */
+typedef struct render_timings {
+    uint64_t background;
+    uint64_t ring;
+    uint64_t status;
+    uint64_t keyboard;
+    uint64_t clock;
+    uint64_t composite;
+} render_timings_t;
+
+/* If set, render_frame() stores its stage timings here. */
+extern render_timings_t *render_timings;
+
+/*
+ * A surface render_frame() draws on, and which frame it shows. Zeroed, the
+ * next frame is drawn on it completely.
+ */
+typedef struct render_target {
+    uint64_t frame;
+    uint32_t resolution[2];
+} render_target_t;
+
+void render_frame(cairo_t *ctx, render_target_t *target, uint32_t *resolution,
+        const char *kb_layout, bool caps_lock, time_t now);
+void warm_up_fonts(void);
+const char *invalid_position_expr(void);
 xcb_pixmap_t draw_image(uint32_t* resolution);
+void free_bg_pixmaps(void);
+void settings_reloaded(const void *old);
+void init_present(void);
 void redraw_screen(void);
+void schedule_redraw(void);
+void flush_redraw(void);
+bool handle_present_event(xcb_generic_event_t *event);
+void handle_expose(void);
 void clear_indicator(void);
 void start_time_redraw_timeout(void);
 void start_time_redraw_tick(struct ev_loop*);
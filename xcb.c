@@ -8,10 +8,11 @@
  *
  */
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
-#include <xcb/xcb_aux.h>
 #include <xcb/composite.h>
+#include <xcb/present.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -20,11 +21,15 @@
 #include <assert.h>
 #include <err.h>
 #include <time.h>
+#include <ev.h>
 
+#include "i3lock.h"
 #include "cursors.h"
 #include "unlock_indicator.h"
+#include "metrics.h"
 
 extern auth_state_t auth_state;
+extern bool debug_mode;
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
@@ -157,94 +162,192 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     values[0] = XCB_STACK_MODE_ABOVE;
     xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    /* No need to wait for the server here: the replies to the grab requests
+     * sent next arrive only once the window is set up. */
+    xcb_flush(conn);
 
     return win;
 }
 
 /*
- * Repeatedly tries to grab pointer and keyboard (up to 10000 times).
+ * Grabbing pointer and keyboard fails as long as another client (e.g. an open
+ * menu) holds a grab. Failed grabs are retried with exponential backoff,
+ * starting at GRAB_BACKOFF_MIN seconds and doubling up to GRAB_BACKOFF_MAX,
+ * until GRAB_TIMEOUT seconds have passed.
  *
  */
-void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor) {
-    xcb_grab_pointer_cookie_t pcookie;
-    xcb_grab_pointer_reply_t *preply;
+#define GRAB_BACKOFF_MIN 0.001
+#define GRAB_BACKOFF_MAX 0.1
+#define GRAB_TIMEOUT 3.0
+
+/* Display the "locking…" message if grabbing takes longer than this. */
+#define GRAB_REDRAW_AFTER 0.25
+
+static struct grab {
+    struct ev_loop *loop;
+    xcb_connection_t *conn;
+    xcb_screen_t *screen;
+    xcb_cursor_t cursor;
+
+    ev_io reply_watcher;
+    ev_timer retry_timer;
 
+    /* Requests sent in the current attempt whose replies were not read yet. */
+    bool pointer_pending;
+    bool keyboard_pending;
+    xcb_grab_pointer_cookie_t pcookie;
     xcb_grab_keyboard_cookie_t kcookie;
-    xcb_grab_keyboard_reply_t *kreply;
 
-    int tries = 10000;
+    bool pointer_grabbed;
+    bool keyboard_grabbed;
 
-    /* Using few variables to trigger a redraw_screen() if too many tries */
-    bool redrawn = false;
-    time_t start = clock();
+    ev_tstamp start;
+    ev_tstamp backoff;
+    int retries;
+    bool redrawn;
+} grab;
 
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
+/*
+ * Requests whichever of the two grabs is still missing. Both requests go out
+ * together, so an attempt costs a single round trip. The X11 connection is
+ * watched until their replies are in.
+ *
+ */
+static void send_grab_requests(void) {
+    if (!grab.pointer_grabbed) {
+        grab.pcookie = xcb_grab_pointer(
+            grab.conn,
             false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
+            grab.screen->root,   /* grab the root window */
             XCB_NONE,            /* which events to let through */
             XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
             XCB_GRAB_MODE_ASYNC, /* keyboard mode */
             XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
+            grab.cursor,         /* we change the cursor to whatever the user wanted */
             XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
-        }
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        /* Measure elapsed time and trigger a screen redraw if elapsed > 250000 */
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            (clock() - start) > 250000) {
-            redraw_screen();
-            redrawn = true;
-        }
+        grab.pointer_pending = true;
     }
 
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
+    if (!grab.keyboard_grabbed) {
+        grab.kcookie = xcb_grab_keyboard(
+            grab.conn,
+            true,              /* report events */
+            grab.screen->root, /* grab the root window */
             XCB_CURRENT_TIME,
             XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
             XCB_GRAB_MODE_ASYNC);
+        grab.keyboard_pending = true;
+    }
 
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(kreply);
-            break;
-        }
+    xcb_flush(grab.conn);
+    ev_io_start(grab.loop, &grab.reply_watcher);
+}
 
-        /* Make this quite a bit slower */
-        usleep(50);
+static void grab_failed(void) {
+    auth_state = STATE_I3LOCK_LOCK_FAILED;
+    redraw_screen();
+    sleep(1);
+    errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+}
 
-        /* Measure elapsed time and trigger a screen redraw if elapsed > 250000 */
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            (clock() - start) > 250000) {
-            redraw_screen();
-            redrawn = true;
-        }
+/*
+ * Reads the replies of the current attempt, if they have arrived. Once both
+ * are in, either stops the event loop (both grabs succeeded) or schedules the
+ * next attempt.
+ *
+ */
+static void read_grab_replies(EV_P) {
+    void *reply;
+    xcb_generic_error_t *error;
+
+    /* Waiting for the next attempt, events are left in the queue. */
+    if (!grab.pointer_pending && !grab.keyboard_pending)
+        return;
+
+    if (grab.pointer_pending &&
+        xcb_poll_for_reply(grab.conn, grab.pcookie.sequence, &reply, &error)) {
+        xcb_grab_pointer_reply_t *preply = reply;
+        grab.pointer_grabbed = (preply && preply->status == XCB_GRAB_STATUS_SUCCESS);
+        grab.pointer_pending = false;
+        free(preply);
+        free(error);
+    }
+
+    if (grab.keyboard_pending &&
+        xcb_poll_for_reply(grab.conn, grab.kcookie.sequence, &reply, &error)) {
+        xcb_grab_keyboard_reply_t *kreply = reply;
+        grab.keyboard_grabbed = (kreply && kreply->status == XCB_GRAB_STATUS_SUCCESS);
+        grab.keyboard_pending = false;
+        free(kreply);
+        free(error);
+    }
+
+    if (grab.pointer_pending || grab.keyboard_pending)
+        return;
+
+    /* Nothing to read until the next attempt. */
+    ev_io_stop(EV_A_ &grab.reply_watcher);
+
+    if (grab.pointer_grabbed && grab.keyboard_grabbed) {
+        ev_break(EV_A_ EVBREAK_ONE);
+        return;
     }
 
-    /* After trying for 10000 times, i3lock will display an error message
-     * for 2 sec prior to terminate. */
-    if (tries <= 0) {
-        auth_state = STATE_I3LOCK_LOCK_FAILED;
+    ev_tstamp elapsed = ev_time() - grab.start;
+    if (elapsed > GRAB_TIMEOUT)
+        grab_failed();
+
+    if (!grab.redrawn && elapsed > GRAB_REDRAW_AFTER) {
         redraw_screen();
-        sleep(1);
-        errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+        grab.redrawn = true;
     }
+
+    grab.retries++;
+    ev_timer_set(&grab.retry_timer, grab.backoff, 0.);
+    ev_timer_start(EV_A_ &grab.retry_timer);
+    grab.backoff *= 2;
+    if (grab.backoff > GRAB_BACKOFF_MAX)
+        grab.backoff = GRAB_BACKOFF_MAX;
+}
+
+static void grab_reply_cb(EV_P_ ev_io *w, int revents) {
+    read_grab_replies(EV_A);
+}
+
+static void grab_retry_cb(EV_P_ ev_timer *w, int revents) {
+    send_grab_requests();
+    read_grab_replies(EV_A);
+}
+
+/*
+ * Grabs pointer and keyboard, retrying for up to GRAB_TIMEOUT seconds. Runs
+ * the given event loop (which must not have other watchers yet) until both
+ * grabs succeeded, so waiting for the replies or the next attempt does not
+ * block or spin. X11 events arriving meanwhile stay queued in the connection.
+ *
+ * Exits with an error message if the grabs cannot be acquired.
+ *
+ */
+void grab_pointer_and_keyboard(struct ev_loop *loop, xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor) {
+    grab.loop = loop;
+    grab.conn = conn;
+    grab.screen = screen;
+    grab.cursor = cursor;
+    grab.start = ev_time();
+    grab.backoff = GRAB_BACKOFF_MIN;
+
+    ev_io_init(&grab.reply_watcher, grab_reply_cb, xcb_get_file_descriptor(conn), EV_READ);
+    ev_timer_init(&grab.retry_timer, grab_retry_cb, 0., 0.);
+
+    send_grab_requests();
+    read_grab_replies(loop);
+    if (!grab.pointer_grabbed || !grab.keyboard_grabbed)
+        ev_run(loop, 0);
+
+    grab_usec = (uint64_t)((ev_time() - grab.start) * 1e6);
+    grab_retries = grab.retries;
+    DEBUG("grabbed pointer and keyboard after %d retries (%llu usec)\n",
+          grab_retries, (unsigned long long)grab_usec);
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
@@ -323,3 +426,71 @@ xcb_pixmap_t capture_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int3
     xcb_free_gc(conn, gc);
     return bg_pixmap;
 }
+
+/* The QueryVersion request sent by present_query_version(), if any. */
+static bool present_version_pending;
+static xcb_present_query_version_cookie_t present_version_cookie;
+
+/*
+ * Sends the Present QueryVersion request if the server has the extension.
+ * The reply is read by present_select_window(), so the request can share a
+ * round trip with the rest of the initialization.
+ *
+ */
+void present_query_version(xcb_connection_t *conn) {
+    const xcb_query_extension_reply_t *extension = xcb_get_extension_data(conn, &xcb_present_id);
+    if (!extension || !extension->present)
+        return;
+
+    present_version_cookie = xcb_present_query_version(conn, 1, 0);
+    present_version_pending = true;
+}
+
+/*
+ * Checks whether the server supports the Present extension and, if so, asks
+ * for CompleteNotify and IdleNotify events on the given window. Returns the
+ * major opcode of the extension (needed to recognize its events) or 0 if
+ * frames cannot be presented.
+ *
+ */
+uint8_t present_select_window(xcb_connection_t *conn, xcb_window_t win) {
+    const xcb_query_extension_reply_t *extension = xcb_get_extension_data(conn, &xcb_present_id);
+    if (!extension || !extension->present)
+        return 0;
+
+    if (!present_version_pending)
+        present_query_version(conn);
+    present_version_pending = false;
+
+    xcb_present_query_version_reply_t *reply =
+        xcb_present_query_version_reply(conn, present_version_cookie, NULL);
+    if (!reply)
+        return 0;
+    free(reply);
+
+    xcb_present_select_input(conn, xcb_generate_id(conn), win,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+
+    return extension->major_opcode;
+}
+
+/*
+ * Asks the server to copy (or flip) the pixmap to the window once the
+ * output reaches the given media stream counter, i.e. at a vblank.
+ *
+ */
+void present_pixmap(xcb_connection_t *conn, xcb_window_t win, xcb_pixmap_t pixmap,
+                    uint32_t serial, uint64_t target_msc) {
+    xcb_present_pixmap(conn, win, pixmap, serial,
+                       XCB_NONE, /* valid region: the whole pixmap */
+                       XCB_NONE, /* update region: the whole window */
+                       0, 0,     /* offset */
+                       XCB_NONE, /* target crtc: let the server pick */
+                       XCB_NONE, /* wait fence */
+                       XCB_NONE, /* idle fence */
+                       XCB_PRESENT_OPTION_NONE,
+                       target_msc,
+                       0, 0, /* divisor, remainder */
+                       0, NULL);
+}
@@ -2,6 +2,7 @@
 #define _XCB_H
 
 #include <xcb/xcb.h>
+#include <ev.h>
 
 extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
@@ -9,8 +10,11 @@ extern xcb_screen_t *screen;
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
-void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor);
+void grab_pointer_and_keyboard(struct ev_loop *loop, xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
 xcb_pixmap_t capture_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t* resolution);
+void present_query_version(xcb_connection_t *conn);
+uint8_t present_select_window(xcb_connection_t *conn, xcb_window_t win);
+void present_pixmap(xcb_connection_t *conn, xcb_window_t win, xcb_pixmap_t pixmap, uint32_t serial, uint64_t target_msc);
 
 #endif
@@ -26,38 +26,52 @@ Rect *xr_resolutions;
 static bool xinerama_active;
 extern bool debug_mode;
 
+/* Requests sent by xinerama_init() whose replies have not been read yet. */
+static bool init_pending;
+static xcb_xinerama_is_active_cookie_t active_cookie;
+static xcb_xinerama_query_screens_cookie_t screens_cookie;
+
+/*
+ * Asks the server whether Xinerama is active and for its screens. The
+ * replies are read by the first xinerama_query_screens(), so other requests
+ * can be sent in the meantime.
+ *
+ */
 void xinerama_init(void) {
     if (!xcb_get_extension_data(conn, &xcb_xinerama_id)->present) {
         DEBUG("Xinerama extension not found, disabling.\n");
         return;
     }
 
-    xcb_xinerama_is_active_cookie_t cookie;
-    xcb_xinerama_is_active_reply_t *reply;
-
-    cookie = xcb_xinerama_is_active(conn);
-    reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
-    if (!reply)
-        return;
-
-    if (!reply->state) {
-        free(reply);
-        return;
-    }
-
-    xinerama_active = true;
-    free(reply);
+    active_cookie = xcb_xinerama_is_active(conn);
+    screens_cookie = xcb_xinerama_query_screens_unchecked(conn);
+    init_pending = true;
 }
 
 void xinerama_query_screens(void) {
-    if (!xinerama_active)
-        return;
-
     xcb_xinerama_query_screens_cookie_t cookie;
     xcb_xinerama_query_screens_reply_t *reply;
     xcb_xinerama_screen_info_t *screen_info;
 
-    cookie = xcb_xinerama_query_screens_unchecked(conn);
+    if (init_pending) {
+        init_pending = false;
+
+        xcb_xinerama_is_active_reply_t *active_reply;
+        active_reply = xcb_xinerama_is_active_reply(conn, active_cookie, NULL);
+        xinerama_active = (active_reply && active_reply->state);
+        free(active_reply);
+
+        if (!xinerama_active) {
+            xcb_discard_reply(conn, screens_cookie.sequence);
+            return;
+        }
+        cookie = screens_cookie;
+    } else {
+        if (!xinerama_active)
+            return;
+        cookie = xcb_xinerama_query_screens_unchecked(conn);
+    }
+
     reply = xcb_xinerama_query_screens_reply(conn, cookie, NULL);
     if (!reply) {
         if (debug_mode)